@@ -572,6 +572,8 @@ void RetireJitBlock(JitBlock* block)
 
 void CompileBlock(ARM* cpu)
 {
+    NDS::PerfScope perf(NDS::Perf_JIT);
+
     bool thumb = cpu->CPSR & 0x20;
 
     if (Config::JIT_MaxBlockSize < 1)
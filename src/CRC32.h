@@ -21,6 +21,7 @@
 
 #include "types.h"
 
-u32 CRC32(u8* data, int len);
+// pass the result of a previous call as 'start' to continue a CRC over several blocks
+u32 CRC32(u8* data, int len, u32 start = 0);
 
 #endif // CRC32_H
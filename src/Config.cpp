@@ -46,6 +46,9 @@ char DSiBIOS7Path[1024];
 char DSiFirmwarePath[1024];
 char DSiNANDPath[1024];
 
+int DSiDSPThreaded;
+int DSiDSPMaxLag;
+
 int RandomizeMAC;
 int AudioBitrate;
 
@@ -77,6 +80,9 @@ ConfigEntry ConfigFile[] =
     {"DSiFirmwarePath", 1, DSiFirmwarePath, 0, "", 1023},
     {"DSiNANDPath", 1, DSiNANDPath, 0, "", 1023},
 
+    {"DSiDSPThreaded", 0, &DSiDSPThreaded, 0, NULL, 0},
+    {"DSiDSPMaxLag", 0, &DSiDSPMaxLag, 65536, NULL, 0},
+
     {"RandomizeMAC", 0, &RandomizeMAC, 0, NULL, 0},
     {"AudioBitrate", 0, &AudioBitrate, 0, NULL, 0},
 
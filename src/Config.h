@@ -59,6 +59,9 @@ extern char DSiBIOS7Path[1024];
 extern char DSiFirmwarePath[1024];
 extern char DSiNANDPath[1024];
 
+extern int DSiDSPThreaded;
+extern int DSiDSPMaxLag;
+
 extern int RandomizeMAC;
 extern int AudioBitrate;
 
@@ -19,6 +19,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <inttypes.h>
+#include <vector>
 #include "Config.h"
 #include "NDS.h"
 #include "DSi.h"
@@ -268,24 +269,16 @@ void DecryptModcryptArea(u32 offset, u32 size, u8* iv)
 
 #undef BINARY_GOOD
 
-    for (u32 i = 0; i < size; i+=16)
-    {
-        u8 data[16];
+    // decrypt the whole area in one go
+    std::vector<u8> data(roundedsize);
 
-        *(u32*)&data[0] = ARM9Read32(binaryaddr+i);
-        *(u32*)&data[4] = ARM9Read32(binaryaddr+i+4);
-        *(u32*)&data[8] = ARM9Read32(binaryaddr+i+8);
-        *(u32*)&data[12] = ARM9Read32(binaryaddr+i+12);
+    for (u32 i = 0; i < roundedsize; i+=4)
+        *(u32*)&data[i] = ARM9Read32(binaryaddr+i);
 
-        DSi_AES::Swap16(tmp, data);
-        AES_CTR_xcrypt_buffer(&ctx, tmp, 16);
-        DSi_AES::Swap16(data, tmp);
+    DSi_AES::CTR_CryptSwapped(&ctx, data.data(), roundedsize);
 
-        ARM9Write32(binaryaddr+i, *(u32*)&data[0]);
-        ARM9Write32(binaryaddr+i+4, *(u32*)&data[4]);
-        ARM9Write32(binaryaddr+i+8, *(u32*)&data[8]);
-        ARM9Write32(binaryaddr+i+12, *(u32*)&data[12]);
-    }
+    for (u32 i = 0; i < roundedsize; i+=4)
+        ARM9Write32(binaryaddr+i, *(u32*)&data[i]);
 }
 
 void SetupDirectBoot()
@@ -750,21 +743,17 @@ bool LoadNAND()
 
     AES_init_ctx_iv(&ctx, boot2key, boot2iv);
 
+    u32 len = (bootparams[3] + 0xF) & ~0xF;
+    std::vector<u8> data(len);
+
     fseek(SDMMCFile, bootparams[0], SEEK_SET);
+    fread(data.data(), len, 1, SDMMCFile);
+    DSi_AES::CTR_CryptSwapped(&ctx, data.data(), len);
+
     dstaddr = bootparams[2];
-    for (u32 i = 0; i < bootparams[3]; i += 16)
+    for (u32 i = 0; i < len; i += 4)
     {
-        u8 data[16];
-        fread(data, 16, 1, SDMMCFile);
-
-        for (int j = 0; j < 16; j++) tmp[j] = data[15-j];
-        AES_CTR_xcrypt_buffer(&ctx, tmp, 16);
-        for (int j = 0; j < 16; j++) data[j] = tmp[15-j];
-
-        ARM9Write32(dstaddr, *(u32*)&data[0]); dstaddr += 4;
-        ARM9Write32(dstaddr, *(u32*)&data[4]); dstaddr += 4;
-        ARM9Write32(dstaddr, *(u32*)&data[8]); dstaddr += 4;
-        ARM9Write32(dstaddr, *(u32*)&data[12]); dstaddr += 4;
+        ARM9Write32(dstaddr, *(u32*)&data[i]); dstaddr += 4;
     }
 
     *(u32*)&tmp[0] = bootparams[7];
@@ -775,21 +764,17 @@ bool LoadNAND()
 
     AES_init_ctx_iv(&ctx, boot2key, boot2iv);
 
+    len = (bootparams[7] + 0xF) & ~0xF;
+    data.resize(len);
+
     fseek(SDMMCFile, bootparams[4], SEEK_SET);
+    fread(data.data(), len, 1, SDMMCFile);
+    DSi_AES::CTR_CryptSwapped(&ctx, data.data(), len);
+
     dstaddr = bootparams[6];
-    for (u32 i = 0; i < bootparams[7]; i += 16)
+    for (u32 i = 0; i < len; i += 4)
     {
-        u8 data[16];
-        fread(data, 16, 1, SDMMCFile);
-
-        for (int j = 0; j < 16; j++) tmp[j] = data[15-j];
-        AES_CTR_xcrypt_buffer(&ctx, tmp, 16);
-        for (int j = 0; j < 16; j++) data[j] = tmp[15-j];
-
-        ARM7Write32(dstaddr, *(u32*)&data[0]); dstaddr += 4;
-        ARM7Write32(dstaddr, *(u32*)&data[4]); dstaddr += 4;
-        ARM7Write32(dstaddr, *(u32*)&data[8]); dstaddr += 4;
-        ARM7Write32(dstaddr, *(u32*)&data[12]); dstaddr += 4;
+        ARM7Write32(dstaddr, *(u32*)&data[i]); dstaddr += 4;
     }
 
     // repoint the CPUs to the boot2 binaries
@@ -18,12 +18,25 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <algorithm>
 #include "DSi.h"
 #include "DSi_AES.h"
 #include "FIFO.h"
 #include "tiny-AES-c/aes.hpp"
 #include "Platform.h"
 
+#if defined(__x86_64__) || defined(_M_X64)
+    #define AESNI_SUPPORTED
+    #include <immintrin.h>
+    #ifdef _MSC_VER
+        #include <intrin.h>
+        #define AESNI_TARGET
+    #else
+        #include <cpuid.h>
+        #define AESNI_TARGET __attribute__((target("aes,ssse3")))
+    #endif
+#endif
+
 
 namespace DSi_AES
 {
@@ -83,6 +96,199 @@ void ROL16(u8* val, u32 n)
     }
 }
 
+
+// host AES
+// tiny-AES-c keeps the expanded key in the standard layout, so AES-NI can
+// use its contexts as they are. only AES-128 is used here.
+
+#ifdef AESNI_SUPPORTED
+
+bool DetectAESNI()
+{
+    // CPUID 1, ECX: bit 9 = SSSE3, bit 25 = AES
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    u32 ecx = info[2];
+#else
+    u32 eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return false;
+#endif
+
+    return (ecx & (1<<9)) && (ecx & (1<<25));
+}
+
+AESNI_TARGET
+inline __m128i AESNI_Encrypt(const __m128i* rk, __m128i block)
+{
+    block = _mm_xor_si128(block, rk[0]);
+    for (int i = 1; i < 10; i++)
+        block = _mm_aesenc_si128(block, rk[i]);
+    return _mm_aesenclast_si128(block, rk[10]);
+}
+
+AESNI_TARGET
+inline __m128i AESNI_NextCounter(u64& hi, u64& lo)
+{
+    const __m128i reverse = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+
+    // the counter is a 128-bit big-endian number
+    __m128i ret = _mm_shuffle_epi8(_mm_set_epi64x(hi, lo), reverse);
+    if (++lo == 0) hi++;
+    return ret;
+}
+
+AESNI_TARGET
+void AESNI_ECB_Encrypt(AES_ctx* ctx, u8* block)
+{
+    __m128i rk[11];
+    for (int i = 0; i < 11; i++)
+        rk[i] = _mm_loadu_si128((__m128i*)&ctx->RoundKey[i*16]);
+
+    __m128i data = _mm_loadu_si128((__m128i*)block);
+    _mm_storeu_si128((__m128i*)block, AESNI_Encrypt(rk, data));
+}
+
+AESNI_TARGET
+void AESNI_CTR_Crypt(AES_ctx* ctx, u8* data, u32 len, bool swapped)
+{
+    __m128i rk[11];
+    for (int i = 0; i < 11; i++)
+        rk[i] = _mm_loadu_si128((__m128i*)&ctx->RoundKey[i*16]);
+
+    const __m128i reverse = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+
+    u64 ctrhi = 0, ctrlo = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        ctrhi = (ctrhi << 8) | ctx->Iv[i];
+        ctrlo = (ctrlo << 8) | ctx->Iv[8+i];
+    }
+
+    // four blocks at a time keeps the AES units busy
+    u32 i = 0;
+    for (; (i + 64) <= len; i += 64)
+    {
+        __m128i ks0 = _mm_xor_si128(AESNI_NextCounter(ctrhi, ctrlo), rk[0]);
+        __m128i ks1 = _mm_xor_si128(AESNI_NextCounter(ctrhi, ctrlo), rk[0]);
+        __m128i ks2 = _mm_xor_si128(AESNI_NextCounter(ctrhi, ctrlo), rk[0]);
+        __m128i ks3 = _mm_xor_si128(AESNI_NextCounter(ctrhi, ctrlo), rk[0]);
+
+        for (int r = 1; r < 10; r++)
+        {
+            ks0 = _mm_aesenc_si128(ks0, rk[r]);
+            ks1 = _mm_aesenc_si128(ks1, rk[r]);
+            ks2 = _mm_aesenc_si128(ks2, rk[r]);
+            ks3 = _mm_aesenc_si128(ks3, rk[r]);
+        }
+
+        ks0 = _mm_aesenclast_si128(ks0, rk[10]);
+        ks1 = _mm_aesenclast_si128(ks1, rk[10]);
+        ks2 = _mm_aesenclast_si128(ks2, rk[10]);
+        ks3 = _mm_aesenclast_si128(ks3, rk[10]);
+
+        if (swapped)
+        {
+            ks0 = _mm_shuffle_epi8(ks0, reverse);
+            ks1 = _mm_shuffle_epi8(ks1, reverse);
+            ks2 = _mm_shuffle_epi8(ks2, reverse);
+            ks3 = _mm_shuffle_epi8(ks3, reverse);
+        }
+
+        __m128i* blocks = (__m128i*)&data[i];
+        _mm_storeu_si128(&blocks[0], _mm_xor_si128(_mm_loadu_si128(&blocks[0]), ks0));
+        _mm_storeu_si128(&blocks[1], _mm_xor_si128(_mm_loadu_si128(&blocks[1]), ks1));
+        _mm_storeu_si128(&blocks[2], _mm_xor_si128(_mm_loadu_si128(&blocks[2]), ks2));
+        _mm_storeu_si128(&blocks[3], _mm_xor_si128(_mm_loadu_si128(&blocks[3]), ks3));
+    }
+
+    for (; i < len; i += 16)
+    {
+        __m128i ks = AESNI_Encrypt(rk, AESNI_NextCounter(ctrhi, ctrlo));
+        if (swapped)
+            ks = _mm_shuffle_epi8(ks, reverse);
+
+        if ((i + 16) <= len)
+        {
+            __m128i* block = (__m128i*)&data[i];
+            _mm_storeu_si128(block, _mm_xor_si128(_mm_loadu_si128(block), ks));
+        }
+        else
+        {
+            // partial block, the rest of the keystream is thrown away
+            u8 tmp[16];
+            _mm_storeu_si128((__m128i*)tmp, ks);
+            for (u32 j = 0; j < (len - i); j++)
+                data[i+j] ^= tmp[j];
+        }
+    }
+
+    for (int i = 0; i < 8; i++)
+    {
+        ctx->Iv[7-i] = ctrhi >> (i*8);
+        ctx->Iv[15-i] = ctrlo >> (i*8);
+    }
+}
+
+#endif // AESNI_SUPPORTED
+
+bool HasAESNI()
+{
+#ifdef AESNI_SUPPORTED
+    static const bool hasaesni = DetectAESNI();
+    return hasaesni;
+#else
+    return false;
+#endif
+}
+
+void ECB_Encrypt(AES_ctx* ctx, u8* block)
+{
+#ifdef AESNI_SUPPORTED
+    if (HasAESNI())
+    {
+        AESNI_ECB_Encrypt(ctx, block);
+        return;
+    }
+#endif
+
+    AES_ECB_encrypt(ctx, block);
+}
+
+void CTR_Crypt(AES_ctx* ctx, u8* data, u32 len)
+{
+#ifdef AESNI_SUPPORTED
+    if (HasAESNI())
+    {
+        AESNI_CTR_Crypt(ctx, data, len, false);
+        return;
+    }
+#endif
+
+    AES_CTR_xcrypt_buffer(ctx, data, len);
+}
+
+void CTR_CryptSwapped(AES_ctx* ctx, u8* data, u32 len)
+{
+#ifdef AESNI_SUPPORTED
+    if (HasAESNI())
+    {
+        AESNI_CTR_Crypt(ctx, data, len, true);
+        return;
+    }
+#endif
+
+    for (u32 i = 0; i < len; i += 16)
+    {
+        u8 tmp[16];
+        Swap16(tmp, &data[i]);
+        AES_CTR_xcrypt_buffer(ctx, tmp, 16);
+        Swap16(&data[i], tmp);
+    }
+}
+
+
 #define _printhex(str, size) { for (int z = 0; z < (size); z++) printf("%02X", (str)[z]); printf("\n"); }
 #define _printhex2(str, size) { for (int z = 0; z < (size); z++) printf("%02X", (str)[z]); }
 
@@ -169,87 +375,62 @@ void ProcessBlock_CCM_Extra()
     Swap16(data_rev, data);
 
     for (int i = 0; i < 16; i++) CurMAC[i] ^= data_rev[i];
-    AES_ECB_encrypt(&Ctx, CurMAC);
+    ECB_Encrypt(&Ctx, CurMAC);
 }
 
-void ProcessBlock_CCM_Decrypt()
-{
-    u8 data[16];
-    u8 data_rev[16];
-
-    *(u32*)&data[0] = InputFIFO.Read();
-    *(u32*)&data[4] = InputFIFO.Read();
-    *(u32*)&data[8] = InputFIFO.Read();
-    *(u32*)&data[12] = InputFIFO.Read();
-
-    //printf("AES-CCM: "); _printhex2(data, 16);
-
-    Swap16(data_rev, data);
-
-    AES_CTR_xcrypt_buffer(&Ctx, data_rev, 16);
-    for (int i = 0; i < 16; i++) CurMAC[i] ^= data_rev[i];
-    AES_ECB_encrypt(&Ctx, CurMAC);
-
-    Swap16(data, data_rev);
-
-    //printf(" -> "); _printhex2(data, 16);
+// blocks are processed in batches of up to 4 (a full FIFO)
 
-    OutputFIFO.Write(*(u32*)&data[0]);
-    OutputFIFO.Write(*(u32*)&data[4]);
-    OutputFIFO.Write(*(u32*)&data[8]);
-    OutputFIFO.Write(*(u32*)&data[12]);
+void ReadBlocks(u8* data, u32 num)
+{
+    for (u32 i = 0; i < num*16; i += 4)
+        *(u32*)&data[i] = InputFIFO.Read();
 }
 
-void ProcessBlock_CCM_Encrypt()
+void WriteBlocks(u8* data, u32 num)
 {
-    u8 data[16];
-    u8 data_rev[16];
-
-    *(u32*)&data[0] = InputFIFO.Read();
-    *(u32*)&data[4] = InputFIFO.Read();
-    *(u32*)&data[8] = InputFIFO.Read();
-    *(u32*)&data[12] = InputFIFO.Read();
-
-    //printf("AES-CCM: "); _printhex2(data, 16);
-
-    Swap16(data_rev, data);
+    for (u32 i = 0; i < num*16; i += 4)
+        OutputFIFO.Write(*(u32*)&data[i]);
+}
 
-    for (int i = 0; i < 16; i++) CurMAC[i] ^= data_rev[i];
-    AES_CTR_xcrypt_buffer(&Ctx, data_rev, 16);
-    AES_ECB_encrypt(&Ctx, CurMAC);
+void UpdateMAC(u8* data, u32 num)
+{
+    for (u32 b = 0; b < num*16; b += 16)
+    {
+        for (int i = 0; i < 16; i++) CurMAC[i] ^= data[b+15-i];
+        ECB_Encrypt(&Ctx, CurMAC);
+    }
+}
 
-    Swap16(data, data_rev);
+void ProcessBlocks_CCM_Decrypt(u32 num)
+{
+    u8 data[64];
+    ReadBlocks(data, num);
 
-    //printf(" -> "); _printhex2(data, 16);
+    CTR_CryptSwapped(&Ctx, data, num*16);
+    UpdateMAC(data, num);
 
-    OutputFIFO.Write(*(u32*)&data[0]);
-    OutputFIFO.Write(*(u32*)&data[4]);
-    OutputFIFO.Write(*(u32*)&data[8]);
-    OutputFIFO.Write(*(u32*)&data[12]);
+    WriteBlocks(data, num);
 }
 
-void ProcessBlock_CTR()
+void ProcessBlocks_CCM_Encrypt(u32 num)
 {
-    u8 data[16];
-    u8 data_rev[16];
+    u8 data[64];
+    ReadBlocks(data, num);
 
-    *(u32*)&data[0] = InputFIFO.Read();
-    *(u32*)&data[4] = InputFIFO.Read();
-    *(u32*)&data[8] = InputFIFO.Read();
-    *(u32*)&data[12] = InputFIFO.Read();
+    UpdateMAC(data, num);
+    CTR_CryptSwapped(&Ctx, data, num*16);
 
-    //printf("AES-CTR: "); _printhex2(data, 16);
+    WriteBlocks(data, num);
+}
 
-    Swap16(data_rev, data);
-    AES_CTR_xcrypt_buffer(&Ctx, data_rev, 16);
-    Swap16(data, data_rev);
+void ProcessBlocks_CTR(u32 num)
+{
+    u8 data[64];
+    ReadBlocks(data, num);
 
-    //printf(" -> "); _printhex(data, 16);
+    CTR_CryptSwapped(&Ctx, data, num*16);
 
-    OutputFIFO.Write(*(u32*)&data[0]);
-    OutputFIFO.Write(*(u32*)&data[4]);
-    OutputFIFO.Write(*(u32*)&data[8]);
-    OutputFIFO.Write(*(u32*)&data[12]);
+    WriteBlocks(data, num);
 }
 
 
@@ -324,7 +505,7 @@ void WriteCnt(u32 val)
                 iv[15] = RemBlocks << 4;
 
                 memcpy(CurMAC, iv, 16);
-                AES_ECB_encrypt(&Ctx, CurMAC);
+                ECB_Encrypt(&Ctx, CurMAC);
             }
             else
             {
@@ -430,17 +611,19 @@ void Update()
 
     if (RemExtra == 0)
     {
-        while (InputFIFO.Level() >= 4 && OutputFIFO.Level() <= 12 && RemBlocks > 0)
+        // everything the FIFOs allow for is done in one go
+        u32 num = std::min({InputFIFO.Level() >> 2, (16 - OutputFIFO.Level()) >> 2, RemBlocks});
+        if (num > 0)
         {
             switch (AESMode)
             {
-            case 0: ProcessBlock_CCM_Decrypt(); break;
-            case 1: ProcessBlock_CCM_Encrypt(); break;
+            case 0: ProcessBlocks_CCM_Decrypt(num); break;
+            case 1: ProcessBlocks_CCM_Encrypt(num); break;
             case 2:
-            case 3: ProcessBlock_CTR(); break;
+            case 3: ProcessBlocks_CTR(num); break;
             }
 
-            RemBlocks--;
+            RemBlocks -= num;
         }
     }
 
@@ -453,7 +636,7 @@ void Update()
             Ctx.Iv[13] = 0x00;
             Ctx.Iv[14] = 0x00;
             Ctx.Iv[15] = 0x00;
-            AES_CTR_xcrypt_buffer(&Ctx, CurMAC, 16);
+            CTR_Crypt(&Ctx, CurMAC, 16);
 
             //printf("FINAL MAC: "); _printhexR(CurMAC, 16);
             //printf("INPUT MAC: "); _printhex(MAC, 16);
@@ -469,7 +652,7 @@ void Update()
             Ctx.Iv[13] = 0x00;
             Ctx.Iv[14] = 0x00;
             Ctx.Iv[15] = 0x00;
-            AES_CTR_xcrypt_buffer(&Ctx, CurMAC, 16);
+            CTR_Crypt(&Ctx, CurMAC, 16);
 
             Swap16(OutputMAC, CurMAC);
 
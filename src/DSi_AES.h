@@ -21,6 +21,8 @@
 
 #include "types.h"
 
+struct AES_ctx;
+
 namespace DSi_AES
 {
 
@@ -49,6 +51,15 @@ void WriteKeyY(u32 slot, u32 offset, u32 val, u32 mask);
 void Swap16(u8* dst, u8* src);
 void DeriveNormalKey(u8* keyX, u8* keyY, u8* normalkey);
 
+// AES on the host side, for tiny-AES-c contexts
+// uses AES-NI when the host CPU has it
+bool HasAESNI();
+void ECB_Encrypt(AES_ctx* ctx, u8* block);
+void CTR_Crypt(AES_ctx* ctx, u8* data, u32 len);
+// the same, for data where every 16-byte block is stored backwards
+// like the DSi does (len must be a multiple of 16)
+void CTR_CryptSwapped(AES_ctx* ctx, u8* data, u32 len);
+
 }
 
 #endif // DSI_AES_H
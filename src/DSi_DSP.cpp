@@ -16,12 +16,17 @@
     with melonDS. If not, see http://www.gnu.org/licenses/.
 */
 
+#include <algorithm>
+#include <atomic>
+
 #include "teakra/include/teakra/teakra.h"
 
 #include "DSi.h"
 #include "DSi_DSP.h"
 #include "FIFO.h"
 #include "NDS.h"
+#include "Config.h"
+#include "Platform.h"
 
 
 namespace DSi_DSP
@@ -41,6 +46,7 @@ u16 DSP_CMD[3];
 u16 DSP_REP[3];
 
 u64 DSPTimestamp;
+u64 DSPIdleUntil; // the DSP can't change anything the ARM9 sees before this
 
 FIFO<u16, 16> PDATAReadFifo/*, *PDATAWriteFifo*/;
 int PDataDMALen = 0;
@@ -48,6 +54,90 @@ int PDataDMALen = 0;
 constexpr u32 DataMemoryOffset = 0x20000; // from Teakra memory_interface.h
 // NOTE: ^ IS IN DSP WORDS, NOT IN BYTES!
 
+/*
+    Threaded mode
+
+    the DSP can run on a thread of its own, trailing behind the ARM9. the
+    DSP event only hands it a new target time, and the ARM9 only waits when
+    the DSP falls more than DSiDSPMaxLag cycles behind. accesses to the DSP
+    registers and NWRAM remaps still wait for the DSP to catch up fully, so
+    the ARM9 always sees it in the same state as when it runs inline.
+
+    while it runs on its thread, the DSP can't touch anything that belongs
+    to the ARM9 side: its IRQs are raised once the ARM9 catches up with it,
+    and its AHBM accesses are handed over to the ARM9 thread, except reads
+    from main RAM which are done directly.
+*/
+
+const u32 ThreadSlice = 4096; // how often the DSP thread reports progress
+const u64 MaxIdleDelay = 1<<22; // longest wait between DSP events, in system cycles
+
+Platform::Thread* DSPThread;
+std::atomic<bool> DSPThreadRunning;
+Platform::Semaphore* Sema_DSPStart;    // new target for the DSP thread
+Platform::Semaphore* Sema_DSPProgress; // DSP thread made progress, or wants the bus
+std::atomic<bool> ARM9Waiting; // Sema_DSPProgress is only posted when this is set
+Platform::Semaphore* Sema_BusDone;
+u64 DSPMaxLag;
+
+std::atomic<u64> DSPTarget;
+std::atomic<u64> DSPProgress;
+std::atomic<bool> OnDSPThread;
+// the DSP thread is parked once it has gone through every target it was
+// posted, from then on only the ARM9 side touches DSPTimestamp and TeakraCore
+u32 DSPTargetsPosted;
+std::atomic<u32> DSPTargetsDone;
+
+enum
+{
+    PendingIRQ_Rep0 = 1<<0,
+    PendingIRQ_Rep1 = 1<<1,
+    PendingIRQ_Rep2 = 1<<2,
+    PendingIRQ_Sem  = 1<<3,
+};
+std::atomic<u32> PendingIRQ;
+
+struct
+{
+    int Size;
+    bool Write;
+    u32 Addr;
+    u32 Value;
+} BusRequest;
+std::atomic<bool> BusRequestPending;
+bool ServicingBus;
+
+inline bool IsDSPCoreEnabled();
+void ScheduleDSPEvent();
+void WakeDSP();
+void ServiceBusRequest();
+
+// the ARM9 thread flags itself before it waits on Sema_DSPProgress, so that
+// the DSP thread doesn't pile up posts nobody is going to take
+void WakeARM9()
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (ARM9Waiting.exchange(false))
+        Platform::Semaphore_Post(Sema_DSPProgress);
+}
+
+template <typename T>
+void WaitOnDSPThread(T done)
+{
+    while (!done())
+    {
+        ARM9Waiting.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        // check again now that we're flagged, or a wakeup could be missed
+        if (!done() && !BusRequestPending.load(std::memory_order_acquire))
+            Platform::Semaphore_Wait(Sema_DSPProgress);
+
+        ARM9Waiting.store(false, std::memory_order_relaxed);
+        ServiceBusRequest();
+    }
+}
+
 u16 GetPSTS()
 {
     u16 r = DSP_PSTS & (1<<9); // this is the only sticky bit
@@ -67,30 +157,278 @@ u16 GetPSTS()
     return r;
 }
 
+bool DeferIRQ(u32 irq)
+{
+    if (!OnDSPThread.load(std::memory_order_relaxed))
+        return false;
+
+    PendingIRQ.fetch_or(irq, std::memory_order_relaxed);
+    return true;
+}
+
 void IrqRep0()
 {
+    if (DeferIRQ(PendingIRQ_Rep0)) return;
     if (DSP_PCFG & (1<< 9)) NDS::SetIRQ(0, NDS::IRQ_DSi_DSP);
 }
 void IrqRep1()
 {
+    if (DeferIRQ(PendingIRQ_Rep1)) return;
     if (DSP_PCFG & (1<<10)) NDS::SetIRQ(0, NDS::IRQ_DSi_DSP);
 }
 void IrqRep2()
 {
+    if (DeferIRQ(PendingIRQ_Rep2)) return;
     if (DSP_PCFG & (1<<11)) NDS::SetIRQ(0, NDS::IRQ_DSi_DSP);
 }
 void IrqSem()
 {
+    if (DeferIRQ(PendingIRQ_Sem)) return;
     DSP_PSTS |= 1<<9;
     // apparently these are always fired?
     NDS::SetIRQ(0, NDS::IRQ_DSi_DSP);
 }
 
+void ApplyPendingIRQs()
+{
+    u32 irq = PendingIRQ.exchange(0);
+    if (!irq) return;
+
+    if (irq & PendingIRQ_Rep0) IrqRep0();
+    if (irq & PendingIRQ_Rep1) IrqRep1();
+    if (irq & PendingIRQ_Rep2) IrqRep2();
+    if (irq & PendingIRQ_Sem) IrqSem();
+}
+
+// AHBM accesses from the DSP thread are done by the ARM9 thread
+u32 RequestBus(int size, bool write, u32 addr, u32 val)
+{
+    BusRequest.Size = size;
+    BusRequest.Write = write;
+    BusRequest.Addr = addr;
+    BusRequest.Value = val;
+    BusRequestPending.store(true, std::memory_order_release);
+    WakeARM9();
+
+    while (BusRequestPending.load(std::memory_order_acquire))
+        Platform::Semaphore_Wait(Sema_BusDone);
+
+    return BusRequest.Value;
+}
+
+void ServiceBusRequest()
+{
+    if (!BusRequestPending.load(std::memory_order_acquire))
+        return;
+
+    // the DSP thread is stopped in the middle of an instruction until this is
+    // done, so waiting for it from here would never end
+    ServicingBus = true;
+
+    u32 addr = BusRequest.Addr;
+    u32 val = BusRequest.Value;
+    if (BusRequest.Write)
+    {
+        switch (BusRequest.Size)
+        {
+        case 8: DSi::ARM9Write8(addr, val); break;
+        case 16: DSi::ARM9Write16(addr, val); break;
+        case 32: DSi::ARM9Write32(addr, val); break;
+        }
+    }
+    else
+    {
+        switch (BusRequest.Size)
+        {
+        case 8: BusRequest.Value = DSi::ARM9Read8(addr); break;
+        case 16: BusRequest.Value = DSi::ARM9Read16(addr); break;
+        case 32: BusRequest.Value = DSi::ARM9Read32(addr); break;
+        }
+    }
+
+    ServicingBus = false;
+    BusRequestPending.store(false, std::memory_order_release);
+    Platform::Semaphore_Post(Sema_BusDone);
+}
+
+// reading main RAM has no side effects, the DSP thread can do it alone
+// (except for the one word DSi::ARM9Read32() patches)
+inline bool DirectBusRead(u32 addr)
+{
+    return OnDSPThread.load(std::memory_order_relaxed)
+        && (addr & 0xFF000000) == 0x02000000 && addr != 0x02FE71B0;
+}
+
+u8 BusRead8(u32 addr)
+{
+    if (DirectBusRead(addr))
+        return *(u8*)&NDS::MainRAM[addr & NDS::MainRAMMask];
+    if (OnDSPThread.load(std::memory_order_relaxed))
+        return RequestBus(8, false, addr, 0);
+    return DSi::ARM9Read8(addr);
+}
+u16 BusRead16(u32 addr)
+{
+    if (DirectBusRead(addr))
+        return *(u16*)&NDS::MainRAM[addr & NDS::MainRAMMask];
+    if (OnDSPThread.load(std::memory_order_relaxed))
+        return RequestBus(16, false, addr, 0);
+    return DSi::ARM9Read16(addr);
+}
+u32 BusRead32(u32 addr)
+{
+    if (DirectBusRead(addr))
+        return *(u32*)&NDS::MainRAM[addr & NDS::MainRAMMask];
+    if (OnDSPThread.load(std::memory_order_relaxed))
+        return RequestBus(32, false, addr, 0);
+    return DSi::ARM9Read32(addr);
+}
+void BusWrite8(u32 addr, u8 val)
+{
+    if (OnDSPThread.load(std::memory_order_relaxed))
+        RequestBus(8, true, addr, val);
+    else
+        DSi::ARM9Write8(addr, val);
+}
+void BusWrite16(u32 addr, u16 val)
+{
+    if (OnDSPThread.load(std::memory_order_relaxed))
+        RequestBus(16, true, addr, val);
+    else
+        DSi::ARM9Write16(addr, val);
+}
+void BusWrite32(u32 addr, u32 val)
+{
+    if (OnDSPThread.load(std::memory_order_relaxed))
+        RequestBus(32, true, addr, val);
+    else
+        DSi::ARM9Write32(addr, val);
+}
+
 void AudioCb(std::array<s16, 2> frame)
 {
     // TODO
 }
 
+void SetDSPTimestamp(u64 time)
+{
+    // only while the DSP thread is parked
+    DSPTimestamp = time;
+    DSPTarget.store(time, std::memory_order_relaxed);
+    DSPProgress.store(time, std::memory_order_relaxed);
+}
+
+void DSPThreadFunc()
+{
+    for (;;)
+    {
+        Platform::Semaphore_Wait(Sema_DSPStart);
+        if (!DSPThreadRunning.load(std::memory_order_relaxed))
+            break;
+
+        u64 target;
+        while (DSPTimestamp < (target = DSPTarget.load(std::memory_order_acquire)))
+        {
+            u64 backlog = target - DSPTimestamp;
+            u32 cycles = backlog > ThreadSlice ? ThreadSlice : (u32)backlog;
+
+            OnDSPThread.store(true, std::memory_order_relaxed);
+            TeakraCore->Run(cycles);
+            OnDSPThread.store(false, std::memory_order_relaxed);
+
+            DSPTimestamp += cycles;
+            DSPProgress.store(DSPTimestamp, std::memory_order_release);
+            WakeARM9();
+        }
+
+        // done with this target, it won't touch anything until it gets another
+        DSPTargetsDone.fetch_add(1, std::memory_order_release);
+        WakeARM9();
+    }
+}
+
+void PostDSPTarget(u64 time)
+{
+    DSPTargetsPosted++;
+    DSPTarget.store(time, std::memory_order_release);
+    Platform::Semaphore_Post(Sema_DSPStart);
+}
+
+void WaitForDSPThread(u64 time)
+{
+    if (ServicingBus) return;
+
+    WaitOnDSPThread([=]() { return DSPProgress.load(std::memory_order_acquire) >= time; });
+}
+
+// wait for the DSP thread to reach the last target it was given and park
+void SyncDSPThread()
+{
+    if (!DSPThreadRunning.load(std::memory_order_relaxed))
+        return;
+
+    // the DSP thread is stuck waiting for us to do its bus access, it can't park
+    if (ServicingBus) return;
+
+    WaitOnDSPThread([]() { return DSPTargetsDone.load(std::memory_order_acquire) == DSPTargetsPosted; });
+
+    ApplyPendingIRQs();
+}
+
+void DSPThreadEvent()
+{
+    ServiceBusRequest();
+    ApplyPendingIRQs();
+
+    // it gets going again on the next register access
+    if (!IsDSPCoreEnabled())
+        return;
+
+    u64 curtime = NDS::ARM9Timestamp;
+    PostDSPTarget(curtime);
+    if (curtime > DSPMaxLag)
+        WaitForDSPThread(curtime - DSPMaxLag);
+
+    ApplyPendingIRQs();
+    ScheduleDSPEvent();
+}
+
+void StopDSPThread()
+{
+    if (!DSPThreadRunning.load(std::memory_order_relaxed))
+        return;
+
+    SyncDSPThread();
+    DSPThreadRunning = false;
+    Platform::Semaphore_Post(Sema_DSPStart);
+    Platform::Thread_Wait(DSPThread);
+    Platform::Thread_Free(DSPThread);
+    DSPThread = nullptr;
+}
+
+void SetupDSPThread()
+{
+    DSPMaxLag = Config::DSiDSPMaxLag > 0 ? Config::DSiDSPMaxLag : 0;
+
+    if (Config::DSiDSPThreaded)
+    {
+        if (!DSPThreadRunning.load(std::memory_order_relaxed))
+        {
+            Platform::Semaphore_Reset(Sema_DSPStart);
+            Platform::Semaphore_Reset(Sema_DSPProgress);
+            Platform::Semaphore_Reset(Sema_BusDone);
+
+            DSPTargetsPosted = 0;
+            DSPTargetsDone = 0;
+            ARM9Waiting = false;
+            DSPThreadRunning = true;
+            DSPThread = Platform::Thread_Create(DSPThreadFunc);
+        }
+    }
+    else
+        StopDSPThread();
+}
+
 bool Init()
 {
     TeakraCore = new Teakra::Teakra();
@@ -107,16 +445,26 @@ bool Init()
     // these happen instantaneously and without too much regard for bus aribtration
     // rules, so, this might have to be changed later on
     Teakra::AHBMCallback cb;
-    cb.read8 = DSi::ARM9Read8;
-    cb.write8 = DSi::ARM9Write8;
-    cb.read16 = DSi::ARM9Read16;
-    cb.write16 = DSi::ARM9Write16;
-    cb.read32 = DSi::ARM9Read32;
-    cb.write32 = DSi::ARM9Write32;
+    cb.read8 = BusRead8;
+    cb.write8 = BusWrite8;
+    cb.read16 = BusRead16;
+    cb.write16 = BusWrite16;
+    cb.read32 = BusRead32;
+    cb.write32 = BusWrite32;
     TeakraCore->SetAHBMCallback(cb);
 
     TeakraCore->SetAudioCallback(AudioCb);
 
+    Sema_DSPStart = Platform::Semaphore_Create();
+    Sema_DSPProgress = Platform::Semaphore_Create();
+    Sema_BusDone = Platform::Semaphore_Create();
+    DSPThread = nullptr;
+    DSPThreadRunning = false;
+    OnDSPThread = false;
+    PendingIRQ = 0;
+    BusRequestPending = false;
+    ServicingBus = false;
+
     //PDATAReadFifo = new FIFO<u16>(16);
     //PDATAWriteFifo = new FIFO<u16>(16);
 
@@ -124,6 +472,11 @@ bool Init()
 }
 void DeInit()
 {
+    StopDSPThread();
+    Platform::Semaphore_Free(Sema_DSPStart);
+    Platform::Semaphore_Free(Sema_DSPProgress);
+    Platform::Semaphore_Free(Sema_BusDone);
+
     //if (PDATAWriteFifo) delete PDATAWriteFifo;
     if (TeakraCore) delete TeakraCore;
 
@@ -134,7 +487,10 @@ void DeInit()
 
 void Reset()
 {
-    DSPTimestamp = 0;
+    SyncDSPThread();
+    SetupDSPThread();
+    SetDSPTimestamp(0);
+    DSPIdleUntil = 0;
 
     DSP_PADR = 0;
     DSP_PCFG = 0;
@@ -149,6 +505,7 @@ void Reset()
     PDATAReadFifo.Clear();
     //PDATAWriteFifo->Clear();
     TeakraCore->Reset();
+    PendingIRQ = 0;
 
     NDS::CancelEvent(NDS::Event_DSi_DSP);
 }
@@ -161,7 +518,7 @@ void SetRstLine(bool release)
 {
     SCFG_RST = release;
     Reset();
-    DSPTimestamp = NDS::ARM9Timestamp; // only start now!
+    SetDSPTimestamp(NDS::ARM9Timestamp); // only start now!
 }
 
 void OnMBKCfg(char bank, u32 slot, u8 oldcfg, u8 newcfg, u8* nwrambacking)
@@ -179,6 +536,10 @@ void OnMBKCfg(char bank, u32 slot, u8 oldcfg, u8 newcfg, u8* nwrambacking)
     if (olddsp == newdsp)
         return;
 
+    // the DSP may not run while its memory is being swapped
+    SyncDSPThread();
+    WakeDSP();
+
     const u8* src;
     u8* dst;
 
@@ -202,6 +563,10 @@ void OnMBKCfg(char bank, u32 slot, u8 oldcfg, u8 newcfg, u8* nwrambacking)
     }
 
     memcpy(dst, src, 1<<15); // 1 full slot
+
+    // the DSP core keeps decoded instructions around, tell it the code changed
+    if (newdsp && bank == 'B')
+        TeakraCore->InvalidateProgramCache(((newcfg >> 2) & 7) << 14, 1<<14);
 }
 
 inline bool IsDSPCoreEnabled()
@@ -212,12 +577,26 @@ inline bool IsDSPCoreEnabled()
 bool DSPCatchUp()
 {
     //asm volatile("int3");
+    if (DSPThreadRunning.load(std::memory_order_relaxed))
+    {
+        if (IsDSPCoreEnabled())
+        {
+            // once this returns, the DSP has caught up and its thread is idle
+            PostDSPTarget(NDS::ARM9Timestamp);
+            SyncDSPThread();
+            ScheduleDSPEvent();
+            return true;
+        }
+
+        SyncDSPThread();
+    }
+
     if (!IsDSPCoreEnabled())
     {
         // nothing to do, but advance the current time so that we don't do an
         // unreasonable amount of cycles when rst is released
         if (DSPTimestamp < NDS::ARM9Timestamp)
-            DSPTimestamp = NDS::ARM9Timestamp;
+            SetDSPTimestamp(NDS::ARM9Timestamp);
 
         return false;
     }
@@ -237,7 +616,48 @@ bool DSPCatchUp()
 
     return true;
 }
-void DSPCatchUpU32(u32 _) { DSPCatchUp(); }
+void DSPCatchUpU32(u32 _)
+{
+    if (DSPThreadRunning.load(std::memory_order_relaxed))
+        DSPThreadEvent();
+    else
+        DSPCatchUp();
+}
+
+void ScheduleDSPEvent()
+{
+    s32 delay = 16384/*from citra (TeakraSlice)*/;
+
+    // when the DSP is idle, there is no need to check on it before it wakes up
+    if (DSPIdleUntil > NDS::ARM9Timestamp)
+    {
+        u64 idle = ((DSPIdleUntil - NDS::ARM9Timestamp) >> NDS::ARM9ClockShift) + 1;
+        if (idle > MaxIdleDelay) idle = MaxIdleDelay;
+        if (idle > (u64)delay) delay = (s32)idle;
+    }
+
+    NDS::CancelEvent(NDS::Event_DSi_DSP);
+    NDS::ScheduleEvent(NDS::Event_DSi_DSP, false, delay, DSPCatchUpU32, 0);
+}
+
+// as long as the DSP sits idle, register reads see the same thing whether it
+// caught up or not
+bool DSPCatchUpForRead()
+{
+    if (NDS::ARM9Timestamp < DSPIdleUntil && IsDSPCoreEnabled())
+        return true;
+
+    return DSPCatchUp();
+}
+
+// anything the ARM9 writes may get the DSP going
+void WakeDSP()
+{
+    if (!DSPIdleUntil) return;
+
+    DSPIdleUntil = 0;
+    ScheduleDSPEvent();
+}
 
 void PDataDMAWrite(u16 wrval)
 {
@@ -388,7 +808,7 @@ u8 Read8(u32 addr)
     if (!(DSi::SCFG_EXT[0] & (1<<18)))
         return 0;
 
-    if (!DSPCatchUp()) return 0;
+    if (!DSPCatchUpForRead()) return 0;
 
     addr &= 0x3F; // mirroring wheee
 
@@ -417,7 +837,8 @@ u16 Read16(u32 addr)
     if (!(DSi::SCFG_EXT[0] & (1<<18)))
         return 0;
 
-    if (!DSPCatchUp()) return 0;
+    // PDATA can reach into the DSP's I/O, which keeps ticking while it's idle
+    if (!((addr & 0x3E) ? DSPCatchUpForRead() : DSPCatchUp())) return 0;
 
     addr &= 0x3E; // mirroring wheee
 
@@ -470,6 +891,7 @@ void Write8(u32 addr, u8 val)
     if (!(DSi::SCFG_EXT[0] & (1<<18))) return;
 
     if (!DSPCatchUp()) return;
+    WakeDSP();
 
     addr &= 0x3F;
     switch (addr)
@@ -492,6 +914,7 @@ void Write16(u32 addr, u16 val)
     if (!(DSi::SCFG_EXT[0] & (1<<18))) return;
 
     if (!DSPCatchUp()) return;
+    WakeDSP();
 
     addr &= 0x3E;
     switch (addr)
@@ -560,13 +983,16 @@ void Run(u32 cycles)
 
     DSPTimestamp += cycles;
 
-    NDS::CancelEvent(NDS::Event_DSi_DSP);
-    NDS::ScheduleEvent(NDS::Event_DSi_DSP, false,
-            16384/*from citra (TeakraSlice)*/, DSPCatchUpU32, 0);
+    u64 idle = TeakraCore->GetIdleCycles();
+    DSPIdleUntil = idle ? DSPTimestamp + std::min(idle, MaxIdleDelay << NDS::ARM9ClockShift) : 0;
+
+    ScheduleDSPEvent();
 }
 
 void DoSavestate(Savestate* file)
 {
+    SyncDSPThread();
+
     file->Section("DSPi");
 
     PDATAReadFifo.DoSavestate(file);
@@ -587,6 +1013,12 @@ void DoSavestate(Savestate* file)
     file->Var16(&DSP_REP[1]);
     file->Var16(&DSP_REP[2]);
     file->Var8((u8*)&SCFG_RST);
+
+    if (!file->Saving)
+    {
+        SetDSPTimestamp(DSPTimestamp);
+        DSPIdleUntil = 0;
+    }
 }
 
 }
@@ -17,10 +17,17 @@
 */
 
 #include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <list>
+#include <unordered_map>
+#include <vector>
 
 #include "DSi.h"
 #include "DSi_AES.h"
 #include "DSi_NAND.h"
+#include "Platform.h"
 
 #include "sha1/sha1.hpp"
 #include "tiny-AES-c/aes.hpp"
@@ -39,13 +46,37 @@ u64 ConsoleID;
 
 u8 FATIV[16];
 u8 FATKey[16];
+AES_ctx FATCtx; // key schedule for FATKey, so it isn't redone for every access
 
 u8 ESKey[16];
 
 
+// FatFs tends to read the same sectors over and over (FAT, directories),
+// so the most recently used sectors are kept decrypted
+// writes go straight to the file, and update the cache
+const u32 kSectorCacheSize = 2048; // 1MB
+
+struct CachedSector
+{
+    u64 Addr;
+    u8 Data[0x200];
+};
+
+std::list<CachedSector> SectorCache; // most recently used first
+std::unordered_map<u64, std::list<CachedSector>::iterator> SectorCacheMap;
+
+// runs of sectors this big or bigger are split between several threads, when
+// decrypting them in software (with AES-NI, it takes less time than starting
+// the threads would)
+const u32 kNumCryptThreads = 4;
+const u32 kCryptThreadMinLen = 0x8000;
+
+
 UINT FF_ReadNAND(BYTE* buf, LBA_t sector, UINT num);
 UINT FF_WriteNAND(BYTE* buf, LBA_t sector, UINT num);
 
+void ClearSectorCache();
+
 
 bool Init(FILE* nandfile, u8* es_keyY)
 {
@@ -55,6 +86,7 @@ bool Init(FILE* nandfile, u8* es_keyY)
     fseek(nandfile, 0, SEEK_END);
     u64 nandlen = ftell(nandfile);
 
+    ClearSectorCache();
     ff_disk_open(FF_ReadNAND, FF_WriteNAND, (LBA_t)(nandlen>>9));
 
     FRESULT res;
@@ -115,6 +147,7 @@ bool Init(FILE* nandfile, u8* es_keyY)
 
     DSi_AES::DeriveNormalKey(keyX, keyY, tmp);
     DSi_AES::Swap16(FATKey, tmp);
+    AES_init_ctx(&FATCtx, FATKey);
 
 
     *(u32*)&keyX[0] = 0x4E00004A;
@@ -136,6 +169,7 @@ void DeInit()
     f_unmount("0:");
     ff_disk_close();
 
+    ClearSectorCache();
     CurFile = nullptr;
 }
 
@@ -168,59 +202,140 @@ void SetupFATCrypto(AES_ctx* ctx, u32 ctr)
         else break;
     }
 
-    AES_init_ctx_iv(ctx, FATKey, iv);
+    memcpy(ctx, &FATCtx, sizeof(AES_ctx));
+    AES_ctx_set_iv(ctx, iv);
 }
 
-u32 ReadFATBlock(u64 addr, u32 len, u8* buf)
+void CryptFATRun(u32 ctr, u8* buf, u32 len)
 {
-    u32 ctr = (u32)(addr >> 4);
-
     AES_ctx ctx;
     SetupFATCrypto(&ctx, ctr);
 
-    fseek(CurFile, addr, SEEK_SET);
-    u32 res = fread(buf, len, 1, CurFile);
-    if (!res) return 0;
+    DSi_AES::CTR_CryptSwapped(&ctx, buf, len);
+}
 
-    for (u32 i = 0; i < len; i += 16)
+// CTR mode works the same both ways
+void CryptFAT(u64 addr, u32 len, u8* buf)
+{
+    u32 ctr = (u32)(addr >> 4);
+
+    if (len < (kCryptThreadMinLen * 2) || DSi_AES::HasAESNI())
     {
-        u8 tmp[16];
-        DSi_AES::Swap16(tmp, &buf[i]);
-        AES_CTR_xcrypt_buffer(&ctx, tmp, 16);
-        DSi_AES::Swap16(&buf[i], tmp);
+        CryptFATRun(ctr, buf, len);
+        return;
     }
 
-    return len;
+    // every part starts with its own counter, so they don't depend on each other
+    u32 numthreads = std::min(kNumCryptThreads, len / kCryptThreadMinLen);
+    u32 chunk = ((len / numthreads) + 0x1FF) & ~0x1FF;
+
+    Platform::Thread* threads[kNumCryptThreads];
+    for (u32 i = 1; i < numthreads; i++)
+    {
+        u32 start = i * chunk;
+        u32 end = std::min(len, start + chunk);
+        threads[i] = Platform::Thread_Create([=]() { CryptFATRun(ctr + (start >> 4), &buf[start], end - start); });
+    }
+
+    CryptFATRun(ctr, buf, chunk);
+
+    for (u32 i = 1; i < numthreads; i++)
+    {
+        Platform::Thread_Wait(threads[i]);
+        Platform::Thread_Free(threads[i]);
+    }
 }
 
-u32 WriteFATBlock(u64 addr, u32 len, u8* buf)
+void ClearSectorCache()
 {
-    u32 ctr = (u32)(addr >> 4);
+    SectorCache.clear();
+    SectorCacheMap.clear();
+}
 
-    AES_ctx ctx;
-    SetupFATCrypto(&ctx, ctr);
+void CacheSector(u64 addr, const u8* data)
+{
+    auto it = SectorCacheMap.find(addr);
+    if (it != SectorCacheMap.end())
+    {
+        SectorCache.splice(SectorCache.begin(), SectorCache, it->second);
+    }
+    else
+    {
+        if (SectorCache.size() >= kSectorCacheSize)
+        {
+            // reuse the least recently used one
+            SectorCacheMap.erase(SectorCache.back().Addr);
+            SectorCache.splice(SectorCache.begin(), SectorCache, std::prev(SectorCache.end()));
+        }
+        else
+            SectorCache.emplace_front();
 
-    fseek(CurFile, addr, SEEK_SET);
+        SectorCache.front().Addr = addr;
+        SectorCacheMap[addr] = SectorCache.begin();
+    }
 
-    for (u32 s = 0; s < len; s += 0x200)
-    {
-        u8 tempbuf[0x200];
+    memcpy(SectorCache.front().Data, data, 0x200);
+}
 
-        for (u32 i = 0; i < 0x200; i += 16)
+u32 ReadFATBlock(u64 addr, u32 len, u8* buf)
+{
+    for (u32 s = 0; s < len; )
+    {
+        auto it = SectorCacheMap.find(addr + s);
+        if (it != SectorCacheMap.end())
         {
-            u8 tmp[16];
-            DSi_AES::Swap16(tmp, &buf[s+i]);
-            AES_CTR_xcrypt_buffer(&ctx, tmp, 16);
-            DSi_AES::Swap16(&tempbuf[i], tmp);
+            memcpy(&buf[s], it->second->Data, 0x200);
+            SectorCache.splice(SectorCache.begin(), SectorCache, it->second);
+            s += 0x200;
+            continue;
         }
 
-        u32 res = fwrite(tempbuf, 0x200, 1, CurFile);
+        // read and decrypt the whole run of sectors that aren't cached in one go
+        u32 end = s + 0x200;
+        while (end < len && !SectorCacheMap.count(addr + end))
+            end += 0x200;
+
+        fseek(CurFile, addr + s, SEEK_SET);
+        u32 res = fread(&buf[s], end - s, 1, CurFile);
         if (!res) return 0;
+
+        CryptFAT(addr + s, end - s, &buf[s]);
+
+        for (; s < end; s += 0x200)
+            CacheSector(addr + s, &buf[s]);
     }
 
     return len;
 }
 
+u32 WriteFATBlock(u64 addr, u32 len, u8* buf)
+{
+    std::vector<u8> tempbuf(buf, buf + len);
+    CryptFAT(addr, len, tempbuf.data());
+
+    fseek(CurFile, addr, SEEK_SET);
+    u32 res = fwrite(tempbuf.data(), len, 1, CurFile);
+    if (!res)
+    {
+        // no telling what made it to the file
+        for (u32 s = 0; s < len; s += 0x200)
+        {
+            auto it = SectorCacheMap.find(addr + s);
+            if (it == SectorCacheMap.end()) continue;
+
+            SectorCache.erase(it->second);
+            SectorCacheMap.erase(it);
+        }
+
+        return 0;
+    }
+
+    for (u32 s = 0; s < len; s += 0x200)
+        CacheSector(addr + s, &buf[s]);
+
+    return len;
+}
+
 
 UINT FF_ReadNAND(BYTE* buf, LBA_t sector, UINT num)
 {
@@ -266,22 +381,17 @@ bool ESEncrypt(u8* data, u32 len)
     mac[14] = (blklen >> 8) & 0xFF;
     mac[15] = blklen & 0xFF;
 
-    AES_ECB_encrypt(&ctx, mac);
+    DSi_AES::ECB_Encrypt(&ctx, mac);
 
     u32 coarselen = len & ~0xF;
     for (u32 i = 0; i < coarselen; i += 16)
     {
-        u8 tmp[16];
-
-        DSi_AES::Swap16(tmp, &data[i]);
-
-        for (int i = 0; i < 16; i++) mac[i] ^= tmp[i];
-        AES_CTR_xcrypt_buffer(&ctx, tmp, 16);
-        AES_ECB_encrypt(&ctx, mac);
-
-        DSi_AES::Swap16(&data[i], tmp);
+        for (int j = 0; j < 16; j++) mac[j] ^= data[i+15-j];
+        DSi_AES::ECB_Encrypt(&ctx, mac);
     }
 
+    DSi_AES::CTR_CryptSwapped(&ctx, data, coarselen);
+
     u32 remlen = len - coarselen;
     if (remlen)
     {
@@ -293,8 +403,8 @@ bool ESEncrypt(u8* data, u32 len)
             rem[15-i] = data[coarselen+i];
 
         for (int i = 0; i < 16; i++) mac[i] ^= rem[i];
-        AES_CTR_xcrypt_buffer(&ctx, rem, 16);
-        AES_ECB_encrypt(&ctx, mac);
+        DSi_AES::CTR_Crypt(&ctx, rem, 16);
+        DSi_AES::ECB_Encrypt(&ctx, mac);
 
         for (int i = 0; i < remlen; i++)
             data[coarselen+i] = rem[15-i];
@@ -303,7 +413,7 @@ bool ESEncrypt(u8* data, u32 len)
     ctx.Iv[13] = 0x00;
     ctx.Iv[14] = 0x00;
     ctx.Iv[15] = 0x00;
-    AES_CTR_xcrypt_buffer(&ctx, mac, 16);
+    DSi_AES::CTR_Crypt(&ctx, mac, 16);
 
     for (int i = 0; i < 16; i++)
         data[len+i] = mac[15-i];
@@ -322,7 +432,7 @@ bool ESEncrypt(u8* data, u32 len)
     footer[0] = len & 0xFF;
 
     AES_ctx_set_iv(&ctx, iv);
-    AES_CTR_xcrypt_buffer(&ctx, footer, 16);
+    DSi_AES::CTR_Crypt(&ctx, footer, 16);
 
     data[len+0x10] = footer[15];
     data[len+0x1D] = footer[2];
@@ -353,20 +463,15 @@ bool ESDecrypt(u8* data, u32 len)
     mac[14] = (blklen >> 8) & 0xFF;
     mac[15] = blklen & 0xFF;
 
-    AES_ECB_encrypt(&ctx, mac);
+    DSi_AES::ECB_Encrypt(&ctx, mac);
 
     u32 coarselen = len & ~0xF;
+    DSi_AES::CTR_CryptSwapped(&ctx, data, coarselen);
+
     for (u32 i = 0; i < coarselen; i += 16)
     {
-        u8 tmp[16];
-
-        DSi_AES::Swap16(tmp, &data[i]);
-
-        AES_CTR_xcrypt_buffer(&ctx, tmp, 16);
-        for (int i = 0; i < 16; i++) mac[i] ^= tmp[i];
-        AES_ECB_encrypt(&ctx, mac);
-
-        DSi_AES::Swap16(&data[i], tmp);
+        for (int j = 0; j < 16; j++) mac[j] ^= data[i+15-j];
+        DSi_AES::ECB_Encrypt(&ctx, mac);
     }
 
     u32 remlen = len - coarselen;
@@ -381,15 +486,15 @@ bool ESDecrypt(u8* data, u32 len)
 
         memset(rem, 0, 16);
         AES_ctx_set_iv(&ctx, iv);
-        AES_CTR_xcrypt_buffer(&ctx, rem, 16);
+        DSi_AES::CTR_Crypt(&ctx, rem, 16);
 
         for (int i = 0; i < remlen; i++)
             rem[15-i] = data[coarselen+i];
 
         AES_ctx_set_iv(&ctx, iv);
-        AES_CTR_xcrypt_buffer(&ctx, rem, 16);
+        DSi_AES::CTR_Crypt(&ctx, rem, 16);
         for (int i = 0; i < 16; i++) mac[i] ^= rem[i];
-        AES_ECB_encrypt(&ctx, mac);
+        DSi_AES::ECB_Encrypt(&ctx, mac);
 
         for (int i = 0; i < remlen; i++)
             data[coarselen+i] = rem[15-i];
@@ -398,7 +503,7 @@ bool ESDecrypt(u8* data, u32 len)
     ctx.Iv[13] = 0x00;
     ctx.Iv[14] = 0x00;
     ctx.Iv[15] = 0x00;
-    AES_CTR_xcrypt_buffer(&ctx, mac, 16);
+    DSi_AES::CTR_Crypt(&ctx, mac, 16);
 
     u8 footer[16];
 
@@ -412,7 +517,7 @@ bool ESDecrypt(u8* data, u32 len)
         footer[15-i] = data[len+0x10+i];
 
     AES_ctx_set_iv(&ctx, iv);
-    AES_CTR_xcrypt_buffer(&ctx, footer, 16);
+    DSi_AES::CTR_Crypt(&ctx, footer, 16);
 
     data[len+0x10] = footer[15];
     data[len+0x1D] = footer[2];
@@ -19,9 +19,16 @@
 #include <string.h>
 #include <dirent.h>
 #include <inttypes.h>
+#if !defined(_WIN32) && !defined(__SWITCH__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include <algorithm>
 #include <vector>
 
 #include "FATStorage.h"
+#include "CRC32.h"
 #include "Platform.h"
 
 namespace fs = std::filesystem;
@@ -40,13 +47,21 @@ namespace fs = std::filesystem;
 FATStorage::FATStorage(std::string filename, u64 size, bool readonly, std::string sourcedir)
 {
     ReadOnly = readonly;
+    IndexClean = false;
+    ImageDirty = false;
     Load(filename, size, sourcedir);
 
     File = nullptr;
+    Mapping = nullptr;
+
+    CacheTick = 0;
+    CacheHits = 0;
+    CacheMisses = 0;
 }
 
 FATStorage::~FATStorage()
 {
+    Close();
     if (!ReadOnly) Save();
 }
 
@@ -59,21 +74,161 @@ bool FATStorage::Open()
         return false;
     }
 
+    if (!MapImage())
+        printf("FATStorage: could not map %s, using the sector cache\n", FilePath.c_str());
+
     return true;
 }
 
 void FATStorage::Close()
 {
+    UnmapImage();
+    FlushCache();
+    DropCache();
+
     if (File) fclose(File);
     File = nullptr;
 }
 
+void FATStorage::GetCacheStats(u64* hits, u64* misses)
+{
+    *hits = CacheHits;
+    *misses = CacheMisses;
+}
+
+
+bool FATStorage::MapImage()
+{
+#if defined(_WIN32) || defined(__SWITCH__)
+    return false;
+#else
+    if (FileSize == 0 || FileSize > SIZE_MAX) return false;
+
+    int fd = fileno(File);
+    struct stat st;
+    if (fstat(fd, &st) != 0) return false;
+
+    // the image may not have been written all the way to the end yet
+    // accessing the mapping past the end of the file would fault, so the
+    // file is extended (sparse) to its full size
+    if ((u64)st.st_size < FileSize)
+    {
+        if (ReadOnly) return false;
+        if (ftruncate(fd, FileSize) != 0) return false;
+    }
+
+    int prot = ReadOnly ? PROT_READ : (PROT_READ|PROT_WRITE);
+    void* map = mmap(nullptr, FileSize, prot, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) return false;
+
+    Mapping = (u8*)map;
+    return true;
+#endif
+}
+
+void FATStorage::UnmapImage()
+{
+#if !defined(_WIN32) && !defined(__SWITCH__)
+    if (!Mapping) return;
+
+    if (!ReadOnly) msync(Mapping, FileSize, MS_SYNC);
+    munmap(Mapping, FileSize);
+    Mapping = nullptr;
+#endif
+}
+
+FATStorage::CacheBlock* FATStorage::GetCacheBlock(u32 block)
+{
+    auto it = Cache.find(block);
+    if (it != Cache.end())
+    {
+        it->second->LastUse = ++CacheTick;
+        return it->second;
+    }
+
+    CacheBlock* cb;
+    if (Cache.size() >= kCacheMaxBlocks)
+    {
+        // reuse the least recently used block
+        auto lru = Cache.begin();
+        for (auto jt = Cache.begin(); jt != Cache.end(); jt++)
+        {
+            if (jt->second->LastUse < lru->second->LastUse)
+                lru = jt;
+        }
+
+        cb = lru->second;
+        FlushCacheBlock(lru->first, cb);
+        Cache.erase(lru);
+    }
+    else
+        cb = new CacheBlock;
+
+    u32 num = ReadSectorsInternal(File, FileSize, block * kCacheBlockSectors, kCacheBlockSectors, cb->Data);
+    if (num < kCacheBlockSectors)
+        memset(&cb->Data[num * 0x200], 0, (kCacheBlockSectors - num) * 0x200);
+
+    cb->DirtyMask = 0;
+    cb->LastUse = ++CacheTick;
+    Cache[block] = cb;
+    return cb;
+}
+
+void FATStorage::FlushCacheBlock(u32 block, CacheBlock* cb)
+{
+    // write each run of dirty sectors in one go
+    u64 mask = cb->DirtyMask;
+    while (mask)
+    {
+        u32 first = __builtin_ctzll(mask);
+        u32 end = first;
+        while (end < kCacheBlockSectors && (mask & (1ULL << end))) end++;
+
+        WriteSectorsInternal(File, FileSize, block * kCacheBlockSectors + first, end - first, &cb->Data[first * 0x200]);
+
+        if (end == kCacheBlockSectors) mask = 0;
+        else mask &= ~((1ULL << end) - 1);
+    }
+
+    cb->DirtyMask = 0;
+}
+
+void FATStorage::FlushCache()
+{
+    if (!File) return;
+
+    // std::map keeps the blocks in order, so the file is written front to back
+    bool any = false;
+    for (auto& it : Cache)
+    {
+        if (!it.second->DirtyMask) continue;
+
+        FlushCacheBlock(it.first, it.second);
+        any = true;
+    }
+
+    if (any) fflush(File);
+}
+
+void FATStorage::DropCache()
+{
+    for (auto& it : Cache)
+        delete it.second;
+
+    Cache.clear();
+}
+
 
 bool FATStorage::InjectFile(std::string path, u8* data, u32 len)
 {
     if (!File) return false;
     if (FF_File) return false;
 
+    // this goes straight to the file, so the cache has to be written out
+    // first and thrown away after
+    FlushCache();
+    MarkImageDirty();
+
     FF_File = File;
     FF_FileSize = FileSize;
     ff_disk_open(FF_ReadStorage, FF_WriteStorage, (LBA_t)(FileSize>>9));
@@ -108,19 +263,85 @@ bool FATStorage::InjectFile(std::string path, u8* data, u32 len)
     f_unmount("0:");
     ff_disk_close();
     FF_File = nullptr;
+
+    fflush(File);
+    DropCache();
     return nwrite==len;
 }
 
 
 u32 FATStorage::ReadSectors(u32 start, u32 num, u8* data)
 {
-    return ReadSectorsInternal(File, FileSize, start, num, data);
+    if (!File) return 0;
+
+    if ((start + (u64)num) * 0x200 > FileSize)
+    {
+        if (start * 0x200ULL >= FileSize) return 0;
+        num = (FileSize >> 9) - start;
+    }
+
+    if (Mapping)
+    {
+        memcpy(data, &Mapping[start * 0x200ULL], num * 0x200);
+        CacheHits += num;
+        return num;
+    }
+
+    for (u32 i = 0; i < num; )
+    {
+        u32 sector = start + i;
+        u32 block = sector / kCacheBlockSectors;
+        u32 offset = sector % kCacheBlockSectors;
+        u32 len = std::min(num - i, kCacheBlockSectors - offset);
+
+        if (Cache.count(block)) CacheHits += len;
+        else                    CacheMisses += len;
+
+        CacheBlock* cb = GetCacheBlock(block);
+        memcpy(&data[i * 0x200], &cb->Data[offset * 0x200], len * 0x200);
+        i += len;
+    }
+
+    return num;
 }
 
 u32 FATStorage::WriteSectors(u32 start, u32 num, u8* data)
 {
     if (ReadOnly) return 0;
-    return WriteSectorsInternal(File, FileSize, start, num, data);
+    if (!File) return 0;
+    if (!ImageDirty) MarkImageDirty();
+
+    if ((start + (u64)num) * 0x200 > FileSize)
+    {
+        if (start * 0x200ULL >= FileSize) return 0;
+        num = (FileSize >> 9) - start;
+    }
+
+    if (Mapping)
+    {
+        memcpy(&Mapping[start * 0x200ULL], data, num * 0x200);
+        CacheHits += num;
+        return num;
+    }
+
+    for (u32 i = 0; i < num; )
+    {
+        u32 sector = start + i;
+        u32 block = sector / kCacheBlockSectors;
+        u32 offset = sector % kCacheBlockSectors;
+        u32 len = std::min(num - i, kCacheBlockSectors - offset);
+
+        if (Cache.count(block)) CacheHits += len;
+        else                    CacheMisses += len;
+
+        CacheBlock* cb = GetCacheBlock(block);
+        memcpy(&cb->Data[offset * 0x200], &data[i * 0x200], len * 0x200);
+        if (len == kCacheBlockSectors) cb->DirtyMask = ~0ULL;
+        else           cb->DirtyMask |= ((1ULL << len) - 1) << offset;
+        i += len;
+    }
+
+    return num;
 }
 
 
@@ -192,6 +413,7 @@ void FATStorage::LoadIndex()
 {
     DirIndex.clear();
     FileIndex.clear();
+    IndexClean = false;
 
     FILE* f = Platform::OpenLocalFile(IndexPath.c_str(), "r");
     if (!f) return;
@@ -210,6 +432,14 @@ void FATStorage::LoadIndex()
 
             FileSize = fsize;
         }
+        else if (linebuf[0] == 'C')
+        {
+            u32 clean;
+            int ret = sscanf(linebuf, "CLEAN %u", &clean);
+            if (ret < 1) continue;
+
+            IndexClean = clean!=0;
+        }
         else if (linebuf[0] == 'D')
         {
             u32 readonly;
@@ -253,9 +483,31 @@ void FATStorage::LoadIndex()
             entry.Size = fsize;
             entry.LastModified = lastmodified;
             entry.LastModifiedInternal = lastmod_internal;
+            entry.HasHash = false;
+            entry.Hash = 0;
 
             FileIndex[entry.Path] = entry;
         }
+        else if (linebuf[0] == 'H')
+        {
+            // goes with the FILE line before it
+            u32 hash;
+            char fpath[1536] = {0};
+            int ret = sscanf(linebuf, "HASH %x %[^\t\r\n]", &hash, fpath);
+            if (ret < 2) continue;
+
+            for (int i = 0; i < 1536 && fpath[i] != '\0'; i++)
+            {
+                if (fpath[i] == '\\')
+                    fpath[i] = '/';
+            }
+
+            auto it = FileIndex.find(fpath);
+            if (it == FileIndex.end()) continue;
+
+            it->second.HasHash = true;
+            it->second.Hash = hash;
+        }
     }
 
     fclose(f);
@@ -329,6 +581,7 @@ void FATStorage::SaveIndex()
     if (!f) return;
 
     fprintf(f, "SIZE %" PRIu64 "\r\n", FileSize);
+    fprintf(f, "CLEAN %u\r\n", IndexClean?1:0);
 
     for (const auto& [key, val] : DirIndex)
     {
@@ -340,13 +593,84 @@ void FATStorage::SaveIndex()
     {
         fprintf(f, "FILE %u %" PRIu64 " %" PRId64 " %u %s\r\n",
                 val.IsReadOnly?1:0, val.Size, val.LastModified, val.LastModifiedInternal, val.Path.c_str());
+
+        if (val.HasHash)
+            fprintf(f, "HASH %08X %s\r\n", val.Hash, val.Path.c_str());
     }
 
     fclose(f);
 }
 
+void FATStorage::MarkImageDirty()
+{
+    ImageDirty = true;
+
+    // if the image doesn't get synced with the host directory (crash, etc),
+    // the next import will have to check the whole image against the index
+    if (IndexClean)
+    {
+        IndexClean = false;
+        SaveIndex();
+    }
+}
 
-bool FATStorage::ExportFile(std::string path, fs::path out)
+bool FATStorage::HashFile(std::string path, u32* hash)
+{
+    FF_FIL file;
+    FRESULT res;
+
+    res = f_open(&file, path.c_str(), FA_OPEN_EXISTING | FA_READ);
+    if (res != FR_OK)
+        return false;
+
+    u32 len = f_size(&file);
+    u32 crc = 0;
+
+    u8 buf[0x1000];
+    for (u32 i = 0; i < len; i += 0x1000)
+    {
+        u32 blocklen;
+        if ((i + 0x1000) > len)
+            blocklen = len - i;
+        else
+            blocklen = 0x1000;
+
+        u32 nread;
+        f_read(&file, buf, blocklen, &nread);
+        crc = CRC32(buf, blocklen, crc);
+    }
+
+    f_close(&file);
+
+    *hash = crc;
+    return true;
+}
+
+bool FATStorage::HashHostFile(fs::path in, u32* hash)
+{
+    FILE* fin = Platform::OpenFile(in.u8string().c_str(), "rb");
+    if (!fin)
+        return false;
+
+    u32 crc = 0;
+
+    u8 buf[0x1000];
+    for (;;)
+    {
+        u32 nread = fread(buf, 1, 0x1000, fin);
+        if (nread == 0) break;
+
+        crc = CRC32(buf, nread, crc);
+    }
+
+    fclose(fin);
+
+    *hash = crc;
+    return true;
+}
+
+
+bool FATStorage::ExportFile(std::string path, fs::path out, u32* hash)
 {
     FF_FIL file;
     FILE* fout;
@@ -374,6 +698,8 @@ bool FATStorage::ExportFile(std::string path, fs::path out)
         return false;
     }
 
+    u32 crc = 0;
+
     u8 buf[0x1000];
     for (u32 i = 0; i < len; i += 0x1000)
     {
@@ -386,15 +712,18 @@ bool FATStorage::ExportFile(std::string path, fs::path out)
         u32 nread;
         f_read(&file, buf, blocklen, &nread);
         fwrite(buf, blocklen, 1, fout);
+        crc = CRC32(buf, blocklen, crc);
     }
 
     fclose(fout);
     f_close(&file);
 
+    *hash = crc;
+
     return true;
 }
 
-void FATStorage::ExportDirectory(std::string path, std::string outbase, int level)
+void FATStorage::ExportDirectory(std::string path, std::string outbase, int level, std::set<std::string>& seen)
 {
     if (level >= 32) return;
 
@@ -416,9 +745,23 @@ void FATStorage::ExportDirectory(std::string path, std::string outbase, int leve
 
         std::string fullpath = path + info.fname;
         fs::path outpath = fs::u8path(outbase + "/" + fullpath);
+        seen.insert(fullpath);
 
         if (info.fattrib & AM_DIR)
         {
+            if (FileIndex.count(fullpath) > 0)
+            {
+                // this used to be a file
+                std::error_code err;
+                fs::permissions(outpath,
+                                fs::perms::owner_read | fs::perms::owner_write,
+                                fs::perm_options::add,
+                                err);
+                fs::remove(outpath, err);
+
+                FileIndex.erase(fullpath);
+            }
+
             if (DirIndex.count(fullpath) < 1)
             {
                 std::error_code err;
@@ -437,6 +780,12 @@ void FATStorage::ExportDirectory(std::string path, std::string outbase, int leve
         {
             bool doexport = false;
 
+            if (DirIndex.count(fullpath) > 0)
+            {
+                // this used to be a directory
+                DeleteHostDirectory(fullpath, outbase, 0);
+            }
+
             if (FileIndex.count(fullpath) < 1)
             {
                 doexport = true;
@@ -446,6 +795,8 @@ void FATStorage::ExportDirectory(std::string path, std::string outbase, int leve
                 entry.IsReadOnly = (info.fattrib & AM_RDO) != 0;
                 entry.Size = info.fsize;
                 entry.LastModifiedInternal = (info.fdate << 16) | info.ftime;
+                entry.HasHash = false;
+                entry.Hash = 0;
 
                 FileIndex[entry.Path] = entry;
             }
@@ -454,8 +805,15 @@ void FATStorage::ExportDirectory(std::string path, std::string outbase, int leve
                 u32 lastmod = (info.fdate << 16) | info.ftime;
 
                 FileIndexEntry& entry = FileIndex[fullpath];
-                if ((info.fsize != entry.Size) || (lastmod != entry.LastModifiedInternal))
+                if (info.fsize != entry.Size)
                     doexport = true;
+                else if (lastmod != entry.LastModifiedInternal)
+                {
+                    // the file was written to, but it may still have the same contents
+                    u32 hash;
+                    if (!(entry.HasHash && HashFile("0:/"+fullpath, &hash) && hash == entry.Hash && fs::exists(outpath)))
+                        doexport = true;
+                }
 
                 entry.Size = info.fsize;
                 entry.LastModifiedInternal = lastmod;
@@ -463,13 +821,16 @@ void FATStorage::ExportDirectory(std::string path, std::string outbase, int leve
 
             if (doexport)
             {
-                if (ExportFile("0:/"+fullpath, outpath))
+                u32 hash;
+                if (ExportFile("0:/"+fullpath, outpath, &hash))
                 {
                     fs::file_time_type modtime = fs::last_write_time(outpath);
                     s64 modtime_raw = std::chrono::duration_cast<std::chrono::seconds>(modtime.time_since_epoch()).count();
 
                     FileIndexEntry& entry = FileIndex[fullpath];
                     entry.LastModified = modtime_raw;
+                    entry.HasHash = true;
+                    entry.Hash = hash;
                 }
                 else
                 {
@@ -489,7 +850,7 @@ void FATStorage::ExportDirectory(std::string path, std::string outbase, int leve
 
     for (auto& entry : subdirlist)
     {
-        ExportDirectory(entry+"/", outbase, level+1);
+        ExportDirectory(entry+"/", outbase, level+1, seen);
     }
 }
 
@@ -569,30 +930,33 @@ bool FATStorage::DeleteHostDirectory(std::string path, std::string outbase, int
 void FATStorage::ExportChanges(std::string outbase)
 {
     // reflect changes in the FAT volume to the host filesystem
-    // * delete directories and files that exist in the index but not in the volume
-    // * copy files to the host FS if they exist within the index and their size or
-    //   internal last-modified time is different
+    // * copy files to the host FS if they exist within the index and their
+    //   contents changed
     // * index and copy directories and files that exist in the volume but not in
     //   the index
+    // * delete directories and files that exist in the index but not in the volume
+    // the volume is only walked once. whatever it didn't turn up is checked
+    // again before being deleted, since the walk skips directories that are
+    // nested too deep or that can't be read
+
+    std::set<std::string> seen;
+    ExportDirectory("", outbase, 0, seen);
+
+    auto isdeleted = [&](const std::string& path) -> bool
+    {
+        if (seen.count(path) > 0) return false;
+
+        std::string fullpath = "0:/" + path;
+        FRESULT res = f_stat(fullpath.c_str(), nullptr);
+        return (res == FR_NO_FILE || res == FR_NO_PATH);
+    };
 
     std::vector<std::string> deletelist;
 
     for (const auto& [key, val] : FileIndex)
     {
-        std::string innerpath = "0:/" + val.Path;
-        FF_FILINFO finfo;
-        FRESULT res = f_stat(innerpath.c_str(), &finfo);
-        if (res == FR_OK)
-        {
-            if (finfo.fattrib & AM_DIR)
-            {
-                deletelist.push_back(key);
-            }
-        }
-        else if (res == FR_NO_FILE || res == FR_NO_PATH)
-        {
+        if (isdeleted(key))
             deletelist.push_back(key);
-        }
     }
 
     for (const auto& key : deletelist)
@@ -604,7 +968,7 @@ void FATStorage::ExportChanges(std::string outbase)
                         fs::perms::owner_read | fs::perms::owner_write,
                         fs::perm_options::add,
                         err);
-        fs::remove(fullpath);
+        fs::remove(fullpath, err);
 
         FileIndex.erase(key);
     }
@@ -613,28 +977,14 @@ void FATStorage::ExportChanges(std::string outbase)
 
     for (const auto& [key, val] : DirIndex)
     {
-        std::string innerpath = "0:/" + val.Path;
-        FF_FILINFO finfo;
-        FRESULT res = f_stat(innerpath.c_str(), &finfo);
-        if (res == FR_OK)
-        {
-            if (!(finfo.fattrib & AM_DIR))
-            {
-                deletelist.push_back(key);
-            }
-        }
-        else if (res == FR_NO_FILE || res == FR_NO_PATH)
-        {
+        if (isdeleted(key))
             deletelist.push_back(key);
-        }
     }
 
     for (const auto& key : deletelist)
     {
         DeleteHostDirectory(key, outbase, 0);
     }
-
-    ExportDirectory("", outbase, 0);
 }
 
 
@@ -779,7 +1129,7 @@ void FATStorage::CleanupDirectory(std::string sourcedir, std::string path, int l
     }
 }
 
-bool FATStorage::ImportFile(std::string path, fs::path in)
+bool FATStorage::ImportFile(std::string path, fs::path in, u32* hash)
 {
     FF_FIL file;
     FILE* fin;
@@ -806,6 +1156,8 @@ bool FATStorage::ImportFile(std::string path, fs::path in)
         return false;
     }
 
+    u32 crc = 0;
+
     u8 buf[0x1000];
     for (u32 i = 0; i < len; i += 0x1000)
     {
@@ -818,24 +1170,31 @@ bool FATStorage::ImportFile(std::string path, fs::path in)
         u32 nwrite;
         fread(buf, blocklen, 1, fin);
         f_write(&file, buf, blocklen, &nwrite);
+        crc = CRC32(buf, blocklen, crc);
     }
 
     fclose(fin);
     f_close(&file);
 
+    *hash = crc;
+
     return true;
 }
 
 bool FATStorage::ImportDirectory(std::string sourcedir)
 {
     // remove whatever isn't in the index
-    CleanupDirectory(sourcedir, "", 0);
+    // if the index is known to match the volume, there can't be anything
+    // like that, and walking the whole volume can be skipped
+    if (!IndexClean)
+        CleanupDirectory(sourcedir, "", 0);
 
     int srclen = sourcedir.length();
+    std::vector<std::pair<std::string, fs::directory_entry>> entries;
+    std::set<std::string> hostfiles;
+    std::set<std::string> hostdirs;
 
-    // iterate through the host directory:
-    // * directories will be added if they aren't in the index
-    // * files will be added if they aren't in the index, or if the size or last-modified-date don't match
+    // see what is in the host directory first
     for (auto& entry : fs::recursive_directory_iterator(fs::u8path(sourcedir)))
     {
         std::string fullpath = entry.path().u8string();
@@ -850,6 +1209,55 @@ bool FATStorage::ImportDirectory(std::string sourcedir)
                 innerpath[i] = '/';
         }
 
+        if (entry.is_directory())
+            hostdirs.insert(innerpath);
+        else if (entry.is_regular_file())
+            hostfiles.insert(innerpath);
+
+        entries.push_back(std::make_pair(innerpath, entry));
+    }
+
+    // whatever is in the index but is gone from the host directory, or changed
+    // between file and directory, is removed before anything is imported, so
+    // that it doesn't take up space or get in the way of the new entries
+    std::vector<std::string> deletelist;
+
+    for (const auto& [key, val] : FileIndex)
+    {
+        if (hostfiles.count(key) < 1)
+            deletelist.push_back(key);
+    }
+
+    for (const auto& key : deletelist)
+    {
+        std::string fullpath = "0:/" + key;
+        f_chmod(fullpath.c_str(), 0, AM_RDO);
+        f_unlink(fullpath.c_str());
+
+        FileIndex.erase(key);
+    }
+
+    deletelist.clear();
+
+    for (const auto& [key, val] : DirIndex)
+    {
+        if (hostdirs.count(key) < 1)
+            deletelist.push_back(key);
+    }
+
+    // subdirectories come after their parent in the index
+    for (auto it = deletelist.rbegin(); it != deletelist.rend(); it++)
+    {
+        DeleteDirectory(*it+"/", 0);
+        DirIndex.erase(*it);
+    }
+
+    // go through the host directory:
+    // * directories will be added if they aren't in the index
+    // * files will be added if they aren't in the index, or if the size or last-modified-date don't match
+    for (auto& [path, entry] : entries)
+    {
+        std::string innerpath = path;
         bool readonly = (entry.status().permissions() & fs::perms::owner_write) == fs::perms::none;
 
         if (entry.is_directory())
@@ -884,7 +1292,15 @@ bool FATStorage::ImportDirectory(std::string sourcedir)
             {
                 FileIndexEntry& chk = FileIndex[innerpath];
                 if (chk.Size != filesize) import = true;
-                if (chk.LastModified != lastmodified_raw) import = true;
+                else if (chk.LastModified != lastmodified_raw)
+                {
+                    // no need to import it again if only the date changed
+                    u32 hash;
+                    if (chk.HasHash && HashHostFile(entry.path(), &hash) && hash == chk.Hash)
+                        chk.LastModified = lastmodified_raw;
+                    else
+                        import = true;
+                }
             }
 
             if (import)
@@ -894,9 +1310,10 @@ bool FATStorage::ImportDirectory(std::string sourcedir)
                 ientry.IsReadOnly = readonly;
                 ientry.Size = filesize;
                 ientry.LastModified = lastmodified_raw;
+                ientry.HasHash = true;
 
                 innerpath = "0:/" + innerpath;
-                if (ImportFile(innerpath, entry.path()))
+                if (ImportFile(innerpath, entry.path(), &ientry.Hash))
                 {
                     FF_FILINFO finfo;
                     f_stat(innerpath.c_str(), &finfo);
@@ -911,6 +1328,7 @@ bool FATStorage::ImportDirectory(std::string sourcedir)
         f_chmod(innerpath.c_str(), readonly?AM_RDO:0, AM_RDO);
     }
 
+    IndexClean = true;
     SaveIndex();
 
     return true;
@@ -977,6 +1395,7 @@ bool FATStorage::Load(std::string filename, u64 size, std::string sourcedir)
     {
         DirIndex.clear();
         FileIndex.clear();
+        IndexClean = true;
         SaveIndex();
     }
     else
@@ -1043,6 +1462,7 @@ bool FATStorage::Load(std::string filename, u64 size, std::string sourcedir)
 
         DirIndex.clear();
         FileIndex.clear();
+        IndexClean = true;
         SaveIndex();
 
         FF_MKFS_PARM fsopt;
@@ -1089,6 +1509,12 @@ bool FATStorage::Save()
         return true;
     }
 
+    // nothing was written to the volume, so there is nothing to export
+    if (!ImageDirty)
+    {
+        return true;
+    }
+
     FF_File = Platform::OpenLocalFile(FilePath.c_str(), "r+b");
     if (!FF_File)
     {
@@ -1112,6 +1538,8 @@ bool FATStorage::Save()
 
     ExportChanges(SourceDir);
 
+    IndexClean = true;
+    ImageDirty = false;
     SaveIndex();
 
     f_unmount("0:");
@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <string>
 #include <map>
+#include <set>
 #include <filesystem>
 
 #include "types.h"
@@ -42,6 +43,9 @@ public:
     u32 ReadSectors(u32 start, u32 num, u8* data);
     u32 WriteSectors(u32 start, u32 num, u8* data);
 
+    // how many sector accesses were served from memory, and how many had to hit the disk
+    void GetCacheStats(u64* hits, u64* misses);
+
 private:
     std::string FilePath;
     std::string IndexPath;
@@ -51,6 +55,32 @@ private:
     FILE* File;
     u64 FileSize;
 
+    u8* Mapping; // the whole image, when it could be mapped
+
+    // when the image isn't mapped, sector accesses go through a write-back
+    // cache of 32K blocks, dirty sectors are written on Close()/Save()
+    static const u32 kCacheBlockSectors = 64;
+    static const u32 kCacheMaxBlocks = 256;
+
+    typedef struct
+    {
+        u8 Data[kCacheBlockSectors * 0x200];
+        u64 DirtyMask; // one bit per sector
+        u64 LastUse;
+
+    } CacheBlock;
+
+    std::map<u32, CacheBlock*> Cache;
+    u64 CacheTick;
+    u64 CacheHits, CacheMisses;
+
+    bool MapImage();
+    void UnmapImage();
+    CacheBlock* GetCacheBlock(u32 block);
+    void FlushCacheBlock(u32 block, CacheBlock* cb);
+    void FlushCache();
+    void DropCache();
+
     static FILE* FF_File;
     static u64 FF_FileSize;
     static UINT FF_ReadStorage(BYTE* buf, LBA_t sector, UINT num);
@@ -61,16 +91,20 @@ private:
 
     void LoadIndex();
     void SaveIndex();
+    void MarkImageDirty();
 
-    bool ExportFile(std::string path, std::filesystem::path out);
-    void ExportDirectory(std::string path, std::string outbase, int level);
+    bool HashFile(std::string path, u32* hash);
+    bool HashHostFile(std::filesystem::path in, u32* hash);
+
+    bool ExportFile(std::string path, std::filesystem::path out, u32* hash);
+    void ExportDirectory(std::string path, std::string outbase, int level, std::set<std::string>& seen);
     bool DeleteHostDirectory(std::string path, std::string outbase, int level);
     void ExportChanges(std::string outbase);
 
     bool CanFitFile(u32 len);
     bool DeleteDirectory(std::string path, int level);
     void CleanupDirectory(std::string sourcedir, std::string path, int level);
-    bool ImportFile(std::string path, std::filesystem::path in);
+    bool ImportFile(std::string path, std::filesystem::path in, u32* hash);
     bool ImportDirectory(std::string sourcedir);
     u64 GetDirectorySize(std::filesystem::path sourcedir);
 
@@ -91,11 +125,18 @@ private:
         u64 Size;
         s64 LastModified;
         u32 LastModifiedInternal;
+        bool HasHash;
+        u32 Hash; // CRC32 of the contents
 
     } FileIndexEntry;
 
     std::map<std::string, DirIndexEntry> DirIndex;
     std::map<std::string, FileIndexEntry> FileIndex;
+
+    // the index matches the contents of the image: nothing was written to
+    // the image since it was last synced with the host directory
+    bool IndexClean;
+    bool ImageDirty; // written to since it was opened
 };
 
 #endif // FATSTORAGE_H
@@ -82,6 +82,9 @@ int FrontBuffer;
 u32* Framebuffer[2][2];
 int Renderer = 0;
 
+bool SkipRendering;
+bool FrameSkipped; // nothing was drawn this frame
+
 GPU2D::Unit GPU2D_A(0);
 GPU2D::Unit GPU2D_B(1);
 
@@ -123,6 +126,15 @@ VRAMTrackingSet<128*1024, 16*1024> VRAMDirty_TexPal;
 
 NonStupidBitField<128*1024/VRAMDirtyGranularity> VRAMDirty[9];
 
+// the dirty bits above are cleared as the renderers catch up, so savestates
+// keep their own copy. all sized like the biggest bank, for simplicity
+SavestateTracker VRAMTracker[9] =
+{
+    {128*1024, 9}, {128*1024, 9}, {128*1024, 9},
+    {128*1024, 9}, {128*1024, 9}, {128*1024, 9},
+    {128*1024, 9}, {128*1024, 9}, {128*1024, 9}
+};
+
 u8 VRAMFlat_ABG[512*1024];
 u8 VRAMFlat_BBG[128*1024];
 u8 VRAMFlat_AOBJ[256*1024];
@@ -167,6 +179,22 @@ void DeInit()
     if (Framebuffer[1][1]) delete[] Framebuffer[1][1];
 }
 
+void UpdateVRAMTracker(u32 bank)
+{
+    static_assert(VRAMDirtyGranularity == 512, "");
+
+    for (u32 i = 0; i < VRAMDirty[bank].DataLength; i++)
+    {
+        u64 dirty = VRAMDirty[bank].Data[i];
+        while (dirty != 0)
+        {
+            u32 bit = __builtin_ctzll(dirty);
+            dirty &= ~(1ULL << bit);
+            VRAMTracker[bank].Write(((i << 6) + bit) * VRAMDirtyGranularity);
+        }
+    }
+}
+
 void ResetVRAMCache()
 {
     for (int i = 0; i < 9; i++)
@@ -219,6 +247,9 @@ void Reset()
     memset(VRAM_H, 0,  32*1024);
     memset(VRAM_I, 0,  16*1024);
 
+    for (int i = 0; i < 9; i++)
+        VRAMTracker[i].WriteAll();
+
     memset(VRAMCNT, 0, 9);
     VRAMSTAT = 0;
 
@@ -314,15 +345,24 @@ void DoSavestate(Savestate* file)
     file->VarArray(Palette, 2*1024);
     file->VarArray(OAM, 2*1024);
 
-    file->VarArray(VRAM_A, 128*1024);
-    file->VarArray(VRAM_B, 128*1024);
-    file->VarArray(VRAM_C, 128*1024);
-    file->VarArray(VRAM_D, 128*1024);
-    file->VarArray(VRAM_E,  64*1024);
-    file->VarArray(VRAM_F,  16*1024);
-    file->VarArray(VRAM_G,  16*1024);
-    file->VarArray(VRAM_H,  32*1024);
-    file->VarArray(VRAM_I,  16*1024);
+    for (int i = 0; i < 9; i++)
+    {
+        UpdateVRAMTracker(i);
+
+        // writes from the ARM7 side aren't tracked
+        if ((VRAMMap_ARM7[0] | VRAMMap_ARM7[1]) & (1<<i))
+            VRAMTracker[i].WriteAll();
+    }
+
+    file->VarArray(VRAM_A, 128*1024, &VRAMTracker[0]);
+    file->VarArray(VRAM_B, 128*1024, &VRAMTracker[1]);
+    file->VarArray(VRAM_C, 128*1024, &VRAMTracker[2]);
+    file->VarArray(VRAM_D, 128*1024, &VRAMTracker[3]);
+    file->VarArray(VRAM_E,  64*1024, &VRAMTracker[4]);
+    file->VarArray(VRAM_F,  16*1024, &VRAMTracker[5]);
+    file->VarArray(VRAM_G,  16*1024, &VRAMTracker[6]);
+    file->VarArray(VRAM_H,  32*1024, &VRAMTracker[7]);
+    file->VarArray(VRAM_I,  16*1024, &VRAMTracker[8]);
 
     file->VarArray(VRAMCNT, 9);
     file->Var8(&VRAMSTAT);
@@ -362,6 +402,10 @@ void DoSavestate(Savestate* file)
     GPU3D::DoSavestate(file);
 
     ResetVRAMCache();
+
+    // the next frame displays the 3D frame rendered before saving
+    if (!file->Saving)
+        GPU3D::RestartFrame();
 }
 
 void AssignFramebuffers()
@@ -1001,6 +1045,11 @@ void DisplayFIFO(u32 x)
         GPU2D_A.SampleFIFO(253, 3); // sample the remaining pixels
 }
 
+void SetSkipRendering(bool skip)
+{
+    SkipRendering = skip;
+}
+
 void StartFrame()
 {
     // only run the display FIFO if needed:
@@ -1009,6 +1058,7 @@ void StartFrame()
     RunFIFO = GPU2D_A.UsesFIFO() || NDS::DMAsInMode(0, 0x04);
 
     TotalScanlines = 0;
+    FrameSkipped = SkipRendering;
     StartScanline(0);
 }
 
@@ -1017,12 +1067,34 @@ void StartHBlank(u32 line)
     DispStat[0] |= (1<<1);
     DispStat[1] |= (1<<1);
 
-    if (VCount < 192)
+    // display capture writes to VRAM, so it has to keep going
+    if (FrameSkipped && ((GPU2D_A.CaptureLatch) ||
+        (VCount == 0 && (GPU2D_A.CaptureCnt & (1<<31)))))
+        FrameSkipped = false;
+
+    if (VCount < 192 && FrameSkipped)
+    {
+        if (line < 192)
+        {
+            // keep in sync with the threaded 3D renderer
+            if (!GPU3D::CurrentRenderer->Accelerated)
+                GPU3D::GetLine(line);
+
+            // the mosaic counters carry over from a frame to the next
+            GPU2D_A.UpdateMosaicCounters(VCount);
+            if (GPU2D_B.Enabled)
+                GPU2D_B.UpdateMosaicCounters(VCount);
+        }
+
+        NDS::CheckDMAs(0, 0x02);
+    }
+    else if (VCount < 192)
     {
         // draw
         // note: this should start 48 cycles after the scanline start
         if (line < 192)
         {
+            NDS::PerfScope perf(NDS::Perf_GPU2D);
             GPU2D_Renderer->DrawScanline(line, &GPU2D_A);
             GPU2D_Renderer->DrawScanline(line, &GPU2D_B);
         }
@@ -1057,8 +1129,11 @@ void StartHBlank(u32 line)
 
 void FinishFrame(u32 lines)
 {
-    FrontBuffer = FrontBuffer ? 0 : 1;
-    AssignFramebuffers();
+    if (!FrameSkipped)
+    {
+        FrontBuffer = FrontBuffer ? 0 : 1;
+        AssignFramebuffers();
+    }
 
     TotalScanlines = lines;
 
@@ -1159,7 +1234,7 @@ void StartScanline(u32 line)
 
 #ifdef OGLRENDERER_ENABLED
             // Need a better way to identify the openGL renderer in particular
-            if (GPU3D::CurrentRenderer->Accelerated)
+            if (GPU3D::CurrentRenderer->Accelerated && !FrameSkipped)
                 CurGLCompositor->RenderFrame();
 #endif
         }
@@ -1248,6 +1323,7 @@ NonStupidBitField<Size/VRAMDirtyGranularity> VRAMTrackingSet<Size, MappingGranul
     {
         u32 num = __builtin_ctz(banksToBeZeroed);
         banksToBeZeroed &= ~(1 << num);
+        UpdateVRAMTracker(num);
         VRAMDirty[num].Clear();
     }
 
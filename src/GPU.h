@@ -176,6 +176,12 @@ void ResetRenderer();
 
 void SetRenderSettings(int renderer, RenderSettings& settings);
 
+// when set, frames don't produce any video output: the 2D engines only draw
+// when a display capture needs them, and the framebuffers aren't swapped.
+// 3D rendering is left alone since display capture and the next frame
+// depend on it. emulation results are unaffected.
+void SetSkipRendering(bool skip);
+
 
 u8* GetUniqueBankPtr(u32 mask, u32 offset);
 
@@ -627,6 +627,29 @@ void DoSavestate(Savestate* file)
     file->VarArray(ShininessTable, 128*sizeof(u8));
 
     file->Bool32(&AbortFrame);
+
+    // the polygon list latched at the last VBlank, so the 3D frame that is
+    // displayed next can be rendered again after loading
+    if (file->IsAtleastVersion(9, 2))
+    {
+        file->Var32(&RenderNumPolygons);
+        if (RenderNumPolygons > 2048) RenderNumPolygons = 0;
+
+        for (u32 i = 0; i < RenderNumPolygons; i++)
+        {
+            u32 id;
+            if (file->Saving)
+            {
+                id = (u32)(RenderPolygonRAM[i] - &PolygonRAM[0]);
+                file->Var32(&id);
+            }
+            else
+            {
+                file->Var32(&id);
+                RenderPolygonRAM[i] = &PolygonRAM[id & 0xFFF];
+            }
+        }
+    }
 }
 
 
@@ -2433,6 +2456,14 @@ s32 CyclesToRunFor()
     return CycleCount;
 }
 
+bool IsIdle()
+{
+    // same condition as the early-out in Run(): nothing to process, so no
+    // FIFO IRQs or DMAs can be triggered by letting time pass
+    return !GeometryEnabled || FlushRequest ||
+        (CmdPIPE.IsEmpty() && !(GXStat & (1<<27)));
+}
+
 void FinishWork(s32 cycles)
 {
     AddCycles(cycles);
@@ -2449,8 +2480,7 @@ void FinishWork(s32 cycles)
 
 void Run()
 {
-    if (!GeometryEnabled || FlushRequest ||
-        (CmdPIPE.IsEmpty() && !(GXStat & (1<<27))))
+    if (IsIdle())
     {
         Timestamp = NDS::ARM9Timestamp >> NDS::ARM9ClockShift;
         return;
@@ -112,6 +112,7 @@ void SetEnabled(bool geometry, bool rendering);
 void ExecuteCommand();
 
 s32 CyclesToRunFor();
+bool IsIdle();
 void Run();
 void CheckFIFOIRQ();
 void CheckFIFODMA();
@@ -1114,6 +1114,8 @@ void GLRenderer::RenderSceneChunk(int y, int h)
 
 void GLRenderer::RenderFrame()
 {
+    NDS::PerfScope perf(NDS::Perf_Rasterizer);
+
     CurShaderID = -1;
 
     glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
@@ -1619,6 +1619,8 @@ void SoftRenderer::ClearBuffers()
 
 void SoftRenderer::RenderPolygons(bool threaded, Polygon** polygons, int npolys)
 {
+    NDS::PerfScope perf(NDS::Perf_Rasterizer);
+
     int j = 0;
     for (int i = 0; i < npolys; i++)
     {
@@ -1672,7 +1674,21 @@ void SoftRenderer::RenderFrame()
 
 void SoftRenderer::RestartFrame()
 {
+    auto textureDirty = GPU::VRAMDirty_Texture.DeriveState(GPU::VRAMMap_Texture);
+    auto texPalDirty = GPU::VRAMDirty_TexPal.DeriveState(GPU::VRAMMap_TexPal);
+
+    GPU::MakeVRAMFlat_TextureCoherent(textureDirty);
+    GPU::MakeVRAMFlat_TexPalCoherent(texPalDirty);
+
+    // render the latched frame again, whether threaded or not
+    FrameIdentical = false;
     SetupRenderThread();
+
+    if (!Threaded)
+    {
+        ClearBuffers();
+        RenderPolygons(false, &RenderPolygonRAM[0], RenderNumPolygons);
+    }
 }
 
 void SoftRenderer::RenderThreadFunc()
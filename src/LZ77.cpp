@@ -0,0 +1,194 @@
+/*
+    Copyright 2016-2021 Arisotura
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+#include <string.h>
+#include <algorithm>
+#include "LZ77.h"
+
+/*
+    the data is a series of sequences, each made of:
+    * token: upper 4 bits = literal count, lower 4 bits = match length - 4
+    * if the literal count is 15: extra bytes added to it, until one isn't 255
+    * the literals
+    * match offset, 16-bit
+    * if the match length is 19: extra bytes added to it, until one isn't 255
+
+    the last sequence stops after its literals
+*/
+
+const u32 kMinMatch = 4;
+const u32 kMaxOffset = 0xFFFF;
+const int kHashBits = 14;
+
+
+u32 LZ77_MaxCompressedSize(u32 len)
+{
+    return len + (len / 255) + 16;
+}
+
+inline u32 Read32(const u8* ptr)
+{
+    u32 ret;
+    memcpy(&ret, ptr, 4);
+    return ret;
+}
+
+inline u8* WriteLength(u8* out, u32 len)
+{
+    while (len >= 255)
+    {
+        *out++ = 255;
+        len -= 255;
+    }
+
+    *out++ = len;
+    return out;
+}
+
+u8* WriteSequence(u8* out, const u8* literals, u32 numliterals, u32 offset, u32 matchlen)
+{
+    u8* token = out++;
+
+    if (numliterals >= 15)
+    {
+        *token = 0xF0;
+        out = WriteLength(out, numliterals - 15);
+    }
+    else
+        *token = numliterals << 4;
+
+    memcpy(out, literals, numliterals);
+    out += numliterals;
+
+    // the last sequence doesn't have a match
+    if (!matchlen) return out;
+
+    *out++ = offset & 0xFF;
+    *out++ = offset >> 8;
+
+    matchlen -= kMinMatch;
+    if (matchlen >= 15)
+    {
+        *token |= 0x0F;
+        out = WriteLength(out, matchlen - 15);
+    }
+    else
+        *token |= matchlen;
+
+    return out;
+}
+
+u32 LZ77_Compress(const u8* src, u32 len, u8* dst)
+{
+    u32 table[1 << kHashBits];
+    memset(table, 0, sizeof(table));
+
+    u8* out = dst;
+    u32 pos = 0;
+    u32 anchor = 0;
+
+    while (pos + kMinMatch <= len)
+    {
+        u32 seq = Read32(&src[pos]);
+        u32 hash = (seq * 2654435761U) >> (32 - kHashBits);
+        u32 cand = table[hash];
+        table[hash] = pos;
+
+        if (cand >= pos || (pos - cand) > kMaxOffset || Read32(&src[cand]) != seq)
+        {
+            // go faster through data that doesn't compress
+            pos += 1 + ((pos - anchor) >> 6);
+            continue;
+        }
+
+        u32 matchlen = kMinMatch;
+        while (pos + matchlen < len && src[cand + matchlen] == src[pos + matchlen])
+            matchlen++;
+
+        out = WriteSequence(out, &src[anchor], pos - anchor, pos - cand, matchlen);
+
+        pos += matchlen;
+        anchor = pos;
+    }
+
+    out = WriteSequence(out, &src[anchor], len - anchor, 0, 0);
+    return (u32)(out - dst);
+}
+
+bool LZ77_Decompress(const u8* src, u32 srclen, u8* dst, u32 dstlen)
+{
+    const u8* in = src;
+    const u8* inend = src + srclen;
+    u8* out = dst;
+    u8* outend = dst + dstlen;
+
+    auto readlength = [&](u32& len) -> bool
+    {
+        for (;;)
+        {
+            if (in >= inend) return false;
+            u8 val = *in++;
+            len += val;
+            if (val != 255) return true;
+        }
+    };
+
+    while (in < inend)
+    {
+        u8 token = *in++;
+
+        u32 numliterals = token >> 4;
+        if (numliterals == 15 && !readlength(numliterals))
+            return false;
+
+        if (numliterals > (u32)(inend - in) || numliterals > (u32)(outend - out))
+            return false;
+
+        memcpy(out, in, numliterals);
+        in += numliterals;
+        out += numliterals;
+
+        if (in == inend) break;
+
+        if ((inend - in) < 2) return false;
+        u32 offset = in[0] | (in[1] << 8);
+        in += 2;
+
+        u32 matchlen = token & 0x0F;
+        if (matchlen == 15 && !readlength(matchlen))
+            return false;
+        matchlen += kMinMatch;
+
+        if (offset == 0 || offset > (u32)(out - dst) || matchlen > (u32)(outend - out))
+            return false;
+
+        // if the match overlaps what it produces, it repeats the last
+        // 'offset' bytes. every copy doubles how much can be copied at once
+        const u8* match = out - offset;
+        while (matchlen)
+        {
+            u32 chunk = std::min(offset, matchlen);
+            memcpy(out, match, chunk);
+            out += chunk;
+            matchlen -= chunk;
+            offset += chunk;
+        }
+    }
+
+    return out == outend;
+}
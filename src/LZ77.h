@@ -0,0 +1,38 @@
+/*
+    Copyright 2016-2021 Arisotura
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+#ifndef LZ77_H
+#define LZ77_H
+
+#include "types.h"
+
+// byte-oriented LZ77 compression, made for speed rather than ratio
+// the format is close to LZ4's block format
+
+// how big the output of LZ77_Compress() can get for 'len' bytes of input
+u32 LZ77_MaxCompressedSize(u32 len);
+
+// compress 'len' bytes from 'src' into 'dst', which must hold at least
+// LZ77_MaxCompressedSize(len) bytes. returns the compressed length
+u32 LZ77_Compress(const u8* src, u32 len, u8* dst);
+
+// decompress 'srclen' bytes from 'src' into 'dst'
+// returns false if the data is corrupt or doesn't decompress to exactly 'dstlen' bytes
+bool LZ77_Decompress(const u8* src, u32 srclen, u8* dst, u32 dstlen);
+
+#endif // LZ77_H
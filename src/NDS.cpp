@@ -19,6 +19,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <inttypes.h>
+#include <atomic>
+#include <chrono>
 #include "Config.h"
 #include "NDS.h"
 #include "ARM.h"
@@ -98,15 +100,37 @@ u64 ARM9Timestamp, ARM9Target;
 u64 ARM7Timestamp, ARM7Target;
 u64 SysTimestamp;
 
-SchedEvent SchedList[Event_MAX];
-u32 SchedListMask;
+// the event scheduler's state and what acts on it, in one place, as a first
+// step towards a core that can be instantiated several times per process
+// (there is still only the one global instance)
+struct Scheduler
+{
+    SchedEvent List[Event_MAX];
+    u32 Mask;
+    u64 NextTimestamp; // timestamp of the earliest scheduled event, kept in sync with List
+
+    void Reset();
+    bool Add(u32 id, u64 timestamp, void (*func)(u32), u32 param);
+    void Cancel(u32 id);
+    void Run(u64 timestamp);
+    void UpdateNextTimestamp();
+};
+
+Scheduler Sched;
 
 u32 CPUStop;
 
+bool PerfCountersEnabled;
+// atomic since the rasterizer may run on its own thread
+std::atomic<u64> PerfTime[Perf_MAX];
+std::atomic<u32> PerfCalls[Perf_MAX];
+PerfCounters LastPerfCounters;
+
 u8 ARM9BIOS[0x1000];
 u8 ARM7BIOS[0x4000];
 
 u8* MainRAM;
+SavestateTracker MainRAMTracker(MainRAMMaxSize, 12);
 u32 MainRAMMask;
 
 u8* SharedWRAM;
@@ -557,6 +581,7 @@ void Reset()
     InitTimings();
 
     memset(MainRAM, 0, MainRAMMask + 1);
+    MainRAMTracker.WriteAll();
     memset(SharedWRAM, 0, 0x8000);
     memset(ARM7WRAM, 0, 0x10000);
 
@@ -611,8 +636,7 @@ void Reset()
     for (i = 0; i < 8; i++) DMAs[i]->Reset();
     memset(DMA9Fill, 0, 4*4);
 
-    memset(SchedList, 0, sizeof(SchedList));
-    SchedListMask = 0;
+    Sched.Reset();
 
     KeyInput = 0x007F03FF;
     KeyCnt = 0;
@@ -690,7 +714,7 @@ bool DoSavestate_Scheduler(Savestate* file)
     {
         for (int i = 0; i < len; i++)
         {
-            SchedEvent* evt = &SchedList[i];
+            SchedEvent* evt = &Sched.List[i];
 
             u32 funcid = -1;
             if (evt->Func)
@@ -719,7 +743,7 @@ bool DoSavestate_Scheduler(Savestate* file)
     {
         for (int i = 0; i < len; i++)
         {
-            SchedEvent* evt = &SchedList[i];
+            SchedEvent* evt = &Sched.List[i];
 
             u32 funcid;
             file->Var32(&funcid);
@@ -758,7 +782,13 @@ bool DoSavestate(Savestate* file)
     // * do something for 'loading DSi-mode savestate in DS mode' and vice-versa
     // * add IE2/IF2 there
 
-    file->VarArray(MainRAM, 0x400000);
+#ifdef JIT_ENABLED
+    // fast memory writes go around the tracking
+    if (Config::JIT_Enable && Config::JIT_FastMemory)
+        MainRAMTracker.WriteAll();
+#endif
+
+    file->VarArray(MainRAM, 0x400000, &MainRAMTracker);
     file->VarArray(SharedWRAM, 0x8000);
     file->VarArray(ARM7WRAM, ARM7WRAMSize);
 
@@ -806,7 +836,8 @@ bool DoSavestate(Savestate* file)
     file->VarArray(DMA9Fill, 4*sizeof(u32));
 
     if (!DoSavestate_Scheduler(file)) return false;
-    file->Var32(&SchedListMask);
+    file->Var32(&Sched.Mask);
+    if (!file->Saving) Sched.UpdateNextTimestamp();
     file->Var64(&ARM9Timestamp);
     file->Var64(&ARM9Target);
     file->Var64(&ARM7Timestamp);
@@ -863,7 +894,9 @@ bool DoSavestate(Savestate* file)
     }
 
 #ifdef JIT_ENABLED
-    if (!file->Saving)
+    // clearing the block cache takes a while, and there is nothing
+    // to clear if the JIT isn't in use
+    if (!file->Saving && Config::JIT_Enable)
     {
         ARMJIT::ResetBlockCache();
         ARMJIT_Memory::Reset();
@@ -892,9 +925,9 @@ bool LoadROM(const u8* romdata, u32 filelength, const char *sram, bool direct)
     }
 }
 
-bool LoadROM(const char* path, const char* sram, bool direct)
+bool LoadROM(const char* path, const char* sram, bool direct, bool mapfile)
 {
-    if (NDSCart::LoadROM(path, sram, direct))
+    if (NDSCart::LoadROM(path, sram, direct, mapfile))
     {
         Running = true;
         return true;
@@ -946,25 +979,132 @@ void RelocateSave(const char* path, bool write)
 
 
 
-u64 NextTarget()
+void Scheduler::Reset()
 {
-    u64 minEvent = UINT64_MAX;
+    memset(List, 0, sizeof(List));
+    Mask = 0;
+    NextTimestamp = UINT64_MAX;
+}
 
-    u32 mask = SchedListMask;
-    for (int i = 0; i < Event_MAX; i++)
+bool Scheduler::Add(u32 id, u64 timestamp, void (*func)(u32), u32 param)
+{
+    if (Mask & (1<<id))
     {
-        if (!mask) break;
-        if (mask & 0x1)
+        printf("!! EVENT %d ALREADY SCHEDULED\n", id);
+        return false;
+    }
+
+    SchedEvent* evt = &List[id];
+    evt->Timestamp = timestamp;
+    evt->Func = func;
+    evt->Param = param;
+
+    Mask |= (1<<id);
+    if (timestamp < NextTimestamp)
+        NextTimestamp = timestamp;
+
+    return true;
+}
+
+void Scheduler::Cancel(u32 id)
+{
+    if (!(Mask & (1<<id)))
+        return;
+
+    Mask &= ~(1<<id);
+    if (List[id].Timestamp == NextTimestamp)
+        UpdateNextTimestamp();
+}
+
+void Scheduler::Run(u64 timestamp)
+{
+    // events scheduled by the callbacks below are only considered on the next pass
+    u32 mask = Mask;
+    while (mask)
+    {
+        u32 i = __builtin_ctz(mask);
+        mask &= mask - 1;
+
+        if (List[i].Timestamp <= timestamp)
         {
-            if (SchedList[i].Timestamp < minEvent)
-                minEvent = SchedList[i].Timestamp;
+            Mask &= ~(1<<i);
+            List[i].Func(List[i].Param);
         }
+    }
+
+    UpdateNextTimestamp();
+}
+
+void Scheduler::UpdateNextTimestamp()
+{
+    u64 minEvent = UINT64_MAX;
+
+    u32 mask = Mask;
+    while (mask)
+    {
+        u32 i = __builtin_ctz(mask);
+        mask &= mask - 1;
+
+        if (List[i].Timestamp < minEvent)
+            minEvent = List[i].Timestamp;
+    }
+
+    NextTimestamp = minEvent;
+}
 
-        mask >>= 1;
+u64 NextTimerOverflow()
+{
+    u64 ret = UINT64_MAX;
+
+    // cascading timers are left out, they can only overflow along with
+    // the timer they're chained to
+    for (u32 cpu = 0; cpu < 2; cpu++)
+    {
+        u32 mask = TimerCheckMask[cpu];
+        while (mask)
+        {
+            u32 i = __builtin_ctz(mask);
+            mask &= mask - 1;
+
+            Timer* timer = &Timers[(cpu<<2)+i];
+            u32 step = 1 << timer->CycleShift;
+            u64 cycles = (((u64)1 << 26) - timer->Counter + step - 1) >> timer->CycleShift;
+
+            ret = std::min(ret, TimerTimestamp[cpu] + cycles);
+        }
     }
 
+    return ret;
+}
+
+bool CanSkipIdle()
+{
+    // both CPUs waiting for an IRQ, and nothing else that could raise one
+    // between scheduler events besides the timers
+    return ARM9->Halted == 1 && ARM7->Halted == 1 &&
+           !HaltInterrupted(0) && !HaltInterrupted(1) &&
+           CPUStop == 0 && GPU3D::IsIdle();
+}
+
+u64 NextTarget()
+{
+    u64 minEvent = Sched.NextTimestamp;
+
     u64 max = SysTimestamp + kMaxIterationCycles;
 
+    if (CanSkipIdle())
+    {
+        // jump straight to the iteration in which the next timer overflow
+        // would have been noticed, unless an event comes first. the CPUs
+        // wake up at the same point as they would by running every iteration.
+        u64 timer = std::min(NextTimerOverflow(), minEvent);
+        if (timer != UINT64_MAX && timer > max)
+        {
+            u64 iterations = (timer - SysTimestamp + kMaxIterationCycles - 1) / kMaxIterationCycles;
+            max = SysTimestamp + iterations * kMaxIterationCycles;
+        }
+    }
+
     if (minEvent < max + kIterationCycleMargin)
         return minEvent;
 
@@ -975,20 +1115,64 @@ void RunSystem(u64 timestamp)
 {
     SysTimestamp = timestamp;
 
-    u32 mask = SchedListMask;
-    for (int i = 0; i < Event_MAX; i++)
+    // nothing is due yet, which is the case for most iterations
+    if (Sched.NextTimestamp > SysTimestamp)
+        return;
+
+    PerfScope perf(Perf_Scheduler);
+    Sched.Run(SysTimestamp);
+}
+
+void SetPerfCountersEnabled(bool enable)
+{
+    for (int i = 0; i < Perf_MAX; i++)
     {
-        if (!mask) break;
-        if (mask & 0x1)
-        {
-            if (SchedList[i].Timestamp <= SysTimestamp)
-            {
-                SchedListMask &= ~(1<<i);
-                SchedList[i].Func(SchedList[i].Param);
-            }
-        }
+        PerfTime[i] = 0;
+        PerfCalls[i] = 0;
+    }
+    memset(&LastPerfCounters, 0, sizeof(LastPerfCounters));
 
-        mask >>= 1;
+    PerfCountersEnabled = enable;
+}
+
+void GetPerfCounters(PerfCounters* counters)
+{
+    *counters = LastPerfCounters;
+}
+
+u64 PerfTimestamp()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// the innermost scope being measured on this thread
+thread_local PerfScope* CurPerfScope = nullptr;
+
+void PerfBegin(PerfScope* scope)
+{
+    scope->Parent = CurPerfScope;
+    CurPerfScope = scope;
+    scope->Start = PerfTimestamp();
+}
+
+void PerfEnd(PerfScope* scope)
+{
+    u64 time = PerfTimestamp() - scope->Start;
+
+    PerfTime[scope->ID].fetch_add(time - scope->Nested, std::memory_order_relaxed);
+    PerfCalls[scope->ID].fetch_add(1, std::memory_order_relaxed);
+
+    if (scope->Parent) scope->Parent->Nested += time;
+    CurPerfScope = scope->Parent;
+}
+
+void EndPerfFrame()
+{
+    for (int i = 0; i < Perf_MAX; i++)
+    {
+        LastPerfCounters.Time[i] = PerfTime[i].exchange(0, std::memory_order_relaxed);
+        LastPerfCounters.Calls[i] = PerfCalls[i].exchange(0, std::memory_order_relaxed);
     }
 }
 
@@ -1018,6 +1202,7 @@ u32 RunFrame()
             }
             else if (CPUStop & 0x0FFF)
             {
+                PerfScope perf(Perf_DMA);
                 DMAs[0]->Run<ConsoleType>();
                 if (!(CPUStop & 0x80000000)) DMAs[1]->Run<ConsoleType>();
                 if (!(CPUStop & 0x80000000)) DMAs[2]->Run<ConsoleType>();
@@ -1026,6 +1211,7 @@ u32 RunFrame()
             }
             else
             {
+                PerfScope perf(Perf_ARM9);
 #ifdef JIT_ENABLED
                 if (EnableJIT)
                     ARM9->ExecuteJIT();
@@ -1035,7 +1221,10 @@ u32 RunFrame()
             }
 
             RunTimers(0);
-            GPU3D::Run();
+            {
+                PerfScope perf(Perf_GPU3D);
+                GPU3D::Run();
+            }
 
             target = ARM9Timestamp >> ARM9ClockShift;
             CurCPU = 1;
@@ -1046,6 +1235,7 @@ u32 RunFrame()
 
                 if (CPUStop & 0x0FFF0000)
                 {
+                    PerfScope perf(Perf_DMA);
                     DMAs[4]->Run<ConsoleType>();
                     DMAs[5]->Run<ConsoleType>();
                     DMAs[6]->Run<ConsoleType>();
@@ -1054,6 +1244,7 @@ u32 RunFrame()
                 }
                 else
                 {
+                    PerfScope perf(Perf_ARM7);
 #ifdef JIT_ENABLED
                     if (EnableJIT)
                         ARM7->ExecuteJIT();
@@ -1094,6 +1285,9 @@ u32 RunFrame()
     if (LagFrameFlag)
         NumLagFrames++;
 
+    if (PerfCountersEnabled)
+        EndPerfFrame();
+
     if (runFrame)
         return GPU::TotalScanlines;
     else
@@ -1130,35 +1324,26 @@ void Reschedule(u64 target)
 
 void ScheduleEvent(u32 id, bool periodic, s32 delay, void (*func)(u32), u32 param)
 {
-    if (SchedListMask & (1<<id))
-    {
-        printf("!! EVENT %d ALREADY SCHEDULED\n", id);
-        return;
-    }
-
-    SchedEvent* evt = &SchedList[id];
-
+    u64 timestamp;
     if (periodic)
-        evt->Timestamp += delay;
+        timestamp = Sched.List[id].Timestamp + delay;
     else
     {
         if (CurCPU == 0)
-            evt->Timestamp = (ARM9Timestamp >> ARM9ClockShift) + delay;
+            timestamp = (ARM9Timestamp >> ARM9ClockShift) + delay;
         else
-            evt->Timestamp = ARM7Timestamp + delay;
+            timestamp = ARM7Timestamp + delay;
     }
 
-    evt->Func = func;
-    evt->Param = param;
-
-    SchedListMask |= (1<<id);
+    if (!Sched.Add(id, timestamp, func, param))
+        return;
 
-    Reschedule(evt->Timestamp);
+    Reschedule(timestamp);
 }
 
 void CancelEvent(u32 id)
 {
-    SchedListMask &= ~(1<<id);
+    Sched.Cancel(id);
 }
 
 
@@ -2119,6 +2304,7 @@ void ARM9Write8(u32 addr, u8 val)
         ARMJIT::CheckAndInvalidate<0, ARMJIT_Memory::memregion_MainRAM>(addr);
 #endif
         *(u8*)&MainRAM[addr & MainRAMMask] = val;
+        MainRAMTracker.Write(addr & MainRAMMask);
         return;
 
     case 0x03000000:
@@ -2162,6 +2348,7 @@ void ARM9Write16(u32 addr, u16 val)
         ARMJIT::CheckAndInvalidate<0, ARMJIT_Memory::memregion_MainRAM>(addr);
 #endif
         *(u16*)&MainRAM[addr & MainRAMMask] = val;
+        MainRAMTracker.Write(addr & MainRAMMask);
         return;
 
     case 0x03000000:
@@ -2226,6 +2413,7 @@ void ARM9Write32(u32 addr, u32 val)
         ARMJIT::CheckAndInvalidate<0, ARMJIT_Memory::memregion_MainRAM>(addr);
 #endif
         *(u32*)&MainRAM[addr & MainRAMMask] = val;
+        MainRAMTracker.Write(addr & MainRAMMask);
         return ;
 
     case 0x03000000:
@@ -2520,6 +2708,7 @@ void ARM7Write8(u32 addr, u8 val)
         ARMJIT::CheckAndInvalidate<1, ARMJIT_Memory::memregion_MainRAM>(addr);
 #endif
         *(u8*)&MainRAM[addr & MainRAMMask] = val;
+        MainRAMTracker.Write(addr & MainRAMMask);
         return;
 
     case 0x03000000:
@@ -2586,6 +2775,7 @@ void ARM7Write16(u32 addr, u16 val)
         ARMJIT::CheckAndInvalidate<1, ARMJIT_Memory::memregion_MainRAM>(addr);
 #endif
         *(u16*)&MainRAM[addr & MainRAMMask] = val;
+        MainRAMTracker.Write(addr & MainRAMMask);
         return;
 
     case 0x03000000:
@@ -2662,6 +2852,7 @@ void ARM7Write32(u32 addr, u32 val)
         ARMJIT::CheckAndInvalidate<1, ARMJIT_Memory::memregion_MainRAM>(addr);
 #endif
         *(u32*)&MainRAM[addr & MainRAMMask] = val;
+        MainRAMTracker.Write(addr & MainRAMMask);
         return;
 
     case 0x03000000:
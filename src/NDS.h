@@ -62,6 +62,31 @@ struct SchedEvent
     u32 Param;
 };
 
+// subsystems tracked by the performance counters
+// the counters are exclusive: time spent in a nested counter (JIT compilation
+// while running the ARM9, GPU2D and SPU from scheduler events) only counts
+// towards that one
+enum
+{
+    Perf_ARM9 = 0,
+    Perf_ARM7,
+    Perf_DMA,
+    Perf_GPU3D,
+    Perf_GPU2D,
+    Perf_Rasterizer,
+    Perf_SPU,
+    Perf_Scheduler,
+    Perf_JIT,
+
+    Perf_MAX
+};
+
+struct PerfCounters
+{
+    u64 Time[Perf_MAX];     // host time, in nanoseconds
+    u32 Calls[Perf_MAX];
+};
+
 enum
 {
     IRQ_VBlank = 0,
@@ -226,7 +251,9 @@ void SetARM7RegionTimings(u32 addrstart, u32 addrend, u32 region, int buswidth,
 // 0=DS  1=DSi
 void SetConsoleType(int type);
 
-bool LoadROM(const char* path, const char* sram, bool direct);
+// mapfile: the ROM file won't change while it's loaded, so it can be mapped
+// instead of read in full
+bool LoadROM(const char* path, const char* sram, bool direct, bool mapfile = false);
 bool LoadROM(const u8* romdata, u32 filelength, const char *sram, bool direct);
 bool LoadGBAROM(const char* path, const char* sram);
 bool LoadGBAROM(const u8* romdata, u32 filelength, const char *filename, const char *sram);
@@ -236,6 +263,37 @@ void RelocateSave(const char* path, bool write);
 
 u32 RunFrame();
 
+// the performance counters are off by default, they cost two clock reads
+// per measured call when enabled
+extern bool PerfCountersEnabled;
+void SetPerfCountersEnabled(bool enable);
+// counters for the last frame that was run
+void GetPerfCounters(PerfCounters* counters);
+
+struct PerfScope;
+void PerfBegin(PerfScope* scope);
+void PerfEnd(PerfScope* scope);
+
+// measures the enclosing scope
+struct PerfScope
+{
+    PerfScope(u32 id) : ID(id), Enabled(PerfCountersEnabled), Start(0), Nested(0), Parent(nullptr)
+    {
+        if (Enabled) PerfBegin(this);
+    }
+
+    ~PerfScope()
+    {
+        if (Enabled) PerfEnd(this);
+    }
+
+    u32 ID;
+    bool Enabled;
+    u64 Start;
+    u64 Nested; // time spent in scopes within this one
+    PerfScope* Parent;
+};
+
 void TouchScreen(u16 x, u16 y);
 void ReleaseScreen();
 
@@ -18,6 +18,9 @@
 
 #include <stdio.h>
 #include <string.h>
+#if !defined(_WIN32) && !defined(__SWITCH__)
+#include <sys/mman.h>
+#endif
 #include "NDS.h"
 #include "DSi.h"
 #include "NDSCart.h"
@@ -54,6 +57,7 @@ bool CartInserted;
 char CartName[256];
 u8* CartROM;
 u32 CartROMSize;
+bool CartROMMapped; // CartROM is a mapping of the ROM file
 u32 CartID;
 bool CartIsHomebrew;
 bool CartIsDSi;
@@ -371,11 +375,13 @@ void CartCommon::ReadROM(u32 addr, u32 len, u8* data, u32 offset)
 CartRetail::CartRetail(u8* rom, u32 len, u32 chipid) : CartCommon(rom, len, chipid)
 {
     SRAM = nullptr;
+    SRAMTracker = nullptr;
 }
 
 CartRetail::~CartRetail()
 {
     if (SRAM) delete[] SRAM;
+    if (SRAMTracker) delete SRAMTracker;
 }
 
 void CartRetail::Reset()
@@ -407,14 +413,33 @@ void CartRetail::DoSavestate(Savestate* file)
         printf("oh well. loading it anyway. adsfgdsf\n");
 
         if (oldlen) delete[] SRAM;
-        if (SRAMLength) SRAM = new u8[SRAMLength];
+        if (SRAMTracker) delete SRAMTracker;
+        SRAMTracker = nullptr;
+        if (SRAMLength)
+        {
+            SRAM = new u8[SRAMLength];
+            SRAMTracker = new SavestateTracker(SRAMLength, 9);
+        }
     }
     if (SRAMLength)
     {
         //if (!file->Saving)
         //    SRAM = new u8[SRAMLength];
 
-        file->VarArray(SRAM, SRAMLength);
+        u32 gen = SRAMTracker->Generation;
+        file->VarArray(SRAM, SRAMLength, SRAMTracker);
+
+        // whatever was restored is tagged with the generation it was loaded in,
+        // the SRAM manager only needs to look at that
+        if (!file->Saving)
+        {
+            u32 pagesize = 1 << SRAMTracker->PageShift;
+            for (u32 i = 0; i < SRAMTracker->NumPages; i++)
+            {
+                if (SRAMTracker->Pages[i] == gen)
+                    NDSCart_SRAMManager::MarkWritten(i * pagesize, pagesize);
+            }
+        }
     }
 
     // SPI status shito
@@ -434,6 +459,9 @@ void CartRetail::DoSavestate(Savestate* file)
 void CartRetail::LoadSave(const char* path, u32 type)
 {
     if (SRAM) delete[] SRAM;
+    if (SRAMTracker) delete SRAMTracker;
+    SRAM = nullptr;
+    SRAMTracker = nullptr;
 
     strncpy(SRAMPath, path, 1023);
     SRAMPath[1023] = '\0';
@@ -453,6 +481,7 @@ void CartRetail::LoadSave(const char* path, u32 type)
     {
         SRAM = new u8[SRAMLength];
         memset(SRAM, 0xFF, SRAMLength);
+        SRAMTracker = new SavestateTracker(SRAMLength, 9); // same pages as the SRAM manager
     }
 
     FILE* f = Platform::OpenFile(path, "rb");
@@ -508,6 +537,7 @@ void CartRetail::RelocateSave(const char* path, bool write)
 int CartRetail::ImportSRAM(const u8* data, u32 length)
 {
     memcpy(SRAM, data, std::min(length, SRAMLength));
+    SRAMWritten(0, SRAMLength);
     FILE* f = Platform::OpenFile(SRAMPath, "wb");
     if (f)
     {
@@ -518,6 +548,18 @@ int CartRetail::ImportSRAM(const u8* data, u32 length)
     return length - SRAMLength;
 }
 
+void CartRetail::SRAMWritten(u32 offset, u32 len)
+{
+    if (SRAMTracker)
+    {
+        u32 pagesize = 1 << SRAMTracker->PageShift;
+        for (u32 pos = offset & ~(pagesize-1); pos < (offset+len); pos += pagesize)
+            SRAMTracker->Write(pos);
+    }
+
+    NDSCart_SRAMManager::MarkWritten(offset, len);
+}
+
 void CartRetail::FlushSRAMFile()
 {
     if (!SRAMFileDirty) return;
@@ -630,7 +672,9 @@ u8 CartRetail::SRAMWrite_EEPROMTiny(u8 val, u32 pos, bool last)
             // TODO: implement WP bits!
             if (SRAMStatus & (1<<1))
             {
-                SRAM[(SRAMAddr + ((SRAMCmd==0x0A)?0x100:0)) & 0x1FF] = val;
+                u32 addr = (SRAMAddr + ((SRAMCmd==0x0A)?0x100:0)) & 0x1FF;
+                SRAM[addr] = val;
+                SRAMWritten(addr, 1);
                 SRAMFileDirty |= last;
             }
             SRAMAddr++;
@@ -690,6 +734,7 @@ u8 CartRetail::SRAMWrite_EEPROM(u8 val, u32 pos, bool last)
             if (SRAMStatus & (1<<1))
             {
                 SRAM[SRAMAddr & (SRAMLength-1)] = val;
+                SRAMWritten(SRAMAddr & (SRAMLength-1), 1);
                 SRAMFileDirty |= last;
             }
             SRAMAddr++;
@@ -742,6 +787,7 @@ u8 CartRetail::SRAMWrite_FLASH(u8 val, u32 pos, bool last)
             {
                 // CHECKME: should it be &=~val ??
                 SRAM[SRAMAddr & (SRAMLength-1)] = 0;
+                SRAMWritten(SRAMAddr & (SRAMLength-1), 1);
                 SRAMFileDirty |= last;
             }
             SRAMAddr++;
@@ -774,6 +820,7 @@ u8 CartRetail::SRAMWrite_FLASH(u8 val, u32 pos, bool last)
             if (SRAMStatus & (1<<1))
             {
                 SRAM[SRAMAddr & (SRAMLength-1)] = val;
+                SRAMWritten(SRAMAddr & (SRAMLength-1), 1);
                 SRAMFileDirty |= last;
             }
             SRAMAddr++;
@@ -815,6 +862,7 @@ u8 CartRetail::SRAMWrite_FLASH(u8 val, u32 pos, bool last)
             for (u32 i = 0; i < 0x10000; i++)
             {
                 SRAM[SRAMAddr & (SRAMLength-1)] = 0;
+                SRAMWritten(SRAMAddr & (SRAMLength-1), 1);
                 SRAMAddr++;
             }
             SRAMFileDirty = true;
@@ -833,6 +881,7 @@ u8 CartRetail::SRAMWrite_FLASH(u8 val, u32 pos, bool last)
             for (u32 i = 0; i < 0x100; i++)
             {
                 SRAM[SRAMAddr & (SRAMLength-1)] = 0;
+                SRAMWritten(SRAMAddr & (SRAMLength-1), 1);
                 SRAMAddr++;
             }
             SRAMFileDirty = true;
@@ -926,6 +975,7 @@ int CartRetailNAND::ROMCommandStart(u8* cmd, u8* data, u32 len)
             if (SRAMLength && SRAMAddr < (SRAMBase+SRAMLength-0x20000))
             {
                 memcpy(&SRAM[SRAMAddr - SRAMBase], SRAMWriteBuffer, 0x800);
+                SRAMWritten(SRAMAddr - SRAMBase, 0x800);
                 SRAMFileDirty = true;
             }
 
@@ -1078,6 +1128,7 @@ void CartRetailNAND::BuildSRAMID()
         // there is also more data here, but JwtB doesn't seem to care.
         u8 iddata[0x10] = {0xEC, 0x00, 0x9E, 0xA1, 0x51, 0x65, 0x34, 0x35, 0x30, 0x35, 0x30, 0x31, 0x19, 0x19, 0x02, 0x0A};
         memcpy(&SRAM[SRAMLength - 0x800], iddata, 16);
+        SRAMWritten(SRAMLength - 0x20000, 0x20000);
     }
 }
 
@@ -1439,9 +1490,56 @@ void CartHomebrew::ReadROM_B7(u32 addr, u32 len, u8* data, u32 offset)
 
 
 
+// map the ROM file in memory rather than reading all of it
+// the mapping is private: the pages that get modified (secure area, DLDI
+// patch) are copied, the rest stays shared with the page cache, and thus
+// with anything else that has the same ROM open
+// the pages that aren't modified are still backed by the file, so this is
+// only safe for files that nothing rewrites in place (the archive cache
+// replaces its files by renaming) -- a ROM that gets rebuilt while it's
+// loaded would otherwise change under us, or fault if it got shorter
+u8* MapROMFile(FILE* f, u32 len, u32 size)
+{
+#if defined(_WIN32) || defined(__SWITCH__)
+    return nullptr;
+#else
+    if (len == 0) return nullptr;
+
+    // reserve the whole power-of-two area, the part past the end of
+    // the file reads as zero
+    u8* area = (u8*)mmap(nullptr, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (area == MAP_FAILED) return nullptr;
+
+    void* rom = mmap(area, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED, fileno(f), 0);
+    if (rom == MAP_FAILED)
+    {
+        munmap(area, size);
+        return nullptr;
+    }
+
+    return area;
+#endif
+}
+
+void FreeROM()
+{
+    if (!CartROM) return;
+
+#if !defined(_WIN32) && !defined(__SWITCH__)
+    if (CartROMMapped)
+        munmap(CartROM, CartROMSize);
+    else
+#endif
+        delete[] CartROM;
+
+    CartROM = nullptr;
+    CartROMMapped = false;
+}
+
 bool Init()
 {
     CartROM = nullptr;
+    CartROMMapped = false;
     Cart = nullptr;
 
     return true;
@@ -1449,15 +1547,14 @@ bool Init()
 
 void DeInit()
 {
-    if (CartROM) delete[] CartROM;
+    FreeROM();
     if (Cart) delete Cart;
 }
 
 void Reset()
 {
     CartInserted = false;
-    if (CartROM) delete[] CartROM;
-    CartROM = nullptr;
+    FreeROM();
     CartROMSize = 0;
     CartID = 0;
     CartIsHomebrew = false;
@@ -1703,11 +1800,9 @@ bool LoadROMCommon(u32 filelength, const char *sram, bool direct)
     return true;
 }
 
-bool LoadROM(const char* path, const char* sram, bool direct)
+bool LoadROM(const char* path, const char* sram, bool direct, bool mapfile)
 {
-    // TODO: streaming mode? for really big ROMs or systems with limited RAM
-    // for now we're lazy
-    // also TODO: validate what we're loading!!
+    // TODO: validate what we're loading!!
 
     FILE* f = Platform::OpenFile(path, "rb");
     if (!f)
@@ -1734,10 +1829,16 @@ bool LoadROM(const char* path, const char* sram, bool direct)
     while (CartROMSize < len)
         CartROMSize <<= 1;
 
-    CartROM = new u8[CartROMSize];
-    memset(CartROM, 0, CartROMSize);
-    fseek(f, 0, SEEK_SET);
-    fread(CartROM, 1, len, f);
+    CartROM = mapfile ? MapROMFile(f, len, CartROMSize) : nullptr;
+    CartROMMapped = (CartROM != nullptr);
+    if (!CartROM)
+    {
+        // just read the whole thing
+        CartROM = new u8[CartROMSize];
+        memset(CartROM, 0, CartROMSize);
+        fseek(f, 0, SEEK_SET);
+        fread(CartROM, 1, len, f);
+    }
 
     fclose(f);
 
@@ -22,6 +22,7 @@
 #include "types.h"
 #include "NDS_Header.h"
 #include "FATStorage.h"
+#include "Savestate.h"
 
 namespace NDSCart
 {
@@ -91,9 +92,12 @@ protected:
     u8 SRAMWrite_EEPROM(u8 val, u32 pos, bool last);
     u8 SRAMWrite_FLASH(u8 val, u32 pos, bool last);
 
+    void SRAMWritten(u32 offset, u32 len);
+
     u8* SRAM;
     u32 SRAMLength;
     u32 SRAMType;
+    SavestateTracker* SRAMTracker;
 
     char SRAMPath[1024];
     bool SRAMFileDirty;
@@ -207,7 +211,7 @@ void Reset();
 void DoSavestate(Savestate* file);
 
 void DecryptSecureArea(u8* out);
-bool LoadROM(const char* path, const char* sram, bool direct);
+bool LoadROM(const char* path, const char* sram, bool direct, bool mapfile);
 bool LoadROM(const u8* romdata, u32 filelength, const char *sram, bool direct);
 
 void FlushSRAMFile();
@@ -20,16 +20,46 @@
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#ifdef _WIN32
+#include <io.h>
+#endif
+#include <algorithm>
 #include <atomic>
+#include <string>
+#include <vector>
 #include "NDSCart_SRAMManager.h"
+#include "CRC32.h"
 #include "Platform.h"
 
 namespace NDSCart_SRAMManager
 {
 
+/*
+    only the parts of the save that changed are written to the file.
+    the cart tells us which pages of the SRAM it writes to, and flush
+    requests compare only those against the secondary buffer (which holds
+    what the file should contain), marking the pages that differ as dirty.
+
+    so that a crash can't leave the save file half-written, the dirty pages
+    go to a journal first:
+    00 - magic MSRJ
+    04 - number of ranges
+    08 - ranges: offset, length, data
+    xx - CRC32 of everything before it
+    once the journal is complete, the ranges are written to the save file,
+    then the journal is removed. if a complete journal is found when the
+    save is loaded, it is applied again.
+
+    when the whole file has to be written (new save, different size), it
+    is written to a temporary file which then replaces the save file.
+*/
+
+const u32 kPageSize = 0x200;
+
 Platform::Thread* FlushThread;
 std::atomic_bool FlushThreadRunning;
 Platform::Mutex* SecondaryBufferLock;
+Platform::Mutex* FileLock; // held while the save file is being written to
 
 char Path[1024];
 
@@ -39,6 +69,11 @@ u32 Length;
 u8* SecondaryBuffer;
 u32 SecondaryBufferLength;
 
+u32 NumPages;
+u8* WrittenPages; // written by the emulator since the last flush request
+u8* DirtyPages;
+bool FullWriteNeeded; // the file doesn't match the size of the save
+
 time_t TimeAtLastFlushRequest;
 
 // We keep versions in case the user closes the application before
@@ -47,10 +82,12 @@ u32 PreviousFlushVersion;
 u32 FlushVersion;
 
 void FlushThreadFunc();
+bool ReplayJournal(const char* path, u8* buffer, u32 length);
 
 bool Init()
 {
     SecondaryBufferLock = Platform::Mutex_Create();
+    FileLock = Platform::Mutex_Create();
 
     return true;
 }
@@ -68,7 +105,14 @@ void DeInit()
     if (SecondaryBuffer) delete[] SecondaryBuffer;
     SecondaryBuffer = NULL;
 
+    if (WrittenPages) delete[] WrittenPages;
+    WrittenPages = NULL;
+
+    if (DirtyPages) delete[] DirtyPages;
+    DirtyPages = NULL;
+
     Platform::Mutex_Free(SecondaryBufferLock);
+    Platform::Mutex_Free(FileLock);
 }
 
 void Setup(const char* path, u8* buffer, u32 length)
@@ -76,6 +120,7 @@ void Setup(const char* path, u8* buffer, u32 length)
     // Flush SRAM in case there is unflushed data from previous state.
     FlushSecondaryBuffer();
 
+    Platform::Mutex_Lock(FileLock);
     Platform::Mutex_Lock(SecondaryBufferLock);
 
     strncpy(Path, path, 1023);
@@ -85,15 +130,48 @@ void Setup(const char* path, u8* buffer, u32 length)
     Length = length;
 
     if(SecondaryBuffer) delete[] SecondaryBuffer; // Delete secondary buffer, there might be previous state.
+    if(WrittenPages) delete[] WrittenPages;
+    if(DirtyPages) delete[] DirtyPages;
 
     SecondaryBuffer = new u8[length];
     SecondaryBufferLength = length;
 
+    NumPages = (length + kPageSize - 1) / kPageSize;
+    WrittenPages = new u8[NumPages];
+    memset(WrittenPages, 0, NumPages);
+    DirtyPages = new u8[NumPages];
+    memset(DirtyPages, 0, NumPages);
+
     FlushVersion = 0;
     PreviousFlushVersion = 0;
     TimeAtLastFlushRequest = 0;
 
+    // the file will only be written to in place if it has the right size
+    FullWriteNeeded = true;
+    if (path[0] != '\0')
+    {
+        FILE* f = Platform::OpenFile(path, "rb", true);
+        if (f)
+        {
+            fseek(f, 0, SEEK_END);
+            FullWriteNeeded = ((u32)ftell(f) != length);
+            fclose(f);
+        }
+
+        // if we crashed while writing the save, finish the job
+        if (ReplayJournal(path, buffer, length))
+        {
+            FullWriteNeeded = true;
+            FlushVersion++;
+            TimeAtLastFlushRequest = time(NULL);
+        }
+    }
+
+    // the secondary buffer holds what's in the file
+    memcpy(SecondaryBuffer, buffer, length);
+
     Platform::Mutex_Unlock(SecondaryBufferLock);
+    Platform::Mutex_Unlock(FileLock);
 
     if (path[0] != '\0' && !FlushThreadRunning)
     {
@@ -108,11 +186,51 @@ void Setup(const char* path, u8* buffer, u32 length)
     }
 }
 
+void MarkWritten(u32 offset, u32 len)
+{
+    if (!WrittenPages || offset >= Length) return;
+
+    u32 end = std::min(Length - offset, len) + offset;
+    for (u32 i = offset / kPageSize; (i * kPageSize) < end; i++)
+        WrittenPages[i] = 1;
+}
+
 void RequestFlush()
 {
+    // nothing else writes to the secondary buffer, so it can be compared
+    // against without holding the lock
+    std::vector<u32> changed;
+    for (u32 i = 0; i < NumPages; i++)
+    {
+        if (!WrittenPages[i]) continue;
+        WrittenPages[i] = 0;
+
+        u32 offset = i * kPageSize;
+        u32 len = std::min(kPageSize, Length - offset);
+
+        if (memcmp(&SecondaryBuffer[offset], &Buffer[offset], len))
+            changed.push_back(i);
+    }
+
     Platform::Mutex_Lock(SecondaryBufferLock);
+
+    // a save file that doesn't exist yet still needs to be created
+    if (changed.empty() && !FullWriteNeeded)
+    {
+        Platform::Mutex_Unlock(SecondaryBufferLock);
+        return;
+    }
+
     printf("NDS SRAM: Flush requested\n");
-    memcpy(SecondaryBuffer, Buffer, Length);
+
+    for (u32 i : changed)
+    {
+        u32 offset = i * kPageSize;
+        u32 len = std::min(kPageSize, Length - offset);
+
+        memcpy(&SecondaryBuffer[offset], &Buffer[offset], len);
+        DirtyPages[i] = 1;
+    }
     FlushVersion++;
     TimeAtLastFlushRequest = time(NULL);
     Platform::Mutex_Unlock(SecondaryBufferLock);
@@ -136,6 +254,127 @@ void FlushThreadFunc()
     }
 }
 
+// make sure the data actually made it to the disk
+void SyncFile(FILE* f)
+{
+    fflush(f);
+#ifdef _WIN32
+    _commit(_fileno(f));
+#else
+    fsync(fileno(f));
+#endif
+}
+
+bool WriteWholeFile(const char* path, const u8* data, u32 len)
+{
+    std::string tmppath = std::string(path) + ".tmp";
+
+    FILE* f = Platform::OpenFile(tmppath.c_str(), "wb");
+    if (!f) return false;
+
+    bool ok = fwrite(data, len, 1, f) == 1 || len == 0;
+    SyncFile(f);
+    if (fclose(f) != 0) ok = false;
+
+    if (!ok || !Platform::RenameFile(tmppath.c_str(), path))
+    {
+        Platform::RemoveFile(tmppath.c_str());
+        return false;
+    }
+
+    // an old journal would only undo this
+    Platform::RemoveFile((std::string(path) + ".journal").c_str());
+    return true;
+}
+
+bool WriteJournaled(const char* path, const std::vector<u8>& journal)
+{
+    std::string journalpath = std::string(path) + ".journal";
+
+    FILE* f = Platform::OpenFile(journalpath.c_str(), "wb");
+    if (!f) return false;
+
+    bool ok = fwrite(journal.data(), journal.size(), 1, f) == 1;
+    SyncFile(f);
+    if (fclose(f) != 0) ok = false;
+    if (!ok) return false;
+
+    // the journal is safe, now the ranges can go to the save file
+    f = Platform::OpenFile(path, "r+b", true);
+    if (!f) return false;
+
+    u32 numranges = *(u32*)&journal[4];
+    u32 pos = 8;
+    for (u32 i = 0; i < numranges; i++)
+    {
+        u32 offset = *(u32*)&journal[pos];
+        u32 len = *(u32*)&journal[pos+4];
+        pos += 8;
+
+        fseek(f, offset, SEEK_SET);
+        if (fwrite(&journal[pos], len, 1, f) != 1) ok = false;
+        pos += len;
+    }
+
+    SyncFile(f);
+    if (fclose(f) != 0) ok = false;
+
+    // keep the journal around if something went wrong, it will fix the save
+    // file next time it's loaded
+    if (ok) Platform::RemoveFile(journalpath.c_str());
+    return ok;
+}
+
+bool ReplayJournal(const char* path, u8* buffer, u32 length)
+{
+    std::string journalpath = std::string(path) + ".journal";
+
+    FILE* f = Platform::OpenFile(journalpath.c_str(), "rb", true);
+    if (!f) return false;
+
+    fseek(f, 0, SEEK_END);
+    u32 len = (u32)ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    std::vector<u8> journal(len);
+    bool ok = len >= 12 && fread(journal.data(), len, 1, f) == 1;
+    fclose(f);
+
+    // an incomplete journal means the save file wasn't touched yet
+    ok = ok && *(u32*)&journal[0] == *(u32*)"MSRJ"
+            && CRC32(journal.data(), len - 4) == *(u32*)&journal[len - 4];
+
+    u32 numranges = ok ? *(u32*)&journal[4] : 0;
+    u32 pos = 8;
+    for (u32 i = 0; ok && i < numranges; i++)
+    {
+        if ((len - 4 - pos) < 8) { ok = false; break; }
+
+        u32 offset = *(u32*)&journal[pos];
+        u32 rangelen = *(u32*)&journal[pos+4];
+        pos += 8;
+
+        if (rangelen > (len - 4 - pos) || offset > length || rangelen > (length - offset))
+        {
+            ok = false;
+            break;
+        }
+
+        memcpy(&buffer[offset], &journal[pos], rangelen);
+        pos += rangelen;
+    }
+
+    if (!ok)
+    {
+        printf("NDS SRAM: discarding incomplete journal\n");
+        Platform::RemoveFile(journalpath.c_str());
+        return false;
+    }
+
+    printf("NDS SRAM: recovered unfinished write from journal\n");
+    return true;
+}
+
 void FlushSecondaryBuffer(u8* dst, s32 dstLength)
 {
     // When flushing to a file, there's no point in re-writing the exact same data.
@@ -143,24 +382,93 @@ void FlushSecondaryBuffer(u8* dst, s32 dstLength)
     // When flushing to memory, we don't know if dst already has any data so we only check that we CAN flush.
     if (dst && dstLength < SecondaryBufferLength) return;
 
-    Platform::Mutex_Lock(SecondaryBufferLock);
     if (dst)
     {
+        Platform::Mutex_Lock(SecondaryBufferLock);
         memcpy(dst, SecondaryBuffer, SecondaryBufferLength);
+        PreviousFlushVersion = FlushVersion;
+        TimeAtLastFlushRequest = 0;
+        Platform::Mutex_Unlock(SecondaryBufferLock);
+        return;
+    }
+
+    Platform::Mutex_Lock(FileLock);
+    Platform::Mutex_Lock(SecondaryBufferLock);
+
+    // take what needs writing, so the file can be written without holding
+    // up the emulator
+    bool full = FullWriteNeeded;
+    std::vector<u8> data;
+    if (full)
+    {
+        data.assign(SecondaryBuffer, SecondaryBuffer + SecondaryBufferLength);
     }
     else
     {
-        FILE* f = Platform::OpenFile(Path, "wb");
-        if (f)
+        u32 numranges = 0;
+        data.resize(8);
+        memcpy(&data[0], "MSRJ", 4);
+
+        for (u32 i = 0; i < NumPages; )
         {
-            printf("NDS SRAM: Written\n");
-            fwrite(SecondaryBuffer, SecondaryBufferLength, 1, f);
-            fclose(f);
+            if (!DirtyPages[i]) { i++; continue; }
+
+            u32 start = i;
+            while (i < NumPages && DirtyPages[i]) i++;
+
+            u32 offset = start * kPageSize;
+            u32 len = std::min(i * kPageSize, Length) - offset;
+
+            u32 pos = data.size();
+            data.resize(pos + 8 + len);
+            memcpy(&data[pos], &offset, 4);
+            memcpy(&data[pos+4], &len, 4);
+            memcpy(&data[pos+8], &SecondaryBuffer[offset], len);
+            numranges++;
         }
+
+        memcpy(&data[4], &numranges, 4);
+
+        u32 crc = CRC32(data.data(), data.size());
+        data.resize(data.size() + 4);
+        memcpy(&data[data.size() - 4], &crc, 4);
     }
+
+    memset(DirtyPages, 0, NumPages);
+    FullWriteNeeded = false;
     PreviousFlushVersion = FlushVersion;
     TimeAtLastFlushRequest = 0;
+
+    char path[1024];
+    strcpy(path, Path);
+
     Platform::Mutex_Unlock(SecondaryBufferLock);
+
+    bool ok = true;
+    if (path[0] != '\0')
+    {
+        if (full)
+            ok = WriteWholeFile(path, data.data(), data.size());
+        else
+            ok = WriteJournaled(path, data);
+
+        if (ok)
+            printf("NDS SRAM: Written%s\n", full ? "" : " (changes only)");
+        else
+            printf("NDS SRAM: failed to write %s\n", path);
+    }
+
+    if (!ok)
+    {
+        // try again later, with the whole thing
+        Platform::Mutex_Lock(SecondaryBufferLock);
+        FullWriteNeeded = true;
+        FlushVersion++;
+        TimeAtLastFlushRequest = time(NULL);
+        Platform::Mutex_Unlock(SecondaryBufferLock);
+    }
+
+    Platform::Mutex_Unlock(FileLock);
 }
 
 bool NeedsFlush()
@@ -176,6 +484,8 @@ void UpdateBuffer(u8* src, s32 srcLength)
     memcpy(Buffer, src, srcLength);
     Platform::Mutex_Lock(SecondaryBufferLock);
     memcpy(SecondaryBuffer, src, srcLength);
+    // the file doesn't have any of this, so it will need rewriting if it gets flushed
+    FullWriteNeeded = true;
     Platform::Mutex_Unlock(SecondaryBufferLock);
 
     PreviousFlushVersion = FlushVersion;
@@ -29,6 +29,7 @@ namespace NDSCart_SRAMManager
     void DeInit();
 
     void Setup(const char* path, u8* buffer, u32 length);
+    void MarkWritten(u32 offset, u32 len);
     void RequestFlush();
 
     bool NeedsFlush();
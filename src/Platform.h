@@ -72,10 +72,20 @@ std::string GetConfigString(ConfigEntry entry);
 //     Opens a file that was installed alongside melonDS on UNIX systems in /usr/share, etc.
 //     Looks in the user's data directory first, then the system's.
 //     If on Windows or a portable UNIX build, this simply calls OpenLocalFile().
+// * RenameFile():
+//     rename() wrapper that supports UTF8, and replaces the destination if it exists.
+// * RenameLocalFile():
+//     same as RenameFile(), with paths resolved the same way as with OpenLocalFile()
+//     in create mode.
+// * RemoveFile():
+//     remove() wrapper that supports UTF8.
 
 FILE* OpenFile(const char* path, const char* mode, bool mustexist=false);
 FILE* OpenLocalFile(const char* path, const char* mode);
 FILE* OpenDataFile(const char* path);
+bool RenameFile(const char* oldpath, const char* newpath);
+bool RenameLocalFile(const char* oldpath, const char* newpath);
+bool RemoveFile(const char* path);
 
 inline bool FileExists(const char* name)
 {
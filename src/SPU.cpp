@@ -18,12 +18,27 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <algorithm>
+#include <atomic>
 #include <cmath>
 #include "Platform.h"
 #include "NDS.h"
 #include "DSi.h"
 #include "SPU.h"
 
+#if defined(__x86_64__) || defined(_M_X64)
+    #define SIMD_MIXER_SUPPORTED
+    #include <immintrin.h>
+    #ifdef _MSC_VER
+        #include <intrin.h>
+        #define SSE41_TARGET
+        #define AVX2_TARGET
+    #else
+        #include <cpuid.h>
+        #define SSE41_TARGET __attribute__((target("sse4.1")))
+        #define AVX2_TARGET __attribute__((target("avx2")))
+    #endif
+#endif
 
 // SPU TODO
 // * capture addition modes, overflow bugs
@@ -72,21 +87,64 @@ const u32 OutputBufferSize = 2*2048;
 s16 OutputBackbuffer[2 * OutputBufferSize];
 u32 OutputBackbufferWritePosition;
 
+// mixer output, before master volume and bias are applied
+// samples are converted in bulk, whenever something that affects that
+// conversion is about to change, or at the end of the frame
+s32 OutputMixBuffer[2 * OutputBufferSize];
+u32 OutputMixBufferReadPosition;
+
+// ring buffer between the emulator thread, which adds a frame's worth of
+// samples at a time, and the audio thread, which reads them
+// positions are free-running stereo sample counts. only the emulator
+// thread moves the write position, and only the reader moves the read
+// position, so neither side ever has to wait for the other.
+// the emulator thread can't move the read position itself: to drop
+// samples, it sets the discard position, which the reader skips to.
 s16 OutputFrontBuffer[2 * OutputBufferSize];
-u32 OutputFrontBufferWritePosition;
-u32 OutputFrontBufferReadPosition;
-
-Platform::Mutex* AudioLock;
+std::atomic<u32> OutputFrontBufferWritePosition;
+std::atomic<u32> OutputFrontBufferReadPosition;
+std::atomic<u32> OutputFrontBufferDiscardPosition;
 
 u16 Cnt;
 u8 MasterVolume;
 u16 Bias;
 bool ApplyBias;
 bool Degrade10Bit;
+bool SkipOutput;
+
+// the output settings can be changed from other threads. the new values
+// are only applied on the emulator thread, once the samples mixed with the
+// old ones have been converted. -1 = no change pending
+std::atomic<int> PendingBias(-1);
+std::atomic<int> PendingApplyBias(-1);
+std::atomic<int> PendingDegrade10Bit(-1);
 
 Channel* Channels[16];
 CaptureUnit* Capture[2];
 
+// channel mixing parameters, kept as arrays to mix several channels at once
+alignas(32) s32 MixSample[16];   // current sample, before volume
+alignas(32) s32 MixVolume[16];   // volume << volume shift
+alignas(32) s32 MixPanLeft[16];  // 128 - pan
+alignas(32) s32 MixPanRight[16]; // pan
+
+void (*MixChannels)(s32& left, s32& right);
+void (*FinishOutput)(const s32* in, s16* out, u32 len);
+
+// samples are mixed in batches, up to the current time whenever the
+// SPU registers are accessed, so that the ARM7 sees the same state as
+// if they had been mixed one at a time
+const u32 SampleCycles = 1024; // 1 sample = 1024 cycles at 33MHz
+const u32 BatchSamples = 32;
+u64 NextSampleTime; // when the next sample is due
+u64 MixTarget;      // timestamp of the pending Event_SPU
+
+void SelectMixer();
+void FlushOutput();
+void ApplyOutputSettings();
+void ScheduleMix();
+void DiscardOutput(u32 keep);
+
 
 bool Init()
 {
@@ -96,7 +154,9 @@ bool Init()
     Capture[0] = new CaptureUnit(0);
     Capture[1] = new CaptureUnit(1);
 
-    AudioLock = Platform::Mutex_Create();
+    SelectMixer();
+    OutputBackbufferWritePosition = 0;
+    OutputMixBufferReadPosition = 0;
 
     InterpType = 0;
 
@@ -134,8 +194,6 @@ void DeInit()
 
     delete Capture[0];
     delete Capture[1];
-
-    Platform::Mutex_Free(AudioLock);
 }
 
 void Reset()
@@ -152,22 +210,24 @@ void Reset()
     Capture[0]->Reset();
     Capture[1]->Reset();
 
-    NDS::ScheduleEvent(NDS::Event_SPU, true, 1024, Mix, 0);
+    NextSampleTime = SampleCycles;
+    MixTarget = 0;
+    ScheduleMix();
 }
 
 void Stop()
 {
-    Platform::Mutex_Lock(AudioLock);
-    memset(OutputFrontBuffer, 0, 2*OutputBufferSize*2);
-
     OutputBackbufferWritePosition = 0;
-    OutputFrontBufferReadPosition = 0;
-    OutputFrontBufferWritePosition = 0;
-    Platform::Mutex_Unlock(AudioLock);
+    OutputMixBufferReadPosition = 0;
+    DiscardOutput(0);
 }
 
 void DoSavestate(Savestate* file)
 {
+    // pending samples are converted with the settings they were mixed with
+    ApplyOutputSettings();
+    FlushOutput();
+
     file->Section("SPU.");
 
     file->Var16(&Cnt);
@@ -179,6 +239,23 @@ void DoSavestate(Savestate* file)
 
     Capture[0]->DoSavestate(file);
     Capture[1]->DoSavestate(file);
+
+    if (file->IsAtleastVersion(9, 3))
+    {
+        file->Var64(&NextSampleTime);
+    }
+    else if (!file->Saving)
+    {
+        // older states mix a sample on every event, restart from here
+        NextSampleTime = NDS::GetSysClockCycles(0) + SampleCycles;
+    }
+
+    if (!file->Saving)
+    {
+        NDS::CancelEvent(NDS::Event_SPU);
+        MixTarget = 0;
+        ScheduleMix();
+    }
 }
 
 
@@ -189,17 +266,22 @@ void SetInterpolation(int type)
 
 void SetBias(u16 bias)
 {
-    Bias = bias;
+    PendingBias.store(bias, std::memory_order_release);
 }
 
 void SetApplyBias(bool enable)
 {
-    ApplyBias = enable;
+    PendingApplyBias.store(enable, std::memory_order_release);
 }
 
 void SetDegrade10Bit(bool enable)
 {
-    Degrade10Bit = enable;
+    PendingDegrade10Bit.store(enable, std::memory_order_release);
+}
+
+void SetSkipOutput(bool skip)
+{
+    SkipOutput = skip;
 }
 
 
@@ -266,6 +348,9 @@ void Channel::DoSavestate(Savestate* file)
     file->Var32(&FIFOReadOffset);
     file->Var32(&FIFOLevel);
     file->VarArray(FIFO, sizeof(FIFO));
+
+    if (!file->Saving)
+        UpdateMixParams();
 }
 
 void Channel::FIFO_BufferData()
@@ -546,15 +631,15 @@ s32 Channel::Run()
         }
     }
 
-    val <<= VolumeShift;
-    val *= Volume;
+    // volume is applied by the mixer
     return val;
 }
 
-void Channel::PanOutput(s32 in, s32& left, s32& right)
+void Channel::UpdateMixParams()
 {
-    left += ((s64)in * (128-Pan)) >> 10;
-    right += ((s64)in * Pan) >> 10;
+    MixVolume[Num] = Volume << VolumeShift;
+    MixPanLeft[Num] = 128 - Pan;
+    MixPanRight[Num] = Pan;
 }
 
 
@@ -690,33 +775,302 @@ void CaptureUnit::Run(s32 sample)
 }
 
 
-void Mix(u32 dummy)
+// channel mixing: volume and panning for all 16 channels
+//
+// panning is ((s64)in * pan) >> 10, which can overflow 32 bits. splitting
+// the sample in two gives the same result with 32-bit math:
+// in = hi*1024 + lo, with 0 <= lo < 1024, so
+// (in * pan) >> 10 = hi*pan + ((lo*pan) >> 10)
+// the master volume is dealt with the same way, with a shift of 7
+
+void MixChannels_Scalar(s32& left, s32& right)
 {
-    s32 left = 0, right = 0;
-    s32 leftoutput = 0, rightoutput = 0;
+    for (int i = 0; i < 16; i++)
+    {
+        s32 val = MixSample[i] * MixVolume[i];
 
-    if (Cnt & (1<<15))
+        left += ((s64)val * MixPanLeft[i]) >> 10;
+        right += ((s64)val * MixPanRight[i]) >> 10;
+    }
+}
+
+inline s32 FinishSample(s32 val)
+{
+    val = ((s64)val * MasterVolume) >> 7;
+    val >>= 8;
+
+    // Add SOUNDBIAS value
+    // The value used by all commercial games is 0x200, so we subtract that so it won't offset the final sound output.
+    if (ApplyBias)
+        val += (Bias << 6) - 0x8000;
+
+    if      (val < -0x8000) val = -0x8000;
+    else if (val > 0x7FFF)  val = 0x7FFF;
+
+    // The original DS and DS lite degrade the output from 16 to 10 bit before output
+    if (Degrade10Bit)
+        val &= 0xFFFFFFC0;
+
+    return val >> 1;
+}
+
+void FinishOutput_Scalar(const s32* in, s16* out, u32 len)
+{
+    for (u32 i = 0; i < len; i++)
+        out[i] = FinishSample(in[i]);
+}
+
+#ifdef SIMD_MIXER_SUPPORTED
+
+bool DetectSSE41()
+{
+    // CPUID 1, ECX: bit 19 = SSE4.1
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    u32 ecx = info[2];
+#else
+    u32 eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return false;
+#endif
+
+    return ecx & (1<<19);
+}
+
+bool DetectAVX2()
+{
+    // CPUID 1, ECX: bit 27 = OSXSAVE, bit 28 = AVX
+    // CPUID 7, EBX: bit 5 = AVX2
+    // the OS also has to save the upper halves of the YMM registers
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    u32 ecx = info[2];
+    if ((ecx & (3<<27)) != (3<<27))
+        return false;
+
+    __cpuidex(info, 7, 0);
+    u32 ebx = info[1];
+    u64 xcr0 = _xgetbv(0);
+#else
+    u32 eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return false;
+    if ((ecx & (3<<27)) != (3<<27))
+        return false;
+
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        return false;
+
+    u32 xcr0lo, xcr0hi;
+    __asm__ ("xgetbv" : "=a"(xcr0lo), "=d"(xcr0hi) : "c"(0));
+    u64 xcr0 = ((u64)xcr0hi << 32) | xcr0lo;
+#endif
+
+    return (ebx & (1<<5)) && ((xcr0 & 0x6) == 0x6);
+}
+
+SSE41_TARGET
+inline __m128i SSE41_MulShift(__m128i val, __m128i mul, int shift, __m128i lomask)
+{
+    __m128i hi = _mm_mullo_epi32(_mm_srai_epi32(val, shift), mul);
+    __m128i lo = _mm_mullo_epi32(_mm_and_si128(val, lomask), mul);
+    return _mm_add_epi32(hi, _mm_srai_epi32(lo, shift));
+}
+
+SSE41_TARGET
+void MixChannels_SSE41(s32& left, s32& right)
+{
+    const __m128i lomask = _mm_set1_epi32(0x3FF);
+    __m128i suml = _mm_setzero_si128();
+    __m128i sumr = _mm_setzero_si128();
+
+    for (int i = 0; i < 16; i += 4)
     {
-        s32 ch0 = Channels[0]->DoRun();
-        s32 ch1 = Channels[1]->DoRun();
-        s32 ch2 = Channels[2]->DoRun();
-        s32 ch3 = Channels[3]->DoRun();
+        __m128i val = _mm_mullo_epi32(_mm_load_si128((__m128i*)&MixSample[i]),
+                                      _mm_load_si128((__m128i*)&MixVolume[i]));
 
-        // TODO: addition from capture registers
-        Channels[0]->PanOutput(ch0, left, right);
-        Channels[2]->PanOutput(ch2, left, right);
+        suml = _mm_add_epi32(suml, SSE41_MulShift(val, _mm_load_si128((__m128i*)&MixPanLeft[i]), 10, lomask));
+        sumr = _mm_add_epi32(sumr, SSE41_MulShift(val, _mm_load_si128((__m128i*)&MixPanRight[i]), 10, lomask));
+    }
 
-        if (!(Cnt & (1<<12))) Channels[1]->PanOutput(ch1, left, right);
-        if (!(Cnt & (1<<13))) Channels[3]->PanOutput(ch3, left, right);
+    // l0+l1 l2+l3 r0+r1 r2+r3, then left right left right
+    __m128i sum = _mm_hadd_epi32(suml, sumr);
+    sum = _mm_hadd_epi32(sum, sum);
 
-        for (int i = 4; i < 16; i++)
+    left += _mm_extract_epi32(sum, 0);
+    right += _mm_extract_epi32(sum, 1);
+}
+
+SSE41_TARGET
+void FinishOutput_SSE41(const s32* in, s16* out, u32 len)
+{
+    const __m128i lomask = _mm_set1_epi32(0x7F);
+    const __m128i mastervol = _mm_set1_epi32(MasterVolume);
+    const __m128i bias = _mm_set1_epi32(ApplyBias ? ((Bias << 6) - 0x8000) : 0);
+    const __m128i degrade = _mm_set1_epi32(Degrade10Bit ? 0xFFFFFFC0 : 0xFFFFFFFF);
+    const __m128i minval = _mm_set1_epi32(-0x8000);
+    const __m128i maxval = _mm_set1_epi32(0x7FFF);
+
+    u32 i = 0;
+    for (; i+8 <= len; i += 8)
+    {
+        __m128i val[2];
+        for (int j = 0; j < 2; j++)
         {
-            Channel* chan = Channels[i];
+            __m128i v = _mm_loadu_si128((__m128i*)&in[i + j*4]);
+            v = SSE41_MulShift(v, mastervol, 7, lomask);
+            v = _mm_add_epi32(_mm_srai_epi32(v, 8), bias);
+            v = _mm_min_epi32(_mm_max_epi32(v, minval), maxval);
+            v = _mm_and_si128(v, degrade);
+            val[j] = _mm_srai_epi32(v, 1);
+        }
+
+        _mm_storeu_si128((__m128i*)&out[i], _mm_packs_epi32(val[0], val[1]));
+    }
 
-            s32 channel = chan->DoRun();
-            chan->PanOutput(channel, left, right);
+    for (; i < len; i++)
+        out[i] = FinishSample(in[i]);
+}
+
+AVX2_TARGET
+inline __m256i AVX2_MulShift(__m256i val, __m256i mul, int shift, __m256i lomask)
+{
+    __m256i hi = _mm256_mullo_epi32(_mm256_srai_epi32(val, shift), mul);
+    __m256i lo = _mm256_mullo_epi32(_mm256_and_si256(val, lomask), mul);
+    return _mm256_add_epi32(hi, _mm256_srai_epi32(lo, shift));
+}
+
+AVX2_TARGET
+void MixChannels_AVX2(s32& left, s32& right)
+{
+    const __m256i lomask = _mm256_set1_epi32(0x3FF);
+    __m256i suml = _mm256_setzero_si256();
+    __m256i sumr = _mm256_setzero_si256();
+
+    for (int i = 0; i < 16; i += 8)
+    {
+        __m256i val = _mm256_mullo_epi32(_mm256_load_si256((__m256i*)&MixSample[i]),
+                                         _mm256_load_si256((__m256i*)&MixVolume[i]));
+
+        suml = _mm256_add_epi32(suml, AVX2_MulShift(val, _mm256_load_si256((__m256i*)&MixPanLeft[i]), 10, lomask));
+        sumr = _mm256_add_epi32(sumr, AVX2_MulShift(val, _mm256_load_si256((__m256i*)&MixPanRight[i]), 10, lomask));
+    }
+
+    // same as above, once the two 128-bit halves are added together
+    __m256i sum256 = _mm256_hadd_epi32(suml, sumr);
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(sum256), _mm256_extracti128_si256(sum256, 1));
+    sum = _mm_hadd_epi32(sum, sum);
+
+    left += _mm_extract_epi32(sum, 0);
+    right += _mm_extract_epi32(sum, 1);
+}
+
+AVX2_TARGET
+void FinishOutput_AVX2(const s32* in, s16* out, u32 len)
+{
+    const __m256i lomask = _mm256_set1_epi32(0x7F);
+    const __m256i mastervol = _mm256_set1_epi32(MasterVolume);
+    const __m256i bias = _mm256_set1_epi32(ApplyBias ? ((Bias << 6) - 0x8000) : 0);
+    const __m256i degrade = _mm256_set1_epi32(Degrade10Bit ? 0xFFFFFFC0 : 0xFFFFFFFF);
+    const __m256i minval = _mm256_set1_epi32(-0x8000);
+    const __m256i maxval = _mm256_set1_epi32(0x7FFF);
+
+    u32 i = 0;
+    for (; i+16 <= len; i += 16)
+    {
+        __m256i val[2];
+        for (int j = 0; j < 2; j++)
+        {
+            __m256i v = _mm256_loadu_si256((__m256i*)&in[i + j*8]);
+            v = AVX2_MulShift(v, mastervol, 7, lomask);
+            v = _mm256_add_epi32(_mm256_srai_epi32(v, 8), bias);
+            v = _mm256_min_epi32(_mm256_max_epi32(v, minval), maxval);
+            v = _mm256_and_si256(v, degrade);
+            val[j] = _mm256_srai_epi32(v, 1);
         }
 
+        // packing works on each 128-bit half, put the samples back in order
+        __m256i packed = _mm256_packs_epi32(val[0], val[1]);
+        _mm256_storeu_si256((__m256i*)&out[i], _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0)));
+    }
+
+    for (; i < len; i++)
+        out[i] = FinishSample(in[i]);
+}
+
+#endif // SIMD_MIXER_SUPPORTED
+
+void SelectMixer()
+{
+    MixChannels = MixChannels_Scalar;
+    FinishOutput = FinishOutput_Scalar;
+
+#ifdef SIMD_MIXER_SUPPORTED
+    if (DetectAVX2())
+    {
+        MixChannels = MixChannels_AVX2;
+        FinishOutput = FinishOutput_AVX2;
+    }
+    else if (DetectSSE41())
+    {
+        MixChannels = MixChannels_SSE41;
+        FinishOutput = FinishOutput_SSE41;
+    }
+#endif
+}
+
+void ApplyOutputSettings()
+{
+    int bias = PendingBias.load(std::memory_order_relaxed);
+    int applybias = PendingApplyBias.load(std::memory_order_relaxed);
+    int degrade = PendingDegrade10Bit.load(std::memory_order_relaxed);
+    if (bias < 0 && applybias < 0 && degrade < 0)
+        return;
+
+    FlushOutput();
+
+    bias = PendingBias.exchange(-1, std::memory_order_acquire);
+    applybias = PendingApplyBias.exchange(-1, std::memory_order_acquire);
+    degrade = PendingDegrade10Bit.exchange(-1, std::memory_order_acquire);
+
+    if (bias >= 0) Bias = bias;
+    if (applybias >= 0) ApplyBias = applybias;
+    if (degrade >= 0) Degrade10Bit = degrade;
+}
+
+void FlushOutput()
+{
+    u32 len = OutputBackbufferWritePosition - OutputMixBufferReadPosition;
+    if (len == 0) return;
+
+    FinishOutput(&OutputMixBuffer[OutputMixBufferReadPosition],
+                 &OutputBackbuffer[OutputMixBufferReadPosition],
+                 len);
+    OutputMixBufferReadPosition = OutputBackbufferWritePosition;
+}
+
+
+void MixNextSample()
+{
+    s32 left = 0, right = 0;
+    s32 leftoutput = 0, rightoutput = 0;
+
+    if (Cnt & (1<<15))
+    {
+        for (int i = 0; i < 16; i++)
+            MixSample[i] = Channels[i]->DoRun();
+
+        s32 ch1 = MixSample[1] * MixVolume[1];
+        s32 ch3 = MixSample[3] * MixVolume[3];
+
+        // TODO: addition from capture registers
+        if (Cnt & (1<<12)) MixSample[1] = 0;
+        if (Cnt & (1<<13)) MixSample[3] = 0;
+
+        MixChannels(left, right);
+
         // sound capture
         // TODO: other sound capture sources, along with their bugs
 
@@ -797,114 +1151,149 @@ void Mix(u32 dummy)
         }
     }
 
-    leftoutput = ((s64)leftoutput * MasterVolume) >> 7;
-    rightoutput = ((s64)rightoutput * MasterVolume) >> 7;
+    // OutputBufferFrame can never get full because it's
+    // transfered to OutputBuffer at the end of the frame
+    // master volume and bias are applied later, see FlushOutput()
+    OutputMixBuffer[OutputBackbufferWritePosition    ] = leftoutput;
+    OutputMixBuffer[OutputBackbufferWritePosition + 1] = rightoutput;
+    OutputBackbufferWritePosition += 2;
+}
 
-    leftoutput >>= 8;
-    rightoutput >>= 8;
+void CatchUp(u64 timestamp)
+{
+    ApplyOutputSettings();
 
-    // Add SOUNDBIAS value
-    // The value used by all commercial games is 0x200, so we subtract that so it won't offset the final sound output.
-    if (ApplyBias)
-    {
-        leftoutput += (Bias << 6) - 0x8000;
-        rightoutput += (Bias << 6) - 0x8000;
-    }
+    if (timestamp < NextSampleTime)
+        return;
 
-    if      (leftoutput < -0x8000) leftoutput = -0x8000;
-    else if (leftoutput > 0x7FFF)  leftoutput = 0x7FFF;
-    if      (rightoutput < -0x8000) rightoutput = -0x8000;
-    else if (rightoutput > 0x7FFF)  rightoutput = 0x7FFF;
+    NDS::PerfScope perf(NDS::Perf_SPU);
 
-    // The original DS and DS lite degrade the output from 16 to 10 bit before output
-    if (Degrade10Bit)
+    do
     {
-        leftoutput &= 0xFFFFFFC0;
-        rightoutput &= 0xFFFFFFC0;
+        MixNextSample();
+        NextSampleTime += SampleCycles;
     }
+    while (NextSampleTime <= timestamp);
+}
 
-    // OutputBufferFrame can never get full because it's
-    // transfered to OutputBuffer at the end of the frame
-    OutputBackbuffer[OutputBackbufferWritePosition    ] = leftoutput >> 1;
-    OutputBackbuffer[OutputBackbufferWritePosition + 1] = rightoutput >> 1;
-    OutputBackbufferWritePosition += 2;
+void ScheduleMix()
+{
+    // capture writes to memory, which can be read at any time, so
+    // samples are mixed one at a time while it is running
+    u32 samples = ((Capture[0]->Cnt | Capture[1]->Cnt) & 0x80) ? 1 : BatchSamples;
+
+    u64 target = NextSampleTime + (samples-1) * SampleCycles;
+    if (target == MixTarget)
+        return;
 
-    NDS::ScheduleEvent(NDS::Event_SPU, true, 1024, Mix, 0);
+    NDS::CancelEvent(NDS::Event_SPU);
+    MixTarget = target;
+    NDS::ScheduleEvent(NDS::Event_SPU, false, (s32)(target - NDS::GetSysClockCycles(0)), Mix, 0);
+}
+
+void Mix(u32 dummy)
+{
+    CatchUp(MixTarget);
+
+    MixTarget = 0;
+    ScheduleMix();
+}
+
+// the reader's position, once pending discards are applied
+u32 GetOutputReadPosition()
+{
+    u32 readpos = OutputFrontBufferReadPosition.load(std::memory_order_acquire);
+    u32 discardpos = OutputFrontBufferDiscardPosition.load(std::memory_order_acquire);
+
+    if ((s32)(discardpos - readpos) > 0)
+        return discardpos;
+    return readpos;
+}
+
+void DiscardOutput(u32 keep)
+{
+    u32 writepos = OutputFrontBufferWritePosition.load(std::memory_order_relaxed);
+    u32 readpos = GetOutputReadPosition();
+
+    if ((writepos - readpos) > keep)
+        OutputFrontBufferDiscardPosition.store(writepos - keep, std::memory_order_release);
 }
 
 void TransferOutput()
 {
-    Platform::Mutex_Lock(AudioLock);
-    for (u32 i = 0; i < OutputBackbufferWritePosition; i += 2)
+    // mix what is due by the end of the frame
+    CatchUp(NDS::GetSysClockCycles(0));
+
+    if (SkipOutput)
     {
-        OutputFrontBuffer[OutputFrontBufferWritePosition    ] = OutputBackbuffer[i   ];
-        OutputFrontBuffer[OutputFrontBufferWritePosition + 1] = OutputBackbuffer[i + 1];
+        OutputBackbufferWritePosition = 0;
+        OutputMixBufferReadPosition = 0;
+        return;
+    }
 
-        OutputFrontBufferWritePosition += 2;
-        OutputFrontBufferWritePosition &= OutputBufferSize*2-1;
-        if (OutputFrontBufferWritePosition == OutputFrontBufferReadPosition)
-        {
-            // advance the read position too, to avoid losing the entire FIFO
-            OutputFrontBufferReadPosition += 2;
-            OutputFrontBufferReadPosition &= OutputBufferSize*2-1;
-        }
+    FlushOutput();
+
+    u32 writepos = OutputFrontBufferWritePosition.load(std::memory_order_relaxed);
+    u32 readpos = OutputFrontBufferReadPosition.load(std::memory_order_acquire);
+
+    // keep the discard position close to the read position, so comparing
+    // the two still works once the counters wrap around
+    OutputFrontBufferDiscardPosition.store(GetOutputReadPosition(), std::memory_order_release);
+
+    // the reader may still be going through samples that are about to be
+    // discarded, so only the space it's done with can be reused
+    // if the buffer is full, the newest samples are dropped
+    u32 len = OutputBackbufferWritePosition >> 1;
+    u32 space = OutputBufferSize - (writepos - readpos);
+    if (len > space) len = space;
+
+    for (u32 i = 0; i < len; )
+    {
+        u32 pos = (writepos + i) & (OutputBufferSize-1);
+        u32 chunk = std::min(len - i, OutputBufferSize - pos);
+
+        memcpy(&OutputFrontBuffer[pos*2], &OutputBackbuffer[i*2], chunk*2*sizeof(s16));
+        i += chunk;
     }
+
+    OutputFrontBufferWritePosition.store(writepos + len, std::memory_order_release);
+
     OutputBackbufferWritePosition = 0;
-    Platform::Mutex_Unlock(AudioLock);
+    OutputMixBufferReadPosition = 0;
 }
 
 void TrimOutput()
 {
-    Platform::Mutex_Lock(AudioLock);
     const int halflimit = (OutputBufferSize / 2);
-
-    int readpos = OutputFrontBufferWritePosition - (halflimit*2);
-    if (readpos < 0) readpos += (OutputBufferSize*2);
-
-    OutputFrontBufferReadPosition = readpos;
-    Platform::Mutex_Unlock(AudioLock);
+    DiscardOutput(halflimit);
 }
 
 void DrainOutput()
 {
-    Platform::Mutex_Lock(AudioLock);
-    OutputFrontBufferWritePosition = 0;
-    OutputFrontBufferReadPosition = 0;
-    Platform::Mutex_Unlock(AudioLock);
+    // this is on the reader's side, so it can move the read position
+    u32 writepos = OutputFrontBufferWritePosition.load(std::memory_order_acquire);
+    OutputFrontBufferReadPosition.store(writepos, std::memory_order_release);
 }
 
 void InitOutput()
 {
-    Platform::Mutex_Lock(AudioLock);
     memset(OutputBackbuffer, 0, 2*OutputBufferSize*2);
-    memset(OutputFrontBuffer, 0, 2*OutputBufferSize*2);
-    OutputFrontBufferReadPosition = 0;
-    OutputFrontBufferWritePosition = 0;
-    Platform::Mutex_Unlock(AudioLock);
+    DiscardOutput(0);
 }
 
 int GetOutputSize()
 {
-    Platform::Mutex_Lock(AudioLock);
-
-    int ret;
-    if (OutputFrontBufferWritePosition >= OutputFrontBufferReadPosition)
-        ret = OutputFrontBufferWritePosition - OutputFrontBufferReadPosition;
-    else
-        ret = (OutputBufferSize*2) - OutputFrontBufferReadPosition + OutputFrontBufferWritePosition;
-
-    ret >>= 1;
+    u32 writepos = OutputFrontBufferWritePosition.load(std::memory_order_acquire);
+    return writepos - GetOutputReadPosition();
+}
 
-    Platform::Mutex_Unlock(AudioLock);
-    return ret;
+int GetOutputCapacity()
+{
+    return OutputBufferSize;
 }
 
 void Sync(bool wait)
 {
-    // this function is currently not used anywhere
-    // depending on the usage context the thread safety measures could be made
-    // a lot faster
-
     // sync to audio output in case the core is running too fast
     // * wait=true: wait until enough audio data has been played
     // * wait=false: merely skip some audio data to avoid a FIFO overflow
@@ -916,50 +1305,35 @@ void Sync(bool wait)
         // TODO: less CPU-intensive wait?
         while (GetOutputSize() > halflimit);
     }
-    else if (GetOutputSize() > halflimit)
-    {
-        Platform::Mutex_Lock(AudioLock);
-
-        int readpos = OutputFrontBufferWritePosition - (halflimit*2);
-        if (readpos < 0) readpos += (OutputBufferSize*2);
-
-        OutputFrontBufferReadPosition = readpos;
-
-        Platform::Mutex_Unlock(AudioLock);
-    }
+    else
+        DiscardOutput(halflimit);
 }
 
 int ReadOutput(s16* data, int samples)
 {
-    Platform::Mutex_Lock(AudioLock);
-    if (OutputFrontBufferReadPosition == OutputFrontBufferWritePosition)
-    {
-        Platform::Mutex_Unlock(AudioLock);
-        return 0;
-    }
+    u32 readpos = GetOutputReadPosition();
+    u32 writepos = OutputFrontBufferWritePosition.load(std::memory_order_acquire);
 
-    for (int i = 0; i < samples; i++)
-    {
-        *data++ = OutputFrontBuffer[OutputFrontBufferReadPosition];
-        *data++ = OutputFrontBuffer[OutputFrontBufferReadPosition + 1];
+    u32 len = writepos - readpos;
+    if (len > (u32)samples) len = samples;
 
-        OutputFrontBufferReadPosition += 2;
-        OutputFrontBufferReadPosition &= ((2*OutputBufferSize)-1);
+    for (u32 i = 0; i < len; )
+    {
+        u32 pos = (readpos + i) & (OutputBufferSize-1);
+        u32 chunk = std::min(len - i, OutputBufferSize - pos);
 
-        if (OutputFrontBufferWritePosition == OutputFrontBufferReadPosition)
-        {
-            Platform::Mutex_Unlock(AudioLock);
-            return i+1;
-        }
+        memcpy(&data[i*2], &OutputFrontBuffer[pos*2], chunk*2*sizeof(s16));
+        i += chunk;
     }
 
-    Platform::Mutex_Unlock(AudioLock);
-    return samples;
+    OutputFrontBufferReadPosition.store(readpos + len, std::memory_order_release);
+    return len;
 }
 
-
 u8 Read8(u32 addr)
 {
+    CatchUp(NDS::GetSysClockCycles(0));
+
     if (addr < 0x04000500)
     {
         Channel* chan = Channels[(addr >> 4) & 0xF];
@@ -990,6 +1364,8 @@ u8 Read8(u32 addr)
 
 u16 Read16(u32 addr)
 {
+    CatchUp(NDS::GetSysClockCycles(0));
+
     if (addr < 0x04000500)
     {
         Channel* chan = Channels[(addr >> 4) & 0xF];
@@ -1017,6 +1393,8 @@ u16 Read16(u32 addr)
 
 u32 Read32(u32 addr)
 {
+    CatchUp(NDS::GetSysClockCycles(0));
+
     if (addr < 0x04000500)
     {
         Channel* chan = Channels[(addr >> 4) & 0xF];
@@ -1046,6 +1424,8 @@ u32 Read32(u32 addr)
 
 void Write8(u32 addr, u8 val)
 {
+    CatchUp(NDS::GetSysClockCycles(0));
+
     if (addr < 0x04000500)
     {
         Channel* chan = Channels[(addr >> 4) & 0xF];
@@ -1063,6 +1443,7 @@ void Write8(u32 addr, u8 val)
         switch (addr)
         {
         case 0x04000500:
+            FlushOutput();
             Cnt = (Cnt & 0xBF00) | (val & 0x7F);
             MasterVolume = Cnt & 0x7F;
             if (MasterVolume == 127) MasterVolume++;
@@ -1074,10 +1455,12 @@ void Write8(u32 addr, u8 val)
         case 0x04000508:
             Capture[0]->SetCnt(val);
             if (val & 0x03) printf("!! UNSUPPORTED SPU CAPTURE MODE %02X\n", val);
+            ScheduleMix();
             return;
         case 0x04000509:
             Capture[1]->SetCnt(val);
             if (val & 0x03) printf("!! UNSUPPORTED SPU CAPTURE MODE %02X\n", val);
+            ScheduleMix();
             return;
         }
     }
@@ -1087,6 +1470,8 @@ void Write8(u32 addr, u8 val)
 
 void Write16(u32 addr, u16 val)
 {
+    CatchUp(NDS::GetSysClockCycles(0));
+
     if (addr < 0x04000500)
     {
         Channel* chan = Channels[(addr >> 4) & 0xF];
@@ -1111,12 +1496,14 @@ void Write16(u32 addr, u16 val)
         switch (addr)
         {
         case 0x04000500:
+            FlushOutput();
             Cnt = val & 0xBF7F;
             MasterVolume = Cnt & 0x7F;
             if (MasterVolume == 127) MasterVolume++;
             return;
 
         case 0x04000504:
+            FlushOutput();
             Bias = val & 0x3FF;
             return;
 
@@ -1124,6 +1511,7 @@ void Write16(u32 addr, u16 val)
             Capture[0]->SetCnt(val & 0xFF);
             Capture[1]->SetCnt(val >> 8);
             if (val & 0x0303) printf("!! UNSUPPORTED SPU CAPTURE MODE %04X\n", val);
+            ScheduleMix();
             return;
 
         case 0x04000514: Capture[0]->SetLength(val); return;
@@ -1136,6 +1524,8 @@ void Write16(u32 addr, u16 val)
 
 void Write32(u32 addr, u32 val)
 {
+    CatchUp(NDS::GetSysClockCycles(0));
+
     if (addr < 0x04000500)
     {
         Channel* chan = Channels[(addr >> 4) & 0xF];
@@ -1159,12 +1549,14 @@ void Write32(u32 addr, u32 val)
         switch (addr)
         {
         case 0x04000500:
+            FlushOutput();
             Cnt = val & 0xBF7F;
             MasterVolume = Cnt & 0x7F;
             if (MasterVolume == 127) MasterVolume++;
             return;
 
         case 0x04000504:
+            FlushOutput();
             Bias = val & 0x3FF;
             return;
 
@@ -1172,6 +1564,7 @@ void Write32(u32 addr, u32 val)
             Capture[0]->SetCnt(val & 0xFF);
             Capture[1]->SetCnt(val >> 8);
             if (val & 0x0303) printf("!! UNSUPPORTED SPU CAPTURE MODE %04X\n", val);
+            ScheduleMix();
             return;
 
         case 0x04000510: Capture[0]->SetDstAddr(val); return;
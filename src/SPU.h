@@ -38,16 +38,26 @@ void SetBias(u16 bias);
 void SetDegrade10Bit(bool enable);
 void SetApplyBias(bool enable);
 
+// when set, mixed samples are thrown away at the end of the frame
+// instead of being queued for output
+void SetSkipOutput(bool skip);
+
 void Mix(u32 dummy);
 
+// audio output goes through a lock-free ring buffer with one writer (the
+// emulator thread) and one reader (usually the audio callback)
+// sizes are in stereo samples
 void TrimOutput();
-void DrainOutput();
 void InitOutput();
 int GetOutputSize();
+int GetOutputCapacity();
 void Sync(bool wait);
-int ReadOutput(s16* data, int samples);
 void TransferOutput();
 
+// reader side
+int ReadOutput(s16* data, int samples);
+void DrainOutput();
+
 u8 Read8(u32 addr);
 u16 Read16(u32 addr);
 u32 Read32(u32 addr);
@@ -115,6 +125,8 @@ public:
         {
             KeyOn = true;
         }
+
+        UpdateMixParams();
     }
 
     void SetSrcAddr(u32 val) { SrcAddr = val & 0x07FFFFFC; }
@@ -156,7 +168,7 @@ public:
         }
     }
 
-    void PanOutput(s32 in, s32& left, s32& right);
+    void UpdateMixParams();
 
 private:
     u32 (*BusRead32)(u32 addr);
@@ -17,8 +17,14 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <vector>
 #include "Savestate.h"
 #include "Platform.h"
+#include "LZ77.h"
 
 /*
     Savestate format
@@ -41,14 +47,150 @@
     version difference:
     * different major means savestate file is incompatible
     * different minor means adjustments may have to be made
+
+    memory-backed savestates use the same format, they just go to a buffer
+    instead of a file
+
+    when a memory-backed savestate is saved again or loaded back, arrays
+    with a SavestateTracker only copy the pages that were written to since
+    the last time, the rest of the buffer already matches
+
+    Compressed savestates
+
+    a finished savestate can be compressed section by section. the sections
+    are cut in blocks of 256K, compressed with LZ77 on several threads.
+    when loading, sections are only decompressed when they're asked for.
+
+    header:
+    00 - magic MELZ
+    04 - version major
+    06 - version minor
+    08 - uncompressed length
+    0C - number of sections
+
+    section index, one entry per section:
+    00 - section magic
+    04 - offset in the uncompressed savestate
+    08 - section length (as in the section header)
+    0C - offset of the compressed data in the file
+
+    compressed data:
+    the compressed length of each block, then the blocks. a block whose
+    compressed length is the same as its uncompressed length is stored as-is
 */
 
-Savestate::Savestate(const char* filename, bool save)
+const u32 kMemBufferInitialSize = 0x100000;
+
+const u32 kCompressBlockSize = 0x40000;
+const u32 kNumCompressThreads = 4;
+
+
+struct CompressJob
 {
-    const char* magic = "MELN";
+    const u8* Src;
+    u32 SrcLen;
+    u8* Dst;
+    u32 DstLen;
+
+    const u8* Out; // what to store: Dst, or Src if it didn't compress
+    u32 OutLen;
+    bool OK;
+};
+
+// compress or decompress a bunch of blocks, spread over a few threads
+void RunCompressJobs(CompressJob* jobs, u32 num, bool compress)
+{
+    std::atomic<u32> next(0);
+
+    auto worker = [&]()
+    {
+        for (;;)
+        {
+            u32 i = next++;
+            if (i >= num) break;
 
+            CompressJob& job = jobs[i];
+            if (compress)
+            {
+                job.OutLen = LZ77_Compress(job.Src, job.SrcLen, job.Dst);
+                job.Out = job.Dst;
+                if (job.OutLen >= job.SrcLen)
+                {
+                    job.Out = job.Src;
+                    job.OutLen = job.SrcLen;
+                }
+                job.OK = true;
+            }
+            else if (job.SrcLen == job.DstLen)
+            {
+                memcpy(job.Dst, job.Src, job.SrcLen);
+                job.OK = true;
+            }
+            else
+            {
+                job.OK = LZ77_Decompress(job.Src, job.SrcLen, job.Dst, job.DstLen);
+            }
+        }
+    };
+
+    // the calling thread does its share too
+    u32 numthreads = std::min(num, kNumCompressThreads);
+    Platform::Thread* threads[kNumCompressThreads];
+
+    for (u32 i = 1; i < numthreads; i++)
+        threads[i] = Platform::Thread_Create(worker);
+
+    worker();
+
+    for (u32 i = 1; i < numthreads; i++)
+    {
+        Platform::Thread_Wait(threads[i]);
+        Platform::Thread_Free(threads[i]);
+    }
+}
+
+
+u32 NextTrackerID = 0;
+
+SavestateTracker::SavestateTracker(u32 size, u32 pageshift)
+{
+    ID = NextTrackerID++;
+    PageShift = pageshift;
+    NumPages = (size + (1 << pageshift) - 1) >> pageshift;
+    Pages = new u32[NumPages];
+
+    // savestates start from generation 0, so everything counts as changed
+    Generation = 1;
+    WriteAll();
+}
+
+SavestateTracker::~SavestateTracker()
+{
+    delete[] Pages;
+}
+
+void SavestateTracker::WriteAll()
+{
+    for (u32 i = 0; i < NumPages; i++)
+        Pages[i] = Generation;
+}
+
+
+Savestate::Savestate(const char* filename, bool save)
+{
     Error = false;
 
+    file = nullptr;
+    MemBuffer = nullptr;
+    MemBufferSize = 0;
+    MemLength = 0;
+    MemPos = 0;
+    NumTracked = 0;
+
+    CompData = nullptr;
+    CompSections = nullptr;
+    NumCompSections = 0;
+
     if (save)
     {
         Saving = true;
@@ -60,13 +202,7 @@ Savestate::Savestate(const char* filename, bool save)
             return;
         }
 
-        VersionMajor = SAVESTATE_MAJOR;
-        VersionMinor = SAVESTATE_MINOR;
-
-        fwrite(magic, 4, 1, file);
-        fwrite(&VersionMajor, 2, 1, file);
-        fwrite(&VersionMinor, 2, 1, file);
-        fseek(file, 8, SEEK_CUR); // length to be fixed later
+        WriteHeader();
     }
     else
     {
@@ -79,79 +215,580 @@ Savestate::Savestate(const char* filename, bool save)
             return;
         }
 
-        u32 len;
         fseek(file, 0, SEEK_END);
-        len = (u32)ftell(file);
+        u32 len = (u32)ftell(file);
         fseek(file, 0, SEEK_SET);
 
-        u32 buf = 0;
+        u32 magic = 0;
+        fread(&magic, 4, 1, file);
+        fseek(file, 0, SEEK_SET);
+
+        if (magic == *(u32*)"MELZ")
+        {
+            // compressed savestates are small, just read the whole thing
+            u8* data = (u8*)malloc(len);
+            bool ok = data && fread(data, len, 1, file) == 1;
+            fclose(file);
+            file = nullptr;
+
+            ok = ok && OpenCompressed(data, len);
+            free(data);
+            if (!ok)
+            {
+                Error = true;
+                return;
+            }
+
+            len = MemLength;
+        }
 
-        fread(&buf, 4, 1, file);
-        if (buf != ((u32*)magic)[0])
+        if (!ReadHeader(len))
         {
-            printf("savestate: invalid magic %08X\n", buf);
             Error = true;
             return;
         }
+    }
+
+    CurSection = -1;
+}
+
+Savestate::Savestate()
+{
+    Error = false;
+    Saving = true;
+
+    file = nullptr;
+    MemBuffer = (u8*)malloc(kMemBufferInitialSize);
+    MemBufferSize = kMemBufferInitialSize;
+    MemLength = 0;
+    MemPos = 0;
+    NumTracked = 0;
+
+    CompData = nullptr;
+    CompSections = nullptr;
+    NumCompSections = 0;
+
+    if (!MemBuffer)
+    {
+        printf("savestate: could not allocate buffer\n");
+        Error = true;
+        return;
+    }
+
+    WriteHeader();
+
+    CurSection = -1;
+}
+
+Savestate::Savestate(const u8* data, u32 len)
+{
+    Error = false;
+    Saving = false;
+
+    // never written to when loading
+    file = nullptr;
+    MemBuffer = (u8*)data;
+    MemBufferSize = 0;
+    MemLength = len;
+    MemPos = 0;
+    NumTracked = 0;
 
-        VersionMajor = 0;
-        VersionMinor = 0;
+    CompData = nullptr;
+    CompSections = nullptr;
+    NumCompSections = 0;
 
-        fread(&VersionMajor, 2, 1, file);
-        if (VersionMajor != SAVESTATE_MAJOR)
+    if (len >= 4 && *(u32*)data == *(u32*)"MELZ")
+    {
+        MemBuffer = nullptr;
+        if (!OpenCompressed(data, len))
         {
-            printf("savestate: bad version major %d, expecting %d\n", VersionMajor, SAVESTATE_MAJOR);
             Error = true;
             return;
         }
 
-        fread(&VersionMinor, 2, 1, file);
-        if (VersionMinor > SAVESTATE_MINOR)
+        len = MemLength;
+    }
+
+    if (!ReadHeader(len))
+    {
+        Error = true;
+        return;
+    }
+
+    CurSection = -1;
+}
+
+Savestate::~Savestate()
+{
+    if (!Error && Saving)
+        Finish();
+
+    if (file) fclose(file);
+    if (MemBufferSize) free(MemBuffer);
+
+    if (CompData) free(CompData);
+    if (CompSections) delete[] CompSections;
+}
+
+const u8* Savestate::Buffer()
+{
+    if (!Error && Saving)
+        Finish();
+
+    return MemBuffer;
+}
+
+u32 Savestate::Length()
+{
+    if (!Error && Saving)
+        Finish();
+
+    return MemLength;
+}
+
+void Savestate::Restart()
+{
+    if (file || !MemBufferSize) return;
+
+    // a failed save may have left the buffer half-written
+    if (Error)
+        NumTracked = 0;
+
+    Error = false;
+    Saving = true;
+    MemLength = 0;
+    MemPos = 0;
+
+    WriteHeader();
+
+    CurSection = -1;
+}
+
+void Savestate::StartLoading()
+{
+    if (file || !MemBufferSize || !Saving || Error) return;
+
+    Finish();
+
+    Saving = false;
+    MemPos = 0;
+
+    if (!ReadHeader(MemLength))
+    {
+        Error = true;
+        return;
+    }
+
+    CurSection = -1;
+}
+
+u8* Savestate::Compress(u32* len)
+{
+    if (file || !MemBufferSize || !Saving || Error) return nullptr;
+
+    Finish();
+
+    struct SectionInfo
+    {
+        u32 Offset;
+        u32 Length;
+        u32 FirstBlock;
+        u32 NumBlocks;
+    };
+
+    std::vector<SectionInfo> sections;
+    std::vector<CompressJob> jobs;
+    u32 scratchsize = 0;
+
+    u32 pos = 0x10;
+    while (pos < MemLength)
+    {
+        u32 seclen = 0;
+        if ((MemLength - pos) >= 16)
+            memcpy(&seclen, &MemBuffer[pos+4], 4);
+
+        if (seclen < 16 || seclen > (MemLength - pos))
+        {
+            printf("savestate: bad section at %08X, can't compress\n", pos);
+            return nullptr;
+        }
+
+        SectionInfo sec;
+        sec.Offset = pos;
+        sec.Length = seclen;
+        sec.FirstBlock = jobs.size();
+        sec.NumBlocks = 0;
+
+        for (u32 i = 16; i < seclen; i += kCompressBlockSize)
+        {
+            CompressJob job;
+            job.Src = &MemBuffer[pos + i];
+            job.SrcLen = std::min(kCompressBlockSize, seclen - i);
+            job.Dst = nullptr;
+            job.DstLen = scratchsize; // fixed up once the scratch buffer is allocated
+            scratchsize += LZ77_MaxCompressedSize(job.SrcLen);
+
+            jobs.push_back(job);
+            sec.NumBlocks++;
+        }
+
+        sections.push_back(sec);
+        pos += seclen;
+    }
+
+    u8* scratch = (u8*)malloc(std::max(scratchsize, 1U));
+    if (!scratch)
+    {
+        printf("savestate: could not allocate compression buffer\n");
+        return nullptr;
+    }
+
+    for (CompressJob& job : jobs)
+    {
+        job.Dst = &scratch[job.DstLen];
+        job.DstLen = LZ77_MaxCompressedSize(job.SrcLen);
+    }
+
+    RunCompressJobs(jobs.data(), jobs.size(), true);
+
+    u32 datapos = 0x10 + (sections.size() * 16);
+    u32 total = datapos;
+    for (CompressJob& job : jobs)
+        total += 4 + job.OutLen;
+
+    u8* out = (u8*)malloc(total);
+    if (!out)
+    {
+        printf("savestate: could not allocate compression buffer\n");
+        free(scratch);
+        return nullptr;
+    }
+
+    u32 numsections = sections.size();
+    memcpy(&out[0], "MELZ", 4);
+    memcpy(&out[4], &MemBuffer[4], 4); // version
+    memcpy(&out[8], &MemLength, 4);
+    memcpy(&out[12], &numsections, 4);
+
+    for (u32 i = 0; i < numsections; i++)
+    {
+        SectionInfo& sec = sections[i];
+        u8* entry = &out[0x10 + (i * 16)];
+
+        memcpy(&entry[0], &MemBuffer[sec.Offset], 4);
+        memcpy(&entry[4], &sec.Offset, 4);
+        memcpy(&entry[8], &sec.Length, 4);
+        memcpy(&entry[12], &datapos, 4);
+
+        for (u32 j = 0; j < sec.NumBlocks; j++)
+        {
+            memcpy(&out[datapos], &jobs[sec.FirstBlock + j].OutLen, 4);
+            datapos += 4;
+        }
+
+        for (u32 j = 0; j < sec.NumBlocks; j++)
         {
-            printf("savestate: state from the future, %d > %d\n", VersionMinor, SAVESTATE_MINOR);
+            CompressJob& job = jobs[sec.FirstBlock + j];
+            memcpy(&out[datapos], job.Out, job.OutLen);
+            datapos += job.OutLen;
+        }
+    }
+
+    free(scratch);
+
+    *len = total;
+    return out;
+}
+
+bool Savestate::OpenCompressed(const u8* data, u32 len)
+{
+    u32 rawlen = 0, numsections = 0;
+    if (len >= 0x10)
+    {
+        memcpy(&rawlen, &data[8], 4);
+        memcpy(&numsections, &data[12], 4);
+    }
+
+    if (rawlen < 0x10 || numsections > ((len - 0x10) / 16))
+    {
+        printf("savestate: bad compressed savestate header\n");
+        return false;
+    }
+
+    CompData = (u8*)malloc(len);
+    CompSections = new CompressedSection[numsections];
+    NumCompSections = numsections;
+
+    // whatever isn't decompressed reads back as zero
+    MemBuffer = (u8*)calloc(rawlen, 1);
+    if (MemBuffer) MemBufferSize = rawlen;
+    if (!CompData || !MemBuffer)
+    {
+        printf("savestate: could not allocate buffer\n");
+        return false;
+    }
+
+    MemLength = rawlen;
+    MemPos = 0;
+
+    memcpy(CompData, data, len);
+
+    // rebuild the savestate header and section headers, so sections can
+    // be found the usual way
+    memcpy(&MemBuffer[0], "MELN", 4);
+    memcpy(&MemBuffer[4], &data[4], 4);
+    memcpy(&MemBuffer[8], &rawlen, 4);
+
+    u32 expected = 0x10;
+    for (u32 i = 0; i < numsections; i++)
+    {
+        const u8* entry = &CompData[0x10 + (i * 16)];
+        u32 offset, length, dataoffset;
+        memcpy(&offset, &entry[4], 4);
+        memcpy(&length, &entry[8], 4);
+        memcpy(&dataoffset, &entry[12], 4);
+
+        // sections are laid out one after the other, check that everything
+        // is where it should be
+        bool ok = offset == expected && length >= 16 && length <= (rawlen - offset);
+        u32 numblocks = (length - 16 + kCompressBlockSize - 1) / kCompressBlockSize;
+        ok = ok && dataoffset <= len && ((u64)numblocks * 4) <= (len - dataoffset);
+
+        u64 datalen = numblocks * 4;
+        for (u32 j = 0; ok && j < numblocks; j++)
+        {
+            u32 blocklen;
+            memcpy(&blocklen, &CompData[dataoffset + (j * 4)], 4);
+            datalen += blocklen;
+        }
+
+        if (!ok || datalen > (len - dataoffset))
+        {
+            printf("savestate: bad compressed section %d\n", i);
+            return false;
+        }
+
+        CompressedSection& sec = CompSections[i];
+        sec.Offset = offset;
+        sec.Length = length;
+        sec.Data = &CompData[dataoffset];
+        sec.Loaded = false;
+
+        memcpy(&MemBuffer[offset], &entry[0], 4);
+        memcpy(&MemBuffer[offset+4], &length, 4);
+
+        expected = offset + length;
+    }
+
+    if (expected != rawlen)
+    {
+        printf("savestate: compressed savestate is missing sections\n");
+        return false;
+    }
+
+    return true;
+}
+
+void Savestate::LoadCompressedSection(u32 offset)
+{
+    CompressedSection* sec = nullptr;
+    for (u32 i = 0; i < NumCompSections; i++)
+    {
+        if (CompSections[i].Offset == offset)
+        {
+            sec = &CompSections[i];
+            break;
+        }
+    }
+
+    if (!sec || sec->Loaded) return;
+    sec->Loaded = true;
+
+    u32 datalen = sec->Length - 16;
+    u32 numblocks = (datalen + kCompressBlockSize - 1) / kCompressBlockSize;
+
+    std::vector<CompressJob> jobs(numblocks);
+    const u8* src = &sec->Data[numblocks * 4];
+    for (u32 i = 0; i < numblocks; i++)
+    {
+        CompressJob& job = jobs[i];
+        memcpy(&job.SrcLen, &sec->Data[i * 4], 4);
+        job.Src = src;
+        job.Dst = &MemBuffer[offset + 16 + (i * kCompressBlockSize)];
+        job.DstLen = std::min(kCompressBlockSize, datalen - (i * kCompressBlockSize));
+
+        src += job.SrcLen;
+    }
+
+    RunCompressJobs(jobs.data(), numblocks, false);
+
+    for (CompressJob& job : jobs)
+    {
+        if (!job.OK)
+        {
+            printf("savestate: section %.4s is corrupt\n", (const char*)&MemBuffer[offset]);
             Error = true;
             return;
         }
+    }
+}
 
-        buf = 0;
-        fread(&buf, 4, 1, file);
-        if (buf != len)
+void Savestate::Write(const void* data, u32 len)
+{
+    if (file)
+    {
+        fwrite(data, len, 1, file);
+        return;
+    }
+
+    if (MemPos + len > MemBufferSize)
+    {
+        u32 newsize = MemBufferSize;
+        while (MemPos + len > newsize)
+            newsize <<= 1;
+
+        u8* newbuf = (u8*)realloc(MemBuffer, newsize);
+        if (!newbuf)
         {
-            printf("savestate: bad length %d\n", buf);
+            printf("savestate: could not grow buffer to %d bytes\n", newsize);
             Error = true;
             return;
         }
 
-        fseek(file, 4, SEEK_CUR);
+        MemBuffer = newbuf;
+        MemBufferSize = newsize;
     }
 
-    CurSection = -1;
+    memcpy(&MemBuffer[MemPos], data, len);
+    MemPos += len;
+    if (MemPos > MemLength) MemLength = MemPos;
 }
 
-Savestate::~Savestate()
+void Savestate::Read(void* data, u32 len)
 {
-    if (Error) return;
-
-    if (Saving)
+    if (file)
     {
-        if (CurSection != 0xFFFFFFFF)
-        {
-            u32 pos = (u32)ftell(file);
-            fseek(file, CurSection+4, SEEK_SET);
+        fread(data, len, 1, file);
+        return;
+    }
 
-            u32 len = pos - CurSection;
-            fwrite(&len, 4, 1, file);
+    // like fread(), leave the destination alone past the end
+    if (MemPos >= MemLength) return;
+    if (len > MemLength - MemPos) len = MemLength - MemPos;
 
-            fseek(file, pos, SEEK_SET);
-        }
+    memcpy(data, &MemBuffer[MemPos], len);
+    MemPos += len;
+}
+
+void Savestate::Seek(u32 pos)
+{
+    if (file)
+        fseek(file, pos, SEEK_SET);
+    else
+        MemPos = pos;
+}
+
+u32 Savestate::Tell()
+{
+    if (file)
+        return (u32)ftell(file);
+    else
+        return MemPos;
+}
 
+u32 Savestate::End()
+{
+    if (file)
+    {
+        u32 pos = (u32)ftell(file);
         fseek(file, 0, SEEK_END);
         u32 len = (u32)ftell(file);
-        fseek(file, 8, SEEK_SET);
-        fwrite(&len, 4, 1, file);
+        fseek(file, pos, SEEK_SET);
+        return len;
     }
+    else
+        return MemLength;
+}
 
-    if (file) fclose(file);
+void Savestate::WriteHeader()
+{
+    const char* magic = "MELN";
+
+    VersionMajor = SAVESTATE_MAJOR;
+    VersionMinor = SAVESTATE_MINOR;
+
+    u8 zero[8] = {0};
+
+    Write(magic, 4);
+    Write(&VersionMajor, 2);
+    Write(&VersionMinor, 2);
+    Write(zero, 8); // length to be fixed later
+}
+
+bool Savestate::ReadHeader(u32 len)
+{
+    const char* magic = "MELN";
+
+    u32 buf = 0;
+
+    Read(&buf, 4);
+    if (buf != ((u32*)magic)[0])
+    {
+        printf("savestate: invalid magic %08X\n", buf);
+        return false;
+    }
+
+    VersionMajor = 0;
+    VersionMinor = 0;
+
+    Read(&VersionMajor, 2);
+    if (VersionMajor != SAVESTATE_MAJOR)
+    {
+        printf("savestate: bad version major %d, expecting %d\n", VersionMajor, SAVESTATE_MAJOR);
+        return false;
+    }
+
+    Read(&VersionMinor, 2);
+    if (VersionMinor > SAVESTATE_MINOR)
+    {
+        printf("savestate: state from the future, %d > %d\n", VersionMinor, SAVESTATE_MINOR);
+        return false;
+    }
+
+    buf = 0;
+    Read(&buf, 4);
+    if (buf != len)
+    {
+        printf("savestate: bad length %d\n", buf);
+        return false;
+    }
+
+    Seek(0x10);
+    return true;
+}
+
+void Savestate::FinishSection()
+{
+    if (CurSection == 0xFFFFFFFF) return;
+
+    u32 pos = Tell();
+    Seek(CurSection+4);
+
+    u32 len = pos - CurSection;
+    Write(&len, 4);
+
+    Seek(pos);
+}
+
+void Savestate::Finish()
+{
+    FinishSection();
+
+    u32 pos = Tell();
+    u32 len = End();
+    Seek(8);
+    Write(&len, 4);
+    Seek(pos);
 }
 
 void Savestate::Section(const char* magic)
@@ -160,31 +797,24 @@ void Savestate::Section(const char* magic)
 
     if (Saving)
     {
-        if (CurSection != 0xFFFFFFFF)
-        {
-            u32 pos = (u32)ftell(file);
-            fseek(file, CurSection+4, SEEK_SET);
+        FinishSection();
 
-            u32 len = pos - CurSection;
-            fwrite(&len, 4, 1, file);
+        CurSection = Tell();
 
-            fseek(file, pos, SEEK_SET);
-        }
-
-        CurSection = (u32)ftell(file);
+        u8 zero[12] = {0};
 
-        fwrite(magic, 4, 1, file);
-        fseek(file, 12, SEEK_CUR);
+        Write(magic, 4);
+        Write(zero, 12);
     }
     else
     {
-        fseek(file, 0x10, SEEK_SET);
+        Seek(0x10);
 
         for (;;)
         {
             u32 buf = 0;
 
-            fread(&buf, 4, 1, file);
+            Read(&buf, 4);
             if (buf != ((u32*)magic)[0])
             {
                 if (buf == 0)
@@ -194,14 +824,17 @@ void Savestate::Section(const char* magic)
                 }
 
                 buf = 0;
-                fread(&buf, 4, 1, file);
-                fseek(file, buf-8, SEEK_CUR);
+                Read(&buf, 4);
+                Seek(Tell() + buf-8);
                 continue;
             }
 
-            fseek(file, 12, SEEK_CUR);
+            Seek(Tell() + 12);
             break;
         }
+
+        if (CompSections)
+            LoadCompressedSection(Tell() - 16);
     }
 }
 
@@ -211,11 +844,11 @@ void Savestate::Var8(u8* var)
 
     if (Saving)
     {
-        fwrite(var, 1, 1, file);
+        Write(var, 1);
     }
     else
     {
-        fread(var, 1, 1, file);
+        Read(var, 1);
     }
 }
 
@@ -225,11 +858,11 @@ void Savestate::Var16(u16* var)
 
     if (Saving)
     {
-        fwrite(var, 2, 1, file);
+        Write(var, 2);
     }
     else
     {
-        fread(var, 2, 1, file);
+        Read(var, 2);
     }
 }
 
@@ -239,11 +872,11 @@ void Savestate::Var32(u32* var)
 
     if (Saving)
     {
-        fwrite(var, 4, 1, file);
+        Write(var, 4);
     }
     else
     {
-        fread(var, 4, 1, file);
+        Read(var, 4);
     }
 }
 
@@ -253,11 +886,11 @@ void Savestate::Var64(u64* var)
 
     if (Saving)
     {
-        fwrite(var, 8, 1, file);
+        Write(var, 8);
     }
     else
     {
-        fread(var, 8, 1, file);
+        Read(var, 8);
     }
 }
 
@@ -283,10 +916,89 @@ void Savestate::VarArray(void* data, u32 len)
 
     if (Saving)
     {
-        fwrite(data, len, 1, file);
+        Write(data, len);
     }
     else
     {
-        fread(data, len, 1, file);
+        Read(data, len);
     }
 }
+
+void Savestate::VarArray(void* data, u32 len, SavestateTracker* tracker)
+{
+    if (Error) return;
+
+    u32 pos = Tell();
+
+    // find out what the buffer holds from the last time
+    TrackedArray* tracked = nullptr;
+    if (!file && MemBufferSize)
+    {
+        for (u32 i = 0; i < NumTracked; i++)
+        {
+            if (Tracked[i].TrackerID == tracker->ID)
+            {
+                tracked = &Tracked[i];
+                break;
+            }
+        }
+
+        if (!tracked && NumTracked < sizeof(Tracked)/sizeof(Tracked[0]))
+        {
+            tracked = &Tracked[NumTracked++];
+            tracked->TrackerID = tracker->ID;
+            tracked->Generation = 0;
+        }
+    }
+
+    bool incremental = tracked && tracked->Generation
+        && tracked->Offset == pos && tracked->Length == len
+        && (pos + len) <= (Saving ? MemBufferSize : MemLength);
+
+    if (!incremental)
+    {
+        VarArray(data, len);
+
+        if (!Saving)
+            tracker->WriteAll();
+    }
+    else
+    {
+        u8* buf = &MemBuffer[pos];
+        u32 pagesize = 1 << tracker->PageShift;
+        u32 numpages = (len + pagesize - 1) >> tracker->PageShift;
+
+        for (u32 i = 0; i < numpages; i++)
+        {
+            if (tracker->Pages[i] <= tracked->Generation)
+                continue;
+
+            u32 offset = i << tracker->PageShift;
+            u32 chunk = std::min(pagesize, len - offset);
+
+            if (Saving)
+            {
+                memcpy(&buf[offset], &((u8*)data)[offset], chunk);
+            }
+            else
+            {
+                memcpy(&((u8*)data)[offset], &buf[offset], chunk);
+                tracker->Pages[i] = tracker->Generation;
+            }
+        }
+
+        MemPos = pos + len;
+        if (MemPos > MemLength) MemLength = MemPos;
+    }
+
+    if (Error) return;
+
+    if (tracked)
+    {
+        tracked->Offset = pos;
+        tracked->Length = len;
+        tracked->Generation = tracker->Generation;
+    }
+
+    tracker->Generation++;
+}
@@ -23,12 +23,42 @@
 #include "types.h"
 
 #define SAVESTATE_MAJOR 9
-#define SAVESTATE_MINOR 0
+#define SAVESTATE_MINOR 3
+
+// write tracking for big memory areas, so memory-backed savestates only
+// have to copy the pages that changed since they were last saved or loaded
+// each page written to is tagged with the current generation, and a new
+// generation starts every time a savestate goes over the area
+class SavestateTracker
+{
+public:
+    SavestateTracker(u32 size, u32 pageshift);
+    ~SavestateTracker();
+
+    void Write(u32 offset)
+    {
+        Pages[offset >> PageShift] = Generation;
+    }
+
+    // when the whole area changed
+    void WriteAll();
+
+    u32 ID; // unique, unlike the address of the tracker
+    u32 PageShift;
+    u32 NumPages;
+    u32* Pages;
+    u32 Generation;
+};
 
 class Savestate
 {
 public:
     Savestate(const char* filename, bool save);
+    // memory-backed savestates
+    // saving: the state is written to a buffer that grows as needed
+    Savestate();
+    // loading: the state is read from a buffer owned by the caller
+    Savestate(const u8* data, u32 len);
     ~Savestate();
 
     bool Error;
@@ -49,6 +79,7 @@ public:
     void Bool32(bool* var);
 
     void VarArray(void* data, u32 len);
+    void VarArray(void* data, u32 len, SavestateTracker* tracker);
 
     bool IsAtleastVersion(u32 major, u32 minor)
     {
@@ -57,8 +88,72 @@ public:
         return false;
     }
 
+    // for memory-backed saving: the finished state, valid as long as
+    // the savestate exists
+    const u8* Buffer();
+    u32 Length();
+
+    // for memory-backed saving: discard the state and start a new one,
+    // reusing the buffer
+    void Restart();
+
+    // for memory-backed saving: finish the state and start loading it back
+    // Restart() can be used afterwards to save over it again
+    void StartLoading();
+
+    // for memory-backed saving: compress the finished state, for writing
+    // to a file. the result loads like any other savestate
+    // returns a buffer to be freed with free(), or nullptr on failure
+    u8* Compress(u32* len);
+
 private:
     FILE* file;
+
+    u8* MemBuffer;
+    u32 MemBufferSize;
+    u32 MemLength;
+    u32 MemPos;
+
+    // where the tracked arrays are in the buffer, and which generation
+    // of them it holds
+    struct TrackedArray
+    {
+        u32 TrackerID;
+        u32 Offset;
+        u32 Length;
+        u32 Generation;
+    };
+
+    TrackedArray Tracked[16];
+    u32 NumTracked;
+
+    // when loading a compressed savestate, sections are only decompressed
+    // once they're asked for
+    struct CompressedSection
+    {
+        u32 Offset; // in the uncompressed state
+        u32 Length;
+        const u8* Data; // block lengths, then the blocks
+        bool Loaded;
+    };
+
+    u8* CompData;
+    CompressedSection* CompSections;
+    u32 NumCompSections;
+
+    bool OpenCompressed(const u8* data, u32 len);
+    void LoadCompressedSection(u32 offset);
+
+    void Write(const void* data, u32 len);
+    void Read(void* data, u32 len);
+    void Seek(u32 pos);
+    u32 Tell();
+    u32 End();
+
+    bool ReadHeader(u32 len);
+    void WriteHeader();
+    void FinishSection();
+    void Finish();
 };
 
 #endif // SAVESTATE_H
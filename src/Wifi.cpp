@@ -42,6 +42,15 @@ u64 USCounter;
 u64 USCompare;
 bool BlockBeaconIRQ14;
 
+// the microsecond timer ticks every 33 system cycles while the wifi clock is on
+// most ticks only bump a few counters when the hardware is idle, so those ticks
+// are applied lazily: when the counters are accessed, or in bulk right before
+// the next tick that can actually do something, which is the only one that
+// gets an Event_Wifi
+const u32 kUSTimerInterval = 33;
+u64 USTimestamp;    // timestamp of the last tick that was applied
+u64 USTimerTarget;  // timestamp of the pending Event_Wifi
+
 u32 CmdCounter;
 
 u16 BBCnt;
@@ -202,6 +211,9 @@ void Reset()
     USCompare = 0;
     BlockBeaconIRQ14 = false;
 
+    USTimestamp = 0;
+    USTimerTarget = 0;
+
     ComStatus = 0;
     TXCurSlot = -1;
     RXCounter = 0;
@@ -214,6 +226,8 @@ void Reset()
     WifiAP::Reset();
 }
 
+void ScheduleUSTimer();
+
 void DoSavestate(Savestate* file)
 {
     file->Section("WIFI");
@@ -246,6 +260,20 @@ void DoSavestate(Savestate* file)
     file->Var32((u32*)&MPNumReplies);
 
     file->Var32(&CmdCounter);
+
+    if (file->IsAtleastVersion(9, 1))
+    {
+        file->Var64(&USTimestamp);
+        file->Var64(&USTimerTarget);
+    }
+    else if (!file->Saving && !(IOPORT(W_PowerUS) & 0x0001))
+    {
+        // older states tick the timer every 33 cycles, restart it from here
+        NDS::CancelEvent(NDS::Event_Wifi);
+        USTimestamp = NDS::GetSysClockCycles(0);
+        USTimerTarget = 0;
+        ScheduleUSTimer();
+    }
 }
 
 
@@ -960,9 +988,89 @@ void MSTimer()
     }
 }
 
+u32 USTimerTicksToEvent()
+{
+    // number of ticks until the next one that may have side effects
+    // (anything besides bumping counters)
+
+    // sending or receiving: every tick counts
+    if (ComStatus != 0 || IOPORT(W_TXBusy) != 0)
+        return 1;
+
+    // polling for incoming packets
+    u32 ticks = ((0x200 - (RXCounter & 0x1FF)) & 0x1FF) + 1;
+
+    if (IOPORT(W_USCountCnt))
+    {
+        // millisecond timer
+        u32 msticks = 0x400 - (USCounter & 0x3FF);
+        if (msticks < ticks) ticks = msticks;
+
+        // pre-beacon IRQ
+        if (IOPORT(W_USCompareCnt))
+        {
+            u32 uspart = 0x3FF - (IOPORT(W_PreBeacon) & 0x3FF);
+            u32 pbticks = (uspart - USCounter) & 0x3FF;
+            if (pbticks == 0) pbticks = 0x400;
+            if (pbticks < ticks) ticks = pbticks;
+        }
+    }
+
+    return ticks;
+}
+
+void USTimerSkip(u32 ticks)
+{
+    // apply idle ticks: USTimerTicksToEvent() guarantees that these
+    // don't cross a millisecond or reach the RX polling interval
+
+    WifiAP::USTimer(ticks);
+
+    if (IOPORT(W_USCountCnt))
+        USCounter += ticks;
+
+    if (IOPORT(W_CmdCountCnt) & 0x0001)
+        CmdCounter = (CmdCounter > ticks) ? (CmdCounter - ticks) : 0;
+
+    u16 contentfree = IOPORT(W_ContentFree);
+    IOPORT(W_ContentFree) = (contentfree > ticks) ? (contentfree - ticks) : 0;
+
+    RXCounter += ticks;
+}
+
+void USTimerCatchUp(u64 timestamp)
+{
+    // apply the ticks that have elapsed by the given time
+    // the tick the pending event is for is left for the event itself
+    if (timestamp >= USTimerTarget)
+        timestamp = USTimerTarget - kUSTimerInterval;
+    if (timestamp <= USTimestamp)
+        return;
+
+    u32 ticks = (u32)((timestamp - USTimestamp) / kUSTimerInterval);
+    if (!ticks) return;
+
+    USTimerSkip(ticks);
+    USTimestamp += ticks * kUSTimerInterval;
+}
+
+void ScheduleUSTimer()
+{
+    u64 target = USTimestamp + USTimerTicksToEvent() * kUSTimerInterval;
+    if (target == USTimerTarget)
+        return;
+
+    NDS::CancelEvent(NDS::Event_Wifi);
+    USTimerTarget = target;
+    NDS::ScheduleEvent(NDS::Event_Wifi, false, (s32)(target - NDS::GetSysClockCycles(0)), USTimer, 0);
+}
+
 void USTimer(u32 param)
 {
-    WifiAP::USTimer();
+    USTimerCatchUp(USTimerTarget - kUSTimerInterval);
+    USTimestamp = USTimerTarget;
+
+    WifiAP::USTimer(1);
 
     if (IOPORT(W_USCountCnt))
     {
@@ -1099,7 +1207,9 @@ void USTimer(u32 param)
 
     // TODO: make it more accurate, eventually
     // in the DS, the wifi system has its own 22MHz clock and doesn't use the system clock
-    NDS::ScheduleEvent(NDS::Event_Wifi, true, 33, USTimer, 0);
+    u32 ticks = USTimerTicksToEvent();
+    USTimerTarget = USTimestamp + ticks * kUSTimerInterval;
+    NDS::ScheduleEvent(NDS::Event_Wifi, true, ticks * kUSTimerInterval, USTimer, 0);
 }
 
 
@@ -1155,6 +1265,10 @@ u16 Read(u32 addr)
 
     bool activeread = (addr < 0x1000);
 
+    // bring the lazily updated counters up to date
+    if (!(IOPORT(W_PowerUS) & 0x0001))
+        USTimerCatchUp(NDS::GetSysClockCycles(0));
+
     switch (addr)
     {
     case W_Random: // random generator. not accurate
@@ -1229,6 +1343,8 @@ u16 Read(u32 addr)
     return IOPORT(addr&0xFFF);
 }
 
+void WriteIO(u32 addr, u16 val);
+
 void Write(u32 addr, u16 val)
 {//printf("WIFI WRITE %08X %04X\n", addr, val);
     if (addr >= 0x04810000)
@@ -1244,6 +1360,19 @@ void Write(u32 addr, u16 val)
     if (addr >= 0x2000 && addr < 0x4000)
         return;
 
+    // the write is applied at the current time: ticks before it see the
+    // old register state, and it may move the next timer event
+    if (!(IOPORT(W_PowerUS) & 0x0001))
+        USTimerCatchUp(NDS::GetSysClockCycles(0));
+
+    WriteIO(addr, val);
+
+    if (!(IOPORT(W_PowerUS) & 0x0001))
+        ScheduleUSTimer();
+}
+
+void WriteIO(u32 addr, u16 val)
+{
     switch (addr)
     {
     case W_ModeReset:
@@ -1346,7 +1475,8 @@ void Write(u32 addr, u16 val)
         if ((IOPORT(W_PowerUS) & 0x0001) && !(val & 0x0001))
         {
             printf("WIFI ON\n");
-            NDS::ScheduleEvent(NDS::Event_Wifi, false, 33, USTimer, 0);
+            USTimestamp = NDS::GetSysClockCycles(0);
+            USTimerTarget = 0; // scheduled after the write
             if (!MPInited)
             {
                 Platform::MP_Init();
@@ -115,12 +115,12 @@ bool MACIsBroadcast(u8* a)
 }
 
 
-void USTimer()
+void USTimer(u32 ticks)
 {
-    USCounter++;
+    u64 oldcounter = USCounter;
+    USCounter += ticks;
 
-    u32 chk = (u32)USCounter;
-    if (!(chk & 0x1FFFF))
+    if ((oldcounter >> 17) != (USCounter >> 17))
     {
         // send beacon every 128ms
         BeaconDue = true;
@@ -21,6 +21,7 @@
 
 #include "types.h"
 
+#include <functional>
 #include <vector>
 
 namespace Frontend
@@ -80,7 +81,8 @@ int LoadBIOS();
 // load a ROM file to the specified cart slot
 // note: loading a ROM to the NDS slot resets emulation
 int LoadROM(const char* file, int slot);
-int LoadROM(const u8 *romdata, u32 romlength, const char *archivefilename, const char *romfilename, const char *sramfilename, int slot);
+// load a ROM that was extracted from an archive to the given file
+int LoadROM(const char *file, const char *archivefilename, const char *sramfilename, int slot);
 
 // unload the ROM loaded in the specified cart slot
 // simulating ejection of the cartridge
@@ -103,11 +105,58 @@ bool SavestateExists(int slot);
 bool LoadState(const char* filename);
 
 // save the current emulator state to the given file
-bool SaveState(const char* filename);
+// the state is captured right away by the calling thread, so emulation has
+// to be paused, and it is written to disk in the background
+// returns false if the state couldn't be captured
+// once the file is written (or failed to be), the callback is called
+// with the result. note that it is called from the writer thread.
+bool SaveState(const char* filename, std::function<void(bool)> callback = nullptr);
+
+// wait until all pending savestate writes are done
+void FlushSaveStates();
 
 // undo the latest savestate load
 void UndoStateLoad();
 
+// initialize the rewind buffer
+// * memorylimit: how much memory the snapshots may use, in bytes
+// * interval: how many frames between two snapshots
+void Init_Rewind(u64 memorylimit, u32 interval);
+
+// deinitialize the rewind buffer
+void DeInit_Rewind();
+
+// change the rewind buffer settings, takes effect on the next snapshot
+void Rewind_SetParams(u64 memorylimit, u32 interval);
+
+// discard all snapshots
+// should be called whenever the emulator state is replaced (ROM load, reset, savestate load)
+void Rewind_Reset();
+
+// to be called after each emulated frame, takes a snapshot if one is due
+void Rewind_Frame();
+
+// restore the latest snapshot and remove it from the buffer
+// returns false if there is nothing to go back to
+bool Rewind_Step();
+
+// get how many snapshots are currently held
+int Rewind_NumSnapshots();
+
+// get how much memory the snapshots currently use, in bytes
+u64 Rewind_MemoryUsage();
+
+// initialize run-ahead
+void Init_RunAhead();
+
+// deinitialize run-ahead
+void DeInit_RunAhead();
+
+// emulate one frame, but display the one that comes 'frames' frames later
+// with the current input. the emulator state is that of the real frame.
+// returns the amount of scanlines of the real frame, like NDS::RunFrame()
+u32 RunAhead_Frame(int frames);
+
 // imports savedata from an external file. Returns the difference between the filesize and the SRAM size
 int ImportSRAM(const char* filename);
 
@@ -25,6 +25,7 @@ namespace Config
 extern int ConsoleType;
 extern int DirectBoot;
 extern int SavestateRelocSRAM;
+extern int SavestateCompress;
 
 }
 
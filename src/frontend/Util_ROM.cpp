@@ -17,8 +17,16 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#ifdef _WIN32
+#include <io.h>
+#endif
 
+#include <atomic>
+#include <deque>
+#include <string>
 #include <utility>
 
 #ifdef ARCHIVE_SUPPORT_ENABLED
@@ -46,14 +54,35 @@ char PrevSRAMPath[ROMSlot_MAX][1024]; // for savestate 'undo load'
 char NDSROMExtension[4];
 
 bool SavestateLoaded;
+Savestate* BackupState; // state from before the last load, for 'undo load'
 
 ARCodeFile* CheatFile;
 bool CheatsOn;
 
+// savestates are captured into memory on the emulator thread, then written
+// to disk (compressed if enabled) by a separate thread so saving doesn't
+// stall emulation
+struct StateWriteJob
+{
+    std::string Filename;
+    Savestate* State;
+    std::function<void(bool)> Callback;
+};
+
+Platform::Thread* StateWriterThread;
+Platform::Semaphore* StateWriterSema;
+Platform::Semaphore* StateWriterDone;
+Platform::Mutex* StateWriterLock;
+std::deque<StateWriteJob> StateWriterQueue;
+std::atomic<bool> StateWriterRunning;
+
+void StateWriterFunc();
+
 
 void Init_ROM()
 {
     SavestateLoaded = false;
+    BackupState = nullptr;
 
     memset(ROMPath[ROMSlot_NDS], 0, 1024);
     memset(ROMPath[ROMSlot_GBA], 0, 1024);
@@ -64,10 +93,32 @@ void Init_ROM()
 
     CheatFile = nullptr;
     CheatsOn = false;
+
+    StateWriterSema = Platform::Semaphore_Create();
+    StateWriterDone = Platform::Semaphore_Create();
+    StateWriterLock = Platform::Mutex_Create();
+    StateWriterRunning = true;
+    StateWriterThread = Platform::Thread_Create(StateWriterFunc);
 }
 
 void DeInit_ROM()
 {
+    FlushSaveStates();
+
+    StateWriterRunning = false;
+    Platform::Semaphore_Post(StateWriterSema);
+    Platform::Thread_Wait(StateWriterThread);
+    Platform::Thread_Free(StateWriterThread);
+    Platform::Semaphore_Free(StateWriterSema);
+    Platform::Semaphore_Free(StateWriterDone);
+    Platform::Mutex_Free(StateWriterLock);
+
+    if (BackupState)
+    {
+        delete BackupState;
+        BackupState = nullptr;
+    }
+
     if (CheatFile)
     {
         delete CheatFile;
@@ -298,13 +349,17 @@ int LoadBIOS()
     NDS::LoadBIOS();
 
     SavestateLoaded = false;
+    Rewind_Reset();
 
     LoadCheats();
 
     return Load_OK;
 }
 
-int LoadROM(const u8 *romdata, u32 romlength, const char *archivefilename, const char *romfilename, const char *sramfilename, int slot)
+// common part to loading a ROM that comes from an archive
+// 'load' does the actual loading, given the SRAM path and whether to boot directly
+int LoadArchivedROM(const char *archivefilename, const char *sramfilename, int slot,
+                    std::function<bool(const char*, bool)> load)
 {
     int res;
     bool directboot = Config::DirectBoot != 0;
@@ -354,22 +409,19 @@ int LoadROM(const u8 *romdata, u32 romlength, const char *archivefilename, const
 
     NDS::SetConsoleType(Config::ConsoleType);
 
-    if (slot == ROMSlot_NDS && NDS::LoadROM(romdata, romlength, SRAMPath[slot], directboot))
+    if (load(SRAMPath[slot], directboot))
     {
-        SavestateLoaded = false;
-
-        LoadCheats();
+        SavestateLoaded = false; // checkme?? (for GBA)
+        Rewind_Reset();
 
-        // Reload the inserted GBA cartridge (if any)
-        // TODO: report failure there??
-        //if (ROMPath[ROMSlot_GBA][0] != '\0') NDS::LoadGBAROM(ROMPath[ROMSlot_GBA], SRAMPath[ROMSlot_GBA]);
+        if (slot == ROMSlot_NDS)
+        {
+            LoadCheats();
 
-        strncpy(PrevSRAMPath[slot], SRAMPath[slot], 1024); // safety
-        return Load_OK;
-    }
-    else if (slot == ROMSlot_GBA && NDS::LoadGBAROM(romdata, romlength, romfilename, SRAMPath[slot]))
-    {
-        SavestateLoaded = false; // checkme??
+            // Reload the inserted GBA cartridge (if any)
+            // TODO: report failure there??
+            //if (ROMPath[ROMSlot_GBA][0] != '\0') NDS::LoadGBAROM(ROMPath[ROMSlot_GBA], SRAMPath[ROMSlot_GBA]);
+        }
 
         strncpy(PrevSRAMPath[slot], SRAMPath[slot], 1024); // safety
         return Load_OK;
@@ -382,6 +434,17 @@ int LoadROM(const u8 *romdata, u32 romlength, const char *archivefilename, const
     }
 }
 
+int LoadROM(const char *file, const char *archivefilename, const char *sramfilename, int slot)
+{
+    return LoadArchivedROM(archivefilename, sramfilename, slot, [=](const char* sram, bool directboot)
+    {
+        if (slot == ROMSlot_NDS)
+            return NDS::LoadROM(file, sram, directboot, true); // from the archive cache
+        else
+            return NDS::LoadGBAROM(file, sram);
+    });
+}
+
 int LoadROM(const char* file, int slot)
 {
     DSi::CloseDSiNAND();
@@ -440,6 +503,7 @@ int LoadROM(const char* file, int slot)
     if (slot == ROMSlot_NDS && NDS::LoadROM(ROMPath[slot], SRAMPath[slot], directboot))
     {
         SavestateLoaded = false;
+        Rewind_Reset();
 
         LoadCheats();
 
@@ -453,6 +517,7 @@ int LoadROM(const char* file, int slot)
     else if (slot == ROMSlot_GBA && NDS::LoadGBAROM(ROMPath[slot], SRAMPath[slot]))
     {
         SavestateLoaded = false; // checkme??
+        Rewind_Reset();
 
         strncpy(PrevSRAMPath[slot], SRAMPath[slot], 1024); // safety
         return Load_OK;
@@ -540,6 +605,7 @@ void UnloadROM(int slot)
     else if (slot == ROMSlot_GBA)
     {
         GBACart::Eject();
+        Rewind_Reset();
     }
 
     ROMPath[slot][0] = '\0';
@@ -584,6 +650,7 @@ int Reset()
     }
 
     SavestateLoaded = false;
+    Rewind_Reset();
 
     NDS::SetConsoleType(Config::ConsoleType);
 
@@ -605,7 +672,6 @@ int Reset()
 #ifdef ARCHIVE_SUPPORT_ENABLED
         else
         {
-            u8 *romdata = nullptr; u32 romlen;
             char romfilename[1024] = {0}, sramfilename[1024];
             strncpy(sramfilename, SRAMPath[ROMSlot_NDS], 1024); // Use existing SRAMPath
 
@@ -616,13 +682,11 @@ int Reset()
             strncpy(romfilename, &sramfilename[pos + 1], 1024);
             strncpy(&romfilename[strlen(romfilename) - 3], NDSROMExtension, 3); // extension could be nds, srl or dsi
             printf("RESET loading from archive : %s\n", romfilename);
-            romlen = Archive::ExtractFileFromArchive(ROMPath[ROMSlot_NDS], romfilename, &romdata);
-            if(!romdata)
+            QVector<QString> extractResult = Archive::ExtractFileToCache(ROMPath[ROMSlot_NDS], romfilename);
+            if (extractResult[0] == "Err")
                 return Load_ROMLoadError;
 
-            bool ok = NDS::LoadROM(romdata, romlen, sramfilename, directboot);
-            delete romdata;
-            if(!ok)
+            if (!NDS::LoadROM(extractResult[0].toUtf8().constData(), sramfilename, directboot, true))
                 return Load_ROMLoadError;
         }
 #endif
@@ -642,7 +706,6 @@ int Reset()
 #ifdef ARCHIVE_SUPPORT_ENABLED
         else
         {
-            u8 *romdata = nullptr; u32 romlen;
             char romfilename[1024] = {0}, sramfilename[1024];
             strncpy(sramfilename, SRAMPath[ROMSlot_GBA], 1024); // Use existing SRAMPath
 
@@ -653,13 +716,11 @@ int Reset()
             strncpy(romfilename, &sramfilename[pos + 1], 1024);
             strncpy(&romfilename[strlen(romfilename) - 3], "gba", 3);
             printf("RESET loading from archive : %s\n", romfilename);
-            romlen = Archive::ExtractFileFromArchive(ROMPath[ROMSlot_GBA], romfilename, &romdata);
-            if(!romdata)
+            QVector<QString> extractResult = Archive::ExtractFileToCache(ROMPath[ROMSlot_GBA], romfilename);
+            if (extractResult[0] == "Err")
                 return Load_ROMLoadError;
 
-            bool ok = NDS::LoadGBAROM(romdata, romlen, romfilename, SRAMPath[ROMSlot_GBA]);
-            delete romdata;
-            if(!ok)
+            if (!NDS::LoadGBAROM(extractResult[0].toUtf8().constData(), SRAMPath[ROMSlot_GBA]))
                 return Load_ROMLoadError;
         }
 #endif
@@ -713,17 +774,34 @@ bool SavestateExists(int slot)
 {
     char ssfile[1024];
     GetSavestateName(slot, ssfile, 1024);
-    return Platform::FileExists(ssfile);
+
+    // no need to wait for a pending write to know the file will be there
+    bool pending = false;
+    Platform::Mutex_Lock(StateWriterLock);
+    for (const StateWriteJob& job : StateWriterQueue)
+    {
+        if (job.Filename == ssfile)
+        {
+            pending = true;
+            break;
+        }
+    }
+    Platform::Mutex_Unlock(StateWriterLock);
+
+    return pending || Platform::FileExists(ssfile);
 }
 
 bool LoadState(const char* filename)
 {
     u32 oldGBACartCRC = GBACart::CartCRC;
 
+    // the file may still be being written
+    FlushSaveStates();
+
     // backup
-    Savestate* backup = new Savestate("timewarp.mln", true);
-    NDS::DoSavestate(backup);
-    delete backup;
+    delete BackupState;
+    BackupState = new Savestate();
+    NDS::DoSavestate(BackupState);
 
     bool failed = false;
 
@@ -735,7 +813,7 @@ bool LoadState(const char* filename)
         //uiMsgBoxError(MainWindow, "Error", "Could not load savestate file.");
 
         // current state might be crapoed, so restore from sane backup
-        state = new Savestate("timewarp.mln", false);
+        state = new Savestate(BackupState->Buffer(), BackupState->Length());
         failed = true;
     }
 
@@ -778,38 +856,157 @@ bool LoadState(const char* filename)
         OSD::AddMessage(0, msg);*/
 
         SavestateLoaded = true;
+        Rewind_Reset();
     }
 
     return !failed;
 }
 
-bool SaveState(const char* filename)
+// make sure the data actually made it to the disk
+void SyncFile(FILE* f)
 {
-    Savestate* state = new Savestate(filename, true);
-    if (state->Error)
+    fflush(f);
+#ifdef _WIN32
+    _commit(_fileno(f));
+#else
+    fsync(fileno(f));
+#endif
+}
+
+bool WriteStateFile(const char* filename, Savestate* state)
+{
+    const u8* data = state->Buffer();
+    u32 len = state->Length();
+
+    u8* compdata = nullptr;
+    if (Config::SavestateCompress)
     {
-        delete state;
+        u32 complen;
+        compdata = state->Compress(&complen);
+        if (compdata)
+        {
+            data = compdata;
+            len = complen;
+        }
+        else
+            printf("savestate: compression failed, saving uncompressed\n");
+    }
+
+    // write to a temporary file and move it in place once it's complete and
+    // on the disk, so a failed write or a crash can't leave a truncated
+    // savestate behind
+    std::string tmpname = std::string(filename) + ".tmp";
+
+    FILE* file = Platform::OpenLocalFile(tmpname.c_str(), "wb");
+    if (!file)
+    {
+        printf("savestate: could not create %s\n", tmpname.c_str());
+        free(compdata);
         return false;
     }
-    else
+
+    bool ok = fwrite(data, len, 1, file) == 1;
+    SyncFile(file);
+    if (fclose(file) != 0) ok = false;
+    free(compdata);
+
+    if (!ok)
     {
-        NDS::DoSavestate(state);
-        delete state;
+        printf("savestate: could not write %s\n", tmpname.c_str());
+        return false;
+    }
 
-        if (Config::SavestateRelocSRAM && ROMPath[ROMSlot_NDS][0]!='\0')
-        {
-            strncpy(SRAMPath[ROMSlot_NDS], filename, 1019);
-            int len = strlen(SRAMPath[ROMSlot_NDS]);
-            strcpy(&SRAMPath[ROMSlot_NDS][len], ".sav");
-            SRAMPath[ROMSlot_NDS][len+4] = '\0';
+    if (!Platform::RenameLocalFile(tmpname.c_str(), filename))
+    {
+        printf("savestate: could not rename %s to %s\n", tmpname.c_str(), filename);
+        return false;
+    }
 
-            NDS::RelocateSave(SRAMPath[ROMSlot_NDS], true);
+    return true;
+}
+
+void StateWriterFunc()
+{
+    for (;;)
+    {
+        Platform::Semaphore_Wait(StateWriterSema);
+
+        Platform::Mutex_Lock(StateWriterLock);
+        if (StateWriterQueue.empty())
+        {
+            Platform::Mutex_Unlock(StateWriterLock);
+            if (!StateWriterRunning) break;
+            continue;
         }
+
+        StateWriteJob job = StateWriterQueue.front();
+        Platform::Mutex_Unlock(StateWriterLock);
+
+        bool ok = WriteStateFile(job.Filename.c_str(), job.State);
+        delete job.State;
+
+        if (job.Callback)
+            job.Callback(ok);
+
+        // only remove the job once it's fully done, so FlushSaveStates()
+        // doesn't return early
+        Platform::Mutex_Lock(StateWriterLock);
+        StateWriterQueue.pop_front();
+        Platform::Mutex_Unlock(StateWriterLock);
+
+        Platform::Semaphore_Post(StateWriterDone);
     }
+}
 
+bool SaveState(const char* filename, std::function<void(bool)> callback)
+{
+    Savestate* state = new Savestate();
+    NDS::DoSavestate(state);
+
+    // finish the state here, while nothing else can touch it
+    state->Length();
+    if (state->Error)
+    {
+        delete state;
+        return false;
+    }
+
+    if (Config::SavestateRelocSRAM && ROMPath[ROMSlot_NDS][0]!='\0')
+    {
+        strncpy(SRAMPath[ROMSlot_NDS], filename, 1019);
+        int len = strlen(SRAMPath[ROMSlot_NDS]);
+        strcpy(&SRAMPath[ROMSlot_NDS][len], ".sav");
+        SRAMPath[ROMSlot_NDS][len+4] = '\0';
+
+        NDS::RelocateSave(SRAMPath[ROMSlot_NDS], true);
+    }
+
+    StateWriteJob job;
+    job.Filename = filename;
+    job.State = state;
+    job.Callback = callback;
+
+    Platform::Mutex_Lock(StateWriterLock);
+    StateWriterQueue.push_back(job);
+    Platform::Mutex_Unlock(StateWriterLock);
+
+    Platform::Semaphore_Post(StateWriterSema);
     return true;
 }
 
+void FlushSaveStates()
+{
+    for (;;)
+    {
+        Platform::Mutex_Lock(StateWriterLock);
+        bool empty = StateWriterQueue.empty();
+        Platform::Mutex_Unlock(StateWriterLock);
+
+        if (empty) break;
+        Platform::Semaphore_Wait(StateWriterDone);
+    }
+}
+
 void UndoStateLoad()
 {
     if (!SavestateLoaded) return;
@@ -817,10 +1014,12 @@ void UndoStateLoad()
     // pray that this works
     // what do we do if it doesn't???
     // but it should work.
-    Savestate* backup = new Savestate("timewarp.mln", false);
+    Savestate* backup = new Savestate(BackupState->Buffer(), BackupState->Length());
     NDS::DoSavestate(backup);
     delete backup;
 
+    Rewind_Reset();
+
     if (ROMPath[ROMSlot_NDS][0]!='\0')
     {
         strncpy(SRAMPath[ROMSlot_NDS], PrevSRAMPath[ROMSlot_NDS], 1024);
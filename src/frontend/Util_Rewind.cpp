@@ -0,0 +1,334 @@
+/*
+    Copyright 2016-2021 Arisotura
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <deque>
+
+#include "FrontendUtil.h"
+
+#include "NDS.h"
+#include "Savestate.h"
+
+
+namespace Frontend
+{
+
+/*
+    Rewind buffer
+
+    the latest snapshot is kept as a full savestate. every older snapshot
+    is stored as the difference to the snapshot that was taken after it,
+    so going back one step means undoing one delta, and the oldest ones
+    can be dropped without touching anything else.
+
+    deltas are the XOR of both states, run-length encoded by 32-bit word:
+    a series of runs, each made of the amount of unchanged words to skip,
+    the amount of changed words, then the changed words themselves. since
+    most of the RAM doesn't change from a frame to the next, this makes
+    for very small deltas.
+*/
+
+struct RewindDelta
+{
+    u32* Data;
+    u32 Size;       // in words
+    u32 StateLength; // length of the savestate this delta leads to
+};
+
+u64 RewindMemoryLimit;
+u32 RewindInterval;
+u32 RewindFrameCount;
+
+u32* RewindState;     // latest snapshot
+u32 RewindStateLength;
+u32 RewindStateSize;  // allocated size, in words
+bool RewindStateValid;
+
+u32* RewindScratch;
+u32 RewindScratchSize;
+
+Savestate* RewindSaver; // kept around so its buffer can be reused
+
+std::deque<RewindDelta> RewindDeltas;
+u64 RewindDeltaMemory;
+
+
+void Init_Rewind(u64 memorylimit, u32 interval)
+{
+    RewindMemoryLimit = memorylimit;
+    RewindInterval = interval ? interval : 1;
+    RewindFrameCount = 0;
+
+    RewindState = nullptr;
+    RewindStateLength = 0;
+    RewindStateSize = 0;
+    RewindStateValid = false;
+
+    RewindScratch = nullptr;
+    RewindScratchSize = 0;
+
+    RewindSaver = nullptr;
+
+    RewindDeltaMemory = 0;
+}
+
+void DeInit_Rewind()
+{
+    Rewind_Reset();
+
+    if (RewindState) free(RewindState);
+    RewindState = nullptr;
+    RewindStateSize = 0;
+
+    if (RewindScratch) free(RewindScratch);
+    RewindScratch = nullptr;
+    RewindScratchSize = 0;
+
+    delete RewindSaver;
+    RewindSaver = nullptr;
+}
+
+void Rewind_SetParams(u64 memorylimit, u32 interval)
+{
+    RewindMemoryLimit = memorylimit;
+    RewindInterval = interval ? interval : 1;
+}
+
+void Rewind_Reset()
+{
+    for (RewindDelta& delta : RewindDeltas)
+        free(delta.Data);
+
+    RewindDeltas.clear();
+    RewindDeltaMemory = 0;
+
+    RewindStateValid = false;
+    RewindFrameCount = 0;
+}
+
+int Rewind_NumSnapshots()
+{
+    if (!RewindStateValid) return 0;
+    return RewindDeltas.size() + 1;
+}
+
+u64 Rewind_MemoryUsage()
+{
+    return RewindDeltaMemory + (RewindStateValid ? RewindStateLength : 0);
+}
+
+bool EnsureRewindBuffers(u32 words)
+{
+    if (words > RewindStateSize)
+    {
+        u32* newbuf = (u32*)realloc(RewindState, words*4);
+        if (!newbuf) return false;
+
+        // the XOR treats anything past the end of a state as zero
+        memset(&newbuf[RewindStateSize], 0, (words - RewindStateSize) * 4);
+        RewindState = newbuf;
+        RewindStateSize = words;
+    }
+
+    // worst case: one changed word out of two, three words per run
+    u32 scratchsize = words + (words >> 1) + 4;
+    if (scratchsize > RewindScratchSize)
+    {
+        u32* newbuf = (u32*)realloc(RewindScratch, scratchsize*4);
+        if (!newbuf) return false;
+
+        RewindScratch = newbuf;
+        RewindScratchSize = scratchsize;
+    }
+
+    return true;
+}
+
+// encode the difference between 'state' and the new state in 'data' (of
+// 'len' bytes, read as if padded with zeroes), then update 'state' to match
+u32 EncodeRewindDelta(u32* state, const u8* data, u32 len, u32 words, u32* out)
+{
+    u32 outpos = 0;
+    u32 i = 0;
+
+    const u32* data32 = (const u32*)data;
+    u32 fullwords = len >> 2;
+    auto getword = [=](u32 i) -> u32
+    {
+        if (i < fullwords) return data32[i];
+
+        u32 ret = 0;
+        if ((i << 2) < len) memcpy(&ret, &data[i << 2], len - (i << 2));
+        return ret;
+    };
+
+    while (i < words)
+    {
+        u32 start = i;
+        while (i < fullwords && state[i] == data32[i]) i++;
+        while (i < words && state[i] == getword(i)) i++;
+        if (i == words) break;
+
+        out[outpos++] = i - start;
+        u32 countpos = outpos++;
+
+        start = i;
+        while (i < words)
+        {
+            u32 val = getword(i);
+            if (state[i] == val) break;
+
+            out[outpos++] = state[i] ^ val;
+            state[i] = val;
+            i++;
+        }
+
+        out[countpos] = i - start;
+    }
+
+    return outpos;
+}
+
+void ApplyRewindDelta(u32* state, const u32* delta, u32 size)
+{
+    u32 i = 0;
+    u32 pos = 0;
+
+    while (pos < size)
+    {
+        i += delta[pos++];
+        u32 count = delta[pos++];
+
+        for (u32 j = 0; j < count; j++)
+            state[i++] ^= delta[pos++];
+    }
+}
+
+void Rewind_Frame()
+{
+    RewindFrameCount++;
+    if (RewindFrameCount < RewindInterval) return;
+    RewindFrameCount = 0;
+
+    if (!RewindSaver)
+        RewindSaver = new Savestate();
+    else
+        RewindSaver->Restart();
+
+    Savestate* state = RewindSaver;
+    NDS::DoSavestate(state);
+    if (state->Error)
+        return;
+
+    u32 len = state->Length();
+    const u8* data = state->Buffer();
+
+    // the deltas cover whichever state is the longest
+    u32 words = (std::max(len, RewindStateValid ? RewindStateLength : 0) + 3) >> 2;
+    if (!EnsureRewindBuffers(words))
+    {
+        printf("rewind: out of memory\n");
+        Rewind_Reset();
+        return;
+    }
+
+    if (RewindStateValid)
+    {
+        u32 oldlen = RewindStateLength;
+        u32 size = EncodeRewindDelta(RewindState, data, len, words, RewindScratch);
+
+        RewindDelta delta;
+        delta.Data = (u32*)malloc(size*4 + 1);
+        delta.Size = size;
+        delta.StateLength = oldlen;
+        if (delta.Data)
+        {
+            memcpy(delta.Data, RewindScratch, size*4);
+            RewindDeltas.push_back(delta);
+            RewindDeltaMemory += size*4 + sizeof(RewindDelta);
+        }
+        else
+        {
+            // can't keep the history going without this delta
+            printf("rewind: out of memory\n");
+            Rewind_Reset();
+        }
+    }
+    else
+    {
+        memcpy(RewindState, data, len);
+        if (RewindStateLength > len)
+            memset(&((u8*)RewindState)[len], 0, RewindStateLength - len);
+    }
+
+    RewindStateLength = len;
+    RewindStateValid = true;
+
+    // drop the oldest snapshots to stay within budget
+    while (!RewindDeltas.empty() && Rewind_MemoryUsage() > RewindMemoryLimit)
+    {
+        RewindDelta& delta = RewindDeltas.front();
+        RewindDeltaMemory -= delta.Size*4 + sizeof(RewindDelta);
+        free(delta.Data);
+        RewindDeltas.pop_front();
+    }
+}
+
+bool Rewind_Step()
+{
+    if (!RewindStateValid) return false;
+
+    Savestate* state = new Savestate((const u8*)RewindState, RewindStateLength);
+    if (state->Error)
+    {
+        delete state;
+        Rewind_Reset();
+        return false;
+    }
+
+    NDS::DoSavestate(state);
+    delete state;
+
+    // the snapshot we just went back to is consumed, and the one before
+    // it becomes the latest
+    if (RewindDeltas.empty())
+    {
+        RewindStateValid = false;
+    }
+    else
+    {
+        RewindDelta& delta = RewindDeltas.back();
+
+        // this also restores the zero padding past the end of the state
+        ApplyRewindDelta(RewindState, delta.Data, delta.Size);
+        RewindStateLength = delta.StateLength;
+
+        RewindDeltaMemory -= delta.Size*4 + sizeof(RewindDelta);
+        free(delta.Data);
+        RewindDeltas.pop_back();
+    }
+
+    RewindFrameCount = 0;
+    return true;
+}
+
+}
@@ -0,0 +1,101 @@
+/*
+    Copyright 2016-2021 Arisotura
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+#include <stdio.h>
+
+#include "FrontendUtil.h"
+
+#include "NDS.h"
+#include "GPU.h"
+#include "SPU.h"
+#include "Savestate.h"
+
+
+namespace Frontend
+{
+
+/*
+    Run-ahead
+
+    games usually take a frame or more to react to input. to hide that, the
+    real frame is emulated without video, its state is saved, then a few
+    more frames are emulated with the same input and the last one is shown.
+    going back to the saved state afterwards means the emulation itself
+    never sees the frames that were run ahead.
+
+    audio only comes from the real frame, and nothing is drawn for the
+    frames that are thrown away. 3D and display capture still run, since
+    their output ends up in VRAM.
+*/
+
+Savestate* RunAheadState; // kept around so its buffer can be reused
+
+
+void Init_RunAhead()
+{
+    RunAheadState = nullptr;
+}
+
+void DeInit_RunAhead()
+{
+    delete RunAheadState;
+    RunAheadState = nullptr;
+}
+
+u32 RunAhead_Frame(int frames)
+{
+    if (frames < 1)
+        return NDS::RunFrame();
+
+    GPU::SetSkipRendering(true);
+    u32 nlines = NDS::RunFrame();
+
+    if (!RunAheadState)
+        RunAheadState = new Savestate();
+    else
+        RunAheadState->Restart();
+
+    Savestate* state = RunAheadState;
+    NDS::DoSavestate(state);
+    if (state->Error)
+    {
+        // can't go back, so just draw the next frame normally
+        GPU::SetSkipRendering(false);
+        return nlines;
+    }
+
+    SPU::SetSkipOutput(true);
+    for (int i = 0; i < frames; i++)
+    {
+        GPU::SetSkipRendering(i < (frames-1));
+        NDS::RunFrame();
+    }
+    SPU::SetSkipOutput(false);
+
+    // loading from the same savestate only restores what the frames
+    // we ran ahead changed
+    state->StartLoading();
+    if (!state->Error)
+        NDS::DoSavestate(state);
+    else
+        printf("run-ahead: failed to restore the state\n");
+
+    return nlines;
+}
+
+}
@@ -0,0 +1,253 @@
+/*
+    Copyright 2016-2021 Arisotura
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+// minimal platform layer for the headless benchmark
+// no Qt, no SDL: plain stdio and the C++ standard library
+// wireless/LAN is not supported, and there are no DLDI/SD images
+
+#include <stdio.h>
+#include <string.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "Platform.h"
+#include "Config.h"
+
+
+namespace Config
+{
+
+// the bench has no settings of its own
+ConfigEntry PlatformConfigFile[] =
+{
+    {"", -1, NULL, 0, NULL, 0}
+};
+
+}
+
+
+namespace Platform
+{
+
+void Init(int argc, char** argv)
+{
+}
+
+void DeInit()
+{
+}
+
+
+void StopEmu()
+{
+}
+
+
+int GetConfigInt(ConfigEntry entry)
+{
+    return 0;
+}
+
+bool GetConfigBool(ConfigEntry entry)
+{
+    return false;
+}
+
+std::string GetConfigString(ConfigEntry entry)
+{
+    return "";
+}
+
+
+FILE* OpenFile(const char* path, const char* mode, bool mustexist)
+{
+    if (mustexist)
+    {
+        FILE* f = fopen(path, "rb");
+        if (!f) return nullptr;
+        fclose(f);
+    }
+
+    return fopen(path, mode);
+}
+
+FILE* OpenLocalFile(const char* path, const char* mode)
+{
+    // paths are taken as-is, relative to the current directory
+    return OpenFile(path, mode, mode[0] != 'w');
+}
+
+bool RenameFile(const char* oldpath, const char* newpath)
+{
+    return rename(oldpath, newpath) == 0;
+}
+
+bool RenameLocalFile(const char* oldpath, const char* newpath)
+{
+    return RenameFile(oldpath, newpath);
+}
+
+bool RemoveFile(const char* path)
+{
+    return remove(path) == 0;
+}
+
+
+struct Thread
+{
+    std::thread Handle;
+};
+
+Thread* Thread_Create(std::function<void()> func)
+{
+    Thread* t = new Thread;
+    t->Handle = std::thread(func);
+    return t;
+}
+
+void Thread_Free(Thread* thread)
+{
+    if (thread->Handle.joinable())
+        thread->Handle.detach();
+    delete thread;
+}
+
+void Thread_Wait(Thread* thread)
+{
+    if (thread->Handle.joinable())
+        thread->Handle.join();
+}
+
+struct Semaphore
+{
+    std::mutex Lock;
+    std::condition_variable Cond;
+    int Count = 0;
+};
+
+Semaphore* Semaphore_Create()
+{
+    return new Semaphore;
+}
+
+void Semaphore_Free(Semaphore* sema)
+{
+    delete sema;
+}
+
+void Semaphore_Reset(Semaphore* sema)
+{
+    std::lock_guard<std::mutex> lock(sema->Lock);
+    sema->Count = 0;
+}
+
+void Semaphore_Wait(Semaphore* sema)
+{
+    std::unique_lock<std::mutex> lock(sema->Lock);
+    sema->Cond.wait(lock, [sema]{ return sema->Count > 0; });
+    sema->Count--;
+}
+
+void Semaphore_Post(Semaphore* sema, int count)
+{
+    {
+        std::lock_guard<std::mutex> lock(sema->Lock);
+        sema->Count += count;
+    }
+    sema->Cond.notify_all();
+}
+
+struct Mutex
+{
+    std::mutex Handle;
+};
+
+Mutex* Mutex_Create()
+{
+    return new Mutex;
+}
+
+void Mutex_Free(Mutex* mutex)
+{
+    delete mutex;
+}
+
+void Mutex_Lock(Mutex* mutex)
+{
+    mutex->Handle.lock();
+}
+
+void Mutex_Unlock(Mutex* mutex)
+{
+    mutex->Handle.unlock();
+}
+
+bool Mutex_TryLock(Mutex* mutex)
+{
+    return mutex->Handle.try_lock();
+}
+
+
+bool MP_Init()
+{
+    return false;
+}
+
+void MP_DeInit()
+{
+}
+
+int MP_SendPacket(u8* data, int len)
+{
+    return 0;
+}
+
+int MP_RecvPacket(u8* data, bool block)
+{
+    return 0;
+}
+
+bool LAN_Init()
+{
+    return false;
+}
+
+void LAN_DeInit()
+{
+}
+
+int LAN_SendPacket(u8* data, int len)
+{
+    return 0;
+}
+
+int LAN_RecvPacket(u8* data)
+{
+    return 0;
+}
+
+
+void Sleep(u64 usecs)
+{
+    std::this_thread::sleep_for(std::chrono::microseconds(usecs));
+}
+
+}
@@ -0,0 +1,416 @@
+/*
+    Copyright 2016-2021 Arisotura
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+// headless benchmark frontend
+//
+// runs the emulator core as fast as possible for a set amount of frames,
+// without any frame limiter, audio sync, video output or input, and reports
+// the throughput as a single line of JSON
+//
+// usage: melonDS-bench [options] [rom.nds]
+// if no ROM is given, the firmware is booted instead
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "Config.h"
+#include "Platform.h"
+#include "NDS.h"
+#include "DSi.h"
+#include "GPU.h"
+#include "SPU.h"
+#include "xxhash/xxhash.h"
+
+
+struct BenchOptions
+{
+    const char* ROMPath = nullptr;
+    const char* OutputPath = nullptr;
+
+    u32 Frames = 3600;
+    u32 Warmup = 60;
+
+    int ConsoleType = 0;
+    bool DirectBoot = true;
+    bool JIT = false;
+    bool Threaded3D = false;
+    bool Hash = false;
+    bool Perf = false;
+};
+
+void PrintUsage(const char* exe)
+{
+    fprintf(stderr,
+        "usage: %s [options] [rom.nds]\n"
+        "\n"
+        "  -n, --frames N       number of frames to measure (default: 3600)\n"
+        "  -w, --warmup N       number of frames to run before measuring (default: 60)\n"
+        "  -o, --output FILE    write the results to FILE instead of stdout\n"
+        "      --jit            use the JIT recompiler\n"
+        "      --threaded-3d    run the software 3D renderer on a separate thread\n"
+        "      --firmware-boot  boot the ROM through the firmware instead of direct boot\n"
+        "      --hash           include hashes of the last frame and of the audio output in the results\n"
+        "      --perf           include the time spent in each emulated subsystem in the results\n"
+        "      --bios9 FILE     external ARM9 BIOS\n"
+        "      --bios7 FILE     external ARM7 BIOS\n"
+        "      --firmware FILE  external firmware\n"
+        "      --dsi            emulate a DSi (requires the four options below)\n"
+        "      --dsi-bios9 FILE\n"
+        "      --dsi-bios7 FILE\n"
+        "      --dsi-firmware FILE\n"
+        "      --dsi-nand FILE\n",
+        exe);
+}
+
+bool ParseArgs(int argc, char** argv, BenchOptions& opt)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        const char* arg = argv[i];
+        const char* val = (i+1 < argc) ? argv[i+1] : nullptr;
+
+#define NEEDVAL() if (!val) { fprintf(stderr, "missing value for %s\n", arg); return false; } i++;
+#define STRCFG(cfg) NEEDVAL(); strncpy(cfg, val, sizeof(cfg)-1); cfg[sizeof(cfg)-1] = '\0';
+
+        if (!strcmp(arg, "-n") || !strcmp(arg, "--frames"))
+        {
+            NEEDVAL();
+            opt.Frames = strtoul(val, NULL, 0);
+        }
+        else if (!strcmp(arg, "-w") || !strcmp(arg, "--warmup"))
+        {
+            NEEDVAL();
+            opt.Warmup = strtoul(val, NULL, 0);
+        }
+        else if (!strcmp(arg, "-o") || !strcmp(arg, "--output"))
+        {
+            NEEDVAL();
+            opt.OutputPath = val;
+        }
+        else if (!strcmp(arg, "--jit"))
+            opt.JIT = true;
+        else if (!strcmp(arg, "--threaded-3d"))
+            opt.Threaded3D = true;
+        else if (!strcmp(arg, "--firmware-boot"))
+            opt.DirectBoot = false;
+        else if (!strcmp(arg, "--hash"))
+            opt.Hash = true;
+        else if (!strcmp(arg, "--perf"))
+            opt.Perf = true;
+        else if (!strcmp(arg, "--bios9"))
+        {
+            STRCFG(Config::BIOS9Path);
+            Config::ExternalBIOSEnable = 1;
+        }
+        else if (!strcmp(arg, "--bios7"))
+        {
+            STRCFG(Config::BIOS7Path);
+            Config::ExternalBIOSEnable = 1;
+        }
+        else if (!strcmp(arg, "--firmware"))
+        {
+            STRCFG(Config::FirmwarePath);
+        }
+        else if (!strcmp(arg, "--dsi"))
+            opt.ConsoleType = 1;
+        else if (!strcmp(arg, "--dsi-bios9"))
+        {
+            STRCFG(Config::DSiBIOS9Path);
+        }
+        else if (!strcmp(arg, "--dsi-bios7"))
+        {
+            STRCFG(Config::DSiBIOS7Path);
+        }
+        else if (!strcmp(arg, "--dsi-firmware"))
+        {
+            STRCFG(Config::DSiFirmwarePath);
+        }
+        else if (!strcmp(arg, "--dsi-nand"))
+        {
+            STRCFG(Config::DSiNANDPath);
+        }
+        else if (!strcmp(arg, "-h") || !strcmp(arg, "--help"))
+            return false;
+        else if (arg[0] == '-')
+        {
+            fprintf(stderr, "unknown option %s\n", arg);
+            return false;
+        }
+        else
+            opt.ROMPath = arg;
+
+#undef STRCFG
+#undef NEEDVAL
+    }
+
+    if (opt.Frames == 0)
+    {
+        fprintf(stderr, "need to run at least one frame\n");
+        return false;
+    }
+
+#ifndef JIT_ENABLED
+    if (opt.JIT)
+    {
+        fprintf(stderr, "this build was compiled without JIT support\n");
+        return false;
+    }
+#endif
+
+    return true;
+}
+
+void PrintJSONString(FILE* out, const char* str)
+{
+    fputc('"', out);
+    for (; *str; str++)
+    {
+        char c = *str;
+        if (c == '"' || c == '\\')
+            fprintf(out, "\\%c", c);
+        else if ((u8)c < 0x20)
+            fprintf(out, "\\u%04x", c);
+        else
+            fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+// names used in the JSON output, in the same order as NDS::Perf_*
+const char* PerfCounterNames[NDS::Perf_MAX] =
+{
+    "arm9",
+    "arm7",
+    "dma",
+    "gpu3d",
+    "gpu2d",
+    "rasterizer",
+    "spu",
+    "scheduler",
+    "jit",
+};
+
+double Percentile(const std::vector<double>& sorted, double p)
+{
+    // nearest-rank percentile
+    size_t rank = (size_t)(p / 100.0 * sorted.size() + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > sorted.size()) rank = sorted.size();
+    return sorted[rank - 1];
+}
+
+int main(int argc, char** argv)
+{
+    BenchOptions opt;
+
+    Platform::Init(argc, argv);
+
+    // start from the defaults, without reading melonDS.ini
+    Config::ExternalBIOSEnable = 0;
+    Config::FirmwareLanguage = 1;
+    strncpy(Config::FirmwareUsername, "melonDS", sizeof(Config::FirmwareUsername));
+    Config::RandomizeMAC = 0;
+    Config::AudioBitrate = 0;
+
+    if (!ParseArgs(argc, argv, opt))
+    {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+
+#ifdef JIT_ENABLED
+    Config::JIT_Enable = opt.JIT ? 1 : 0;
+    Config::JIT_MaxBlockSize = 32;
+    Config::JIT_BranchOptimisations = 1;
+    Config::JIT_LiteralOptimisations = 1;
+    Config::JIT_FastMemory = 1;
+#endif
+
+    if (!NDS::Init())
+    {
+        fprintf(stderr, "failed to initialize the emulator core\n");
+        return 1;
+    }
+
+    GPU::RenderSettings videoSettings;
+    videoSettings.Soft_Threaded = opt.Threaded3D;
+    videoSettings.GL_ScaleFactor = 1;
+    videoSettings.GL_BetterPolygons = false;
+
+    GPU::InitRenderer(0);
+    GPU::SetRenderSettings(0, videoSettings);
+
+    if (opt.ConsoleType == 1)
+    {
+        DSi::SDMMCFile = Platform::OpenLocalFile(Config::DSiNANDPath, "r+b");
+        if (!DSi::SDMMCFile)
+        {
+            fprintf(stderr, "DSi NAND %s not found\n", Config::DSiNANDPath);
+            return 1;
+        }
+    }
+
+    NDS::SetConsoleType(opt.ConsoleType);
+
+    if (opt.ROMPath)
+    {
+        // no SRAM file: the bench should not modify anything on disk
+        if (!NDS::LoadROM(opt.ROMPath, "", opt.DirectBoot))
+        {
+            fprintf(stderr, "failed to load ROM %s\n", opt.ROMPath);
+            return 1;
+        }
+    }
+    else
+        NDS::LoadBIOS();
+
+    for (u32 i = 0; i < opt.Warmup; i++)
+    {
+        NDS::RunFrame();
+        SPU::DrainOutput();
+    }
+
+    XXH64_state_t* audiohash = nullptr;
+    if (opt.Hash)
+    {
+        audiohash = XXH64_createState();
+        XXH64_reset(audiohash, 0);
+    }
+
+    std::vector<double> frametimes;
+    frametimes.reserve(opt.Frames);
+
+    // the counters add some overhead of their own, so they're only enabled
+    // for the measured frames when asked for
+    NDS::PerfCounters perftotal;
+    memset(&perftotal, 0, sizeof(perftotal));
+    NDS::SetPerfCountersEnabled(opt.Perf);
+
+    u64 emulines = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    auto last = start;
+    for (u32 i = 0; i < opt.Frames; i++)
+    {
+        emulines += NDS::RunFrame();
+
+        // keep the audio buffer from filling up, like an audio callback would
+        if (audiohash)
+        {
+            s16 samples[1024*2];
+            int num;
+            while ((num = SPU::ReadOutput(samples, 1024)) > 0)
+                XXH64_update(audiohash, samples, num*2*sizeof(s16));
+        }
+        else
+            SPU::DrainOutput();
+
+        if (opt.Perf)
+        {
+            NDS::PerfCounters perf;
+            NDS::GetPerfCounters(&perf);
+            for (int j = 0; j < NDS::Perf_MAX; j++)
+            {
+                perftotal.Time[j] += perf.Time[j];
+                perftotal.Calls[j] += perf.Calls[j];
+            }
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        frametimes.push_back(std::chrono::duration<double, std::milli>(now - last).count());
+        last = now;
+    }
+    double total = std::chrono::duration<double>(last - start).count();
+    NDS::SetPerfCountersEnabled(false);
+
+    u64 framehash = 0, audiohashval = 0;
+    if (opt.Hash)
+    {
+        audiohashval = XXH64_digest(audiohash);
+        XXH64_freeState(audiohash);
+
+        int fb = GPU::FrontBuffer;
+        XXH64_state_t* state = XXH64_createState();
+        XXH64_reset(state, 0);
+        XXH64_update(state, GPU::Framebuffer[fb][0], 256*192*4);
+        XXH64_update(state, GPU::Framebuffer[fb][1], 256*192*4);
+        framehash = XXH64_digest(state);
+        XXH64_freeState(state);
+    }
+
+    GPU::DeInitRenderer();
+    NDS::DeInit();
+    Platform::DeInit();
+
+    std::vector<double> sorted = frametimes;
+    std::sort(sorted.begin(), sorted.end());
+
+    double mean = (total * 1000.0) / opt.Frames;
+    // one emulated frame is 263 scanlines at 60Hz
+    double speed = (emulines / (60.0 * 263.0)) / total;
+
+    FILE* out = stdout;
+    if (opt.OutputPath)
+    {
+        out = fopen(opt.OutputPath, "w");
+        if (!out)
+        {
+            fprintf(stderr, "failed to open %s for writing\n", opt.OutputPath);
+            return 1;
+        }
+    }
+
+    fprintf(out, "{\"rom\":");
+    PrintJSONString(out, opt.ROMPath ? opt.ROMPath : "");
+    fprintf(out, ",\"console\":\"%s\",\"jit\":%s,\"threaded_3d\":%s,"
+                 "\"frames\":%u,\"seconds\":%.6f,\"fps\":%.3f,\"speed\":%.4f,"
+                 "\"frametime_ms\":{\"mean\":%.4f,\"min\":%.4f,\"p50\":%.4f,\"p95\":%.4f,\"p99\":%.4f,\"max\":%.4f}",
+        opt.ConsoleType == 1 ? "dsi" : "ds",
+        opt.JIT ? "true" : "false",
+        opt.Threaded3D ? "true" : "false",
+        opt.Frames, total, opt.Frames / total, speed,
+        mean, sorted.front(),
+        Percentile(sorted, 50), Percentile(sorted, 95), Percentile(sorted, 99),
+        sorted.back());
+    if (opt.Hash)
+        fprintf(out, ",\"frame_hash\":\"%016llx\",\"audio_hash\":\"%016llx\"",
+            (unsigned long long)framehash, (unsigned long long)audiohashval);
+    if (opt.Perf)
+    {
+        // totals over all measured frames
+        fprintf(out, ",\"perf\":{");
+        for (int i = 0; i < NDS::Perf_MAX; i++)
+        {
+            fprintf(out, "%s\"%s\":{\"ms\":%.4f,\"calls\":%u}",
+                i ? "," : "", PerfCounterNames[i],
+                perftotal.Time[i] / 1000000.0, perftotal.Calls[i]);
+        }
+        fprintf(out, "}");
+    }
+    fprintf(out, "}\n");
+
+    if (out != stdout)
+        fclose(out);
+
+    return 0;
+}
@@ -16,11 +16,20 @@
     with melonDS. If not, see http://www.gnu.org/licenses/.
 */
 
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QSaveFile>
+#include <QStandardPaths>
+
 #include "ArchiveUtil.h"
 
 namespace Archive
 {
 
+const int kMaxCachedFiles = 4;
+const int kExtractChunkSize = 0x100000;
+
+
 QVector<QString> ListArchive(const char* path)
 {
     struct archive *a;
@@ -53,60 +62,119 @@ QVector<QString> ListArchive(const char* path)
     return fileList;
 }
 
-QVector<QString> ExtractFileFromArchive(const char* path, const char* wantedFile, QByteArray *romBuffer)
+QString GetCacheDir()
 {
+    return QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/extracted";
+}
+
+// only keep the most recently extracted files around
+void TrimCache()
+{
+    QDir cache(GetCacheDir());
+    QFileInfoList entries = cache.entryInfoList(QDir::Dirs | QDir::NoDotAndDotDot, QDir::Time);
+
+    for (int i = kMaxCachedFiles; i < entries.size(); i++)
+        QDir(entries[i].absoluteFilePath()).removeRecursively();
+}
+
+QVector<QString> ExtractFileToCache(const char* path, const char* wantedFile, std::function<void(u64, u64)> progress)
+{
+    // a given file from a given archive always goes to the same place, so
+    // it only needs extracting once, and other instances can share it
+    QFileInfo archiveInfo(QString::fromUtf8(path));
+    QByteArray key = archiveInfo.absoluteFilePath().toUtf8();
+    key += '\n' + QByteArray::number(archiveInfo.size());
+    key += '\n' + QByteArray::number(archiveInfo.lastModified().toMSecsSinceEpoch());
+    key += '\n' + QByteArray(wantedFile);
+    QString hash = QCryptographicHash::hash(key, QCryptographicHash::Sha1).toHex().left(16);
+
+    QDir cacheDir(GetCacheDir() + "/" + hash);
+    QString outPath = cacheDir.filePath(QFileInfo(QString::fromUtf8(wantedFile)).fileName());
+
+    // files only appear there once they're complete
+    if (QFileInfo::exists(outPath))
+        return QVector<QString> {outPath};
+
+    if (!cacheDir.mkpath("."))
+        return QVector<QString> {"Err", "Could not create the cache directory"};
+
     struct archive *a = archive_read_new();
     struct archive_entry *entry;
     int r;
 
     archive_read_support_format_all(a);
     archive_read_support_filter_all(a);
-    
+
     r = archive_read_open_filename(a, path, 10240);
     if (r != ARCHIVE_OK)
     {
-        return QVector<QString> {"Err"};
+        archive_read_free(a);
+        return QVector<QString> {"Err", "Could not open the archive"};
     }
 
+    bool found = false;
     while (archive_read_next_header(a, &entry) == ARCHIVE_OK)
     {
         if (strcmp(wantedFile, archive_entry_pathname(entry)) == 0)
         {
+            found = true;
             break;
         }
     }
 
-    size_t bytesToWrite = archive_entry_size(entry);
-    romBuffer->fill(0, bytesToWrite);
-    ssize_t bytesRead = archive_read_data(a, romBuffer->data(), bytesToWrite);
+    if (!found)
+    {
+        archive_read_close(a);
+        archive_read_free(a);
+        return QVector<QString> {"Err", "The file was not found in the archive"};
+    }
+
+    u64 total = archive_entry_size_is_set(entry) ? archive_entry_size(entry) : 0;
+    u64 done = 0;
 
-    if (bytesRead < 0)
+    // written to a temporary file, which replaces the destination on commit()
+    QSaveFile out(outPath);
+    QString error;
+    if (!out.open(QIODevice::WriteOnly))
+        error = out.errorString();
+
+    std::unique_ptr<char[]> buffer(new char[kExtractChunkSize]);
+    while (error.isEmpty())
     {
-        printf("Error whilst reading archive: %s", archive_error_string(a));
-        return QVector<QString> {"Err", archive_error_string(a)};
+        ssize_t bytesRead = archive_read_data(a, buffer.get(), kExtractChunkSize);
+        if (bytesRead < 0)
+        {
+            printf("Error whilst reading archive: %s\n", archive_error_string(a));
+            error = archive_error_string(a);
+            break;
+        }
+        if (bytesRead == 0)
+            break;
+
+        if (out.write(buffer.get(), bytesRead) != bytesRead)
+        {
+            error = out.errorString();
+            break;
+        }
+
+        done += bytesRead;
+        if (progress) progress(done, total);
     }
 
     archive_read_close(a);
     archive_read_free(a);
-    return QVector<QString> {wantedFile};
 
-}
-
-u32 ExtractFileFromArchive(const char* path, const char* wantedFile, u8 **romdata)
-{
-    QByteArray romBuffer;
-    QVector<QString> extractResult = ExtractFileFromArchive(path, wantedFile, &romBuffer);
+    if (error.isEmpty() && !out.commit())
+        error = out.errorString();
 
-    if(extractResult[0] == "Err")
+    if (!error.isEmpty())
     {
-        return 0;
+        out.cancelWriting();
+        return QVector<QString> {"Err", error};
     }
 
-    u32 len = romBuffer.size();
-    *romdata = new u8[romBuffer.size()];
-    memcpy(*romdata, romBuffer.data(), len);
-
-    return len;
+    TrimCache();
+    return QVector<QString> {outPath};
 }
 
 }
@@ -23,6 +23,7 @@
 
 #include <string>
 #include <memory>
+#include <functional>
 
 #include <QVector>
 #include <QDir>
@@ -36,8 +37,14 @@ namespace Archive
 {
     
 QVector<QString> ListArchive(const char* path);
-QVector<QString> ExtractFileFromArchive(const char* path, const char* wantedFile, QByteArray *romBuffer);
-u32 ExtractFileFromArchive(const char* path, const char* wantedFile, u8 **romdata);
+
+// extract a file to the cache directory, so it can be loaded like a regular
+// file, without having to hold it in memory. files that were already
+// extracted are reused
+// progress is given the amount of bytes extracted so far, and the total
+// (0 if unknown)
+// returns the path of the extracted file, or {"Err", error message}
+QVector<QString> ExtractFileToCache(const char* path, const char* wantedFile, std::function<void(u64, u64)> progress = nullptr);
 
 }
 
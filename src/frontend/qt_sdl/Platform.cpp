@@ -206,14 +206,14 @@ FILE* OpenFile(const char* path, const char* mode, bool mustexist)
     return file;
 }
 
-FILE* OpenLocalFile(const char* path, const char* mode)
+QString GetLocalFilePath(const char* path)
 {
 	QDir dir(path);
     QString fullpath;
 
     if (dir.isAbsolute())
     {
-        // If it's an absolute path, just open that.
+        // If it's an absolute path, just use that.
         fullpath = path;
     }
     else
@@ -229,9 +229,37 @@ FILE* OpenLocalFile(const char* path, const char* mode)
 #endif
     }
 
+    return fullpath;
+}
+
+FILE* OpenLocalFile(const char* path, const char* mode)
+{
+    QString fullpath = GetLocalFilePath(path);
     return OpenFile(fullpath.toUtf8(), mode, mode[0] != 'w');
 }
 
+bool RenameFile(const char* oldpath, const char* newpath)
+{
+#ifdef __WIN32__
+    // rename() won't replace an existing file on Windows
+    QString from = QString::fromUtf8(oldpath);
+    QString to = QString::fromUtf8(newpath);
+    return MoveFileExW((LPCWSTR)from.utf16(), (LPCWSTR)to.utf16(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return rename(oldpath, newpath) == 0;
+#endif
+}
+
+bool RenameLocalFile(const char* oldpath, const char* newpath)
+{
+    return RenameFile(GetLocalFilePath(oldpath).toUtf8(), GetLocalFilePath(newpath).toUtf8());
+}
+
+bool RemoveFile(const char* path)
+{
+    return QFile::remove(QString::fromUtf8(path));
+}
+
 Thread* Thread_Create(std::function<void()> func)
 {
     QThread* t = QThread::create(func);
@@ -82,6 +82,13 @@ char LANDevice[128];
 int DirectLAN;
 
 int SavestateRelocSRAM;
+int SavestateCompress;
+
+int RewindEnable;
+int RewindMemoryLimit;
+int RewindInterval;
+
+int RunAheadFrames;
 
 int AudioInterp;
 int AudioVolume;
@@ -140,6 +147,7 @@ ConfigEntry PlatformConfigFile[] =
     {"HKKey_SolarSensorDecrease", 0, &HKKeyMapping[HK_SolarSensorDecrease], -1, NULL, 0},
     {"HKKey_SolarSensorIncrease", 0, &HKKeyMapping[HK_SolarSensorIncrease], -1, NULL, 0},
     {"HKKey_FrameStep",           0, &HKKeyMapping[HK_FrameStep],           -1, NULL, 0},
+    {"HKKey_Rewind",              0, &HKKeyMapping[HK_Rewind],              -1, NULL, 0},
 
     {"HKJoy_Lid",                 0, &HKJoyMapping[HK_Lid],                 -1, NULL, 0},
     {"HKJoy_Mic",                 0, &HKJoyMapping[HK_Mic],                 -1, NULL, 0},
@@ -152,6 +160,7 @@ ConfigEntry PlatformConfigFile[] =
     {"HKJoy_SolarSensorDecrease", 0, &HKJoyMapping[HK_SolarSensorDecrease], -1, NULL, 0},
     {"HKJoy_SolarSensorIncrease", 0, &HKJoyMapping[HK_SolarSensorIncrease], -1, NULL, 0},
     {"HKJoy_FrameStep",           0, &HKJoyMapping[HK_FrameStep],           -1, NULL, 0},
+    {"HKJoy_Rewind",              0, &HKJoyMapping[HK_Rewind],              -1, NULL, 0},
 
     {"JoystickID", 0, &JoystickID, 0, NULL, 0},
 
@@ -205,6 +214,13 @@ ConfigEntry PlatformConfigFile[] =
     {"DirectLAN", 0, &DirectLAN, 0, NULL, 0},
 
     {"SavStaRelocSRAM", 0, &SavestateRelocSRAM, 0, NULL, 0},
+    {"SavStaCompress", 0, &SavestateCompress, 1, NULL, 0},
+
+    {"RewindEnable", 0, &RewindEnable, 0, NULL, 0},
+    {"RewindMemoryLimit", 0, &RewindMemoryLimit, 256, NULL, 0}, // in MB
+    {"RewindInterval", 0, &RewindInterval, 1, NULL, 0},
+
+    {"RunAheadFrames", 0, &RunAheadFrames, 0, NULL, 0},
 
     {"AudioInterp", 0, &AudioInterp, 0, NULL, 0},
     {"AudioVolume", 0, &AudioVolume, 256, NULL, 0},
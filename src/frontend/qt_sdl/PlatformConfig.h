@@ -34,6 +34,7 @@ enum
     HK_SolarSensorDecrease,
     HK_SolarSensorIncrease,
     HK_FrameStep,
+    HK_Rewind,
     HK_MAX
 };
 
@@ -98,6 +99,13 @@ extern char LANDevice[128];
 extern int DirectLAN;
 
 extern int SavestateRelocSRAM;
+extern int SavestateCompress;
+
+extern int RewindEnable;
+extern int RewindMemoryLimit;
+extern int RewindInterval;
+
+extern int RunAheadFrames;
 
 extern int AudioInterp;
 extern int AudioVolume;
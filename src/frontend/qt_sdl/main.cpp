@@ -30,6 +30,7 @@
 #include <QMenuBar>
 #include <QFileDialog>
 #include <QInputDialog>
+#include <QProgressDialog>
 #include <QPaintEvent>
 #include <QPainter>
 #include <QKeyEvent>
@@ -98,8 +99,7 @@ bool videoSettingsDirty;
 
 SDL_AudioDeviceID audioDevice;
 int audioFreq;
-SDL_cond* audioSync;
-SDL_mutex* audioSyncLock;
+SDL_sem* audioSync;
 
 SDL_AudioDeviceID micDevice;
 s16 micExtBuffer[2048];
@@ -121,10 +121,11 @@ void audioCallback(void* data, Uint8* stream, int len)
     s16 buf_in[1024*2];
     int num_in;
 
-    SDL_LockMutex(audioSyncLock);
+    // reading the output doesn't lock anything, and neither does waking
+    // up the emu thread if it's waiting for the buffer to drain
     num_in = SPU::ReadOutput(buf_in, len_in);
-    SDL_CondSignal(audioSync);
-    SDL_UnlockMutex(audioSyncLock);
+    if (SDL_SemValue(audioSync) == 0)
+        SDL_SemPost(audioSync);
 
     if (num_in < 1)
     {
@@ -539,8 +540,25 @@ void EmuThread::run()
             }
 #endif
 
+            // rewind: go back one snapshot, then run a frame from there to
+            // get something to display
+            bool rewinding = Config::RewindEnable && Input::HotkeyDown(HK_Rewind);
+            if (rewinding)
+                Frontend::Rewind_Step();
+
             // emulate
-            u32 nlines = NDS::RunFrame();
+            // run-ahead is left out while rewinding, both fight over the state
+            u32 nlines;
+            if (Config::RunAheadFrames > 0 && !rewinding)
+                nlines = Frontend::RunAhead_Frame(Config::RunAheadFrames);
+            else
+                nlines = NDS::RunFrame();
+
+            if (Config::RewindEnable && !rewinding)
+            {
+                Frontend::Rewind_SetParams((u64)Config::RewindMemoryLimit << 20, Config::RewindInterval);
+                Frontend::Rewind_Frame();
+            }
 
             FrontBufferLock.lock();
             FrontBuffer = GPU::FrontBuffer;
@@ -570,13 +588,11 @@ void EmuThread::run()
 
             if (Config::AudioSync && (!fastforward) && audioDevice)
             {
-                SDL_LockMutex(audioSyncLock);
                 while (SPU::GetOutputSize() > 1024)
                 {
-                    int ret = SDL_CondWaitTimeout(audioSync, audioSyncLock, 500);
+                    int ret = SDL_SemWaitTimeout(audioSync, 500);
                     if (ret == SDL_MUTEX_TIMEDOUT) break;
                 }
-                SDL_UnlockMutex(audioSyncLock);
             }
 
             double frametimeStep = nlines / (60.0 * 263.0);
@@ -1322,6 +1338,8 @@ MainWindow::MainWindow(QWidget* parent) : QMainWindow(parent)
             actSaveState[0]->setShortcut(QKeySequence(Qt::ShiftModifier | Qt::Key_F9));
             actSaveState[0]->setData(QVariant(0));
             connect(actSaveState[0], &QAction::triggered, this, &MainWindow::onSaveState);
+
+            connect(this, &MainWindow::stateSaved, this, &MainWindow::onStateSaved, Qt::QueuedConnection);
         }
         {
             QMenu* submenu = menu->addMenu("Load state");
@@ -1625,6 +1643,8 @@ MainWindow::MainWindow(QWidget* parent) : QMainWindow(parent)
 
 MainWindow::~MainWindow()
 {
+    // pending savestate writes report back to us
+    Frontend::FlushSaveStates();
 }
 
 void MainWindow::createScreenPanel()
@@ -1780,8 +1800,8 @@ void MainWindow::dropEvent(QDropEvent* event)
     }
     else
     {
-        QByteArray romBuffer;
-        QString romFileName = pickAndExtractFileFromArchive(_filename, &romBuffer);
+        QString extractedPath;
+        QString romFileName = pickAndExtractFileFromArchive(_filename, &extractedPath);
         if(romFileName.isEmpty())
         {
            res = Frontend::Load_ROMLoadError;
@@ -1794,8 +1814,8 @@ void MainWindow::dropEvent(QDropEvent* event)
             if(slot == 0)
                 strncpy(Frontend::NDSROMExtension, QFileInfo(romFileName).suffix().toStdString().c_str(), 4);
 
-            res = Frontend::LoadROM((const u8*)romBuffer.constData(), romBuffer.size(),
-                                    _filename, romFileName.toStdString().c_str(), sramFileName.toStdString().c_str(),
+            res = Frontend::LoadROM(extractedPath.toStdString().c_str(),
+                                    _filename, sramFileName.toStdString().c_str(),
                                     slot);
         }
     }
@@ -1875,7 +1895,7 @@ QString MainWindow::loadErrorStr(int error)
     }
 }
 
-void MainWindow::loadROM(QByteArray *romData, QString archiveFileName, QString romFileName)
+void MainWindow::loadROM(QString extractedPath, QString archiveFileName, QString romFileName)
 {
     recentFileList.removeAll(archiveFileName);
     recentFileList.prepend(archiveFileName);
@@ -1890,18 +1910,18 @@ void MainWindow::loadROM(QByteArray *romData, QString archiveFileName, QString r
     if (romFileName.endsWith("gba"))
     {
         slot = 1;
-        res = Frontend::LoadROM((const u8*)romData->constData(), romData->size(),
+        res = Frontend::LoadROM(extractedPath.toStdString().c_str(),
                                 archiveFileName.toStdString().c_str(),
-                                romFileName.toStdString().c_str(), sramFileName.toStdString().c_str(),
+                                sramFileName.toStdString().c_str(),
                                 Frontend::ROMSlot_GBA);
     }
     else
     {
         strncpy(Frontend::NDSROMExtension, QFileInfo(romFileName).suffix().toStdString().c_str(), 4);
         slot = 0;
-        res = Frontend::LoadROM((const u8*)romData->constData(), romData->size(),
+        res = Frontend::LoadROM(extractedPath.toStdString().c_str(),
                                 archiveFileName.toStdString().c_str(),
-                                romFileName.toStdString().c_str(), sramFileName.toStdString().c_str(),
+                                sramFileName.toStdString().c_str(),
                                 Frontend::ROMSlot_NDS);
     }
 
@@ -2005,15 +2025,15 @@ void MainWindow::onOpenFileArchive()
         return;
     }
 
-    QByteArray romBuffer;
-    QString romFileName = pickAndExtractFileFromArchive(archiveFileName, &romBuffer);
+    QString extractedPath;
+    QString romFileName = pickAndExtractFileFromArchive(archiveFileName, &extractedPath);
     if(!romFileName.isEmpty())
     {
-        loadROM(&romBuffer, archiveFileName, romFileName);
+        loadROM(extractedPath, archiveFileName, romFileName);
     }
 }
 
-QString MainWindow::pickAndExtractFileFromArchive(QString archiveFileName, QByteArray *romBuffer)
+QString MainWindow::pickAndExtractFileFromArchive(QString archiveFileName, QString *extractedPath)
 {
     printf("Finding list of ROMs...\n");
     QVector<QString> archiveROMList = Archive::ListArchive(archiveFileName.toUtf8().constData());
@@ -2032,38 +2052,49 @@ QString MainWindow::pickAndExtractFileFromArchive(QString archiveFileName, QByte
             return QString();
 
         printf("Extracting '%s'\n", toLoad.toUtf8().constData());
-        QVector<QString> extractResult = Archive::ExtractFileFromArchive(archiveFileName.toUtf8().constData(), toLoad.toUtf8().constData(), romBuffer);
-        if (extractResult[0] != QString("Err"))
-        {
-            romFileName = extractResult[0];
-        }
-        else
-        {
-            QMessageBox::critical(this, "melonDS", QString("There was an error while trying to extract the ROM from the archive: ") + extractResult[1]);
-        }
+        romFileName = toLoad;
     }
     else if (archiveROMList.size() == 2)
     {
         printf("Extracting the only ROM in archive\n");
-        QVector<QString> extractResult = Archive::ExtractFileFromArchive(archiveFileName.toUtf8().constData(), archiveROMList.at(1).toUtf8().constData(), romBuffer);
-        if (extractResult[0] != QString("Err"))
-        {
-            romFileName = extractResult[0];
-        }
-        else
-        {
-            QMessageBox::critical(this, "melonDS", QString("There was an error while trying to extract the ROM from the archive: ") + extractResult[1]);
-        }
+        romFileName = archiveROMList.at(1);
     }
     else if ((archiveROMList.size() == 1) && (archiveROMList[0] == QString("OK")))
     {
         QMessageBox::warning(this, "melonDS", "The archive is intact, but there are no files inside.");
+        return QString();
     }
     else
     {
         QMessageBox::critical(this, "melonDS", "The archive could not be read. It may be corrupt or you don't have the permissions.");
+        return QString();
     }
 
+    QProgressDialog progress("Extracting " + QFileInfo(romFileName).fileName() + "...", QString(), 0, 100, this);
+    progress.setWindowModality(Qt::WindowModal);
+    progress.setMinimumDuration(500);
+
+    QVector<QString> extractResult = Archive::ExtractFileToCache(archiveFileName.toUtf8().constData(), romFileName.toUtf8().constData(),
+                                                                 [&](u64 done, u64 total)
+    {
+        // a modal progress dialog processes events when its value changes
+        if (total)
+            progress.setValue((int)((done * 100) / total));
+        else
+        {
+            progress.setRange(0, 0);
+            progress.setValue(0);
+        }
+    });
+    progress.reset();
+
+    if (extractResult[0] == QString("Err"))
+    {
+        QMessageBox::critical(this, "melonDS", QString("There was an error while trying to extract the ROM from the archive: ") + extractResult[1]);
+        return QString();
+    }
+
+    *extractedPath = extractResult[0];
     return romFileName;
 }
 
@@ -2138,12 +2169,12 @@ void MainWindow::onClickRecentFile()
     {
         // Archives
         QString archiveFileName = fileName;
-        QByteArray romBuffer;
-        QString romFileName = MainWindow::pickAndExtractFileFromArchive(archiveFileName, &romBuffer);
+        QString extractedPath;
+        QString romFileName = MainWindow::pickAndExtractFileFromArchive(archiveFileName, &extractedPath);
         if(!romFileName.isEmpty())
         {
             emuThread->emuPause();
-            loadROM(&romBuffer, archiveFileName, romFileName);
+            loadROM(extractedPath, archiveFileName, romFileName);
         }
     }
 }
@@ -2195,7 +2226,18 @@ void MainWindow::onSaveState()
         strncpy(filename, qfilename.toStdString().c_str(), 1023); filename[1023] = '\0';
     }
 
-    if (Frontend::SaveState(filename))
+    // the file is written in the background, the result comes back through onStateSaved()
+    if (!Frontend::SaveState(filename, [this, slot](bool success) { emit stateSaved(slot, success); }))
+    {
+        OSD::AddMessage(0xFFA0A0, "State save failed");
+    }
+
+    emuThread->emuUnpause();
+}
+
+void MainWindow::onStateSaved(int slot, bool success)
+{
+    if (success)
     {
         char msg[64];
         if (slot > 0) sprintf(msg, "State saved to slot %d", slot);
@@ -2208,8 +2250,6 @@ void MainWindow::onSaveState()
     {
         OSD::AddMessage(0xFFA0A0, "State save failed");
     }
-
-    emuThread->emuUnpause();
 }
 
 void MainWindow::onLoadState()
@@ -2830,8 +2870,7 @@ int main(int argc, char** argv)
     format.setSwapInterval(0);
     QSurfaceFormat::setDefaultFormat(format);
 
-    audioSync = SDL_CreateCond();
-    audioSyncLock = SDL_CreateMutex();
+    audioSync = SDL_CreateSemaphore(0);
 
     audioFreq = 48000; // TODO: make configurable?
     SDL_AudioSpec whatIwant, whatIget;
@@ -2862,6 +2901,8 @@ int main(int argc, char** argv)
 
     Frontend::Init_ROM();
     Frontend::EnableCheats(Config::EnableCheats != 0);
+    Frontend::Init_Rewind((u64)Config::RewindMemoryLimit << 20, Config::RewindInterval);
+    Frontend::Init_RunAhead();
 
     Frontend::Init_Audio(audioFreq);
 
@@ -2922,12 +2963,13 @@ int main(int argc, char** argv)
     Input::CloseJoystick();
 
     Frontend::DeInit_ROM();
+    Frontend::DeInit_Rewind();
+    Frontend::DeInit_RunAhead();
 
     if (audioDevice) SDL_CloseAudioDevice(audioDevice);
     micClose();
 
-    SDL_DestroyCond(audioSync);
-    SDL_DestroyMutex(audioSyncLock);
+    SDL_DestroySemaphore(audioSync);
 
     if (micWavBuffer) delete[] micWavBuffer;
 
@@ -211,7 +211,7 @@ public:
     QOpenGLContext* getOGLContext();
 
     void loadROM(QString filename);
-    void loadROM(QByteArray *romData, QString archiveFileName, QString romFileName);
+    void loadROM(QString extractedPath, QString archiveFileName, QString romFileName);
 
     void onAppStateChanged(Qt::ApplicationState state);
 
@@ -227,6 +227,7 @@ protected:
 
 signals:
     void screenLayoutChange();
+    void stateSaved(int slot, bool success);
 
 private slots:
     void onOpenFile();
@@ -235,6 +236,7 @@ private slots:
     void onClearRecentFiles();
     void onBootFirmware();
     void onSaveState();
+    void onStateSaved(int slot, bool success);
     void onLoadState();
     void onUndoStateLoad();
     void onImportSavefile();
@@ -294,7 +296,7 @@ private:
     QMenu *recentMenu;
     void updateRecentFilesMenu();
 
-    QString pickAndExtractFileFromArchive(QString archiveFileName, QByteArray *romBuffer);
+    QString pickAndExtractFileFromArchive(QString archiveFileName, QString *extractedPath);
 
     void createScreenPanel();
 
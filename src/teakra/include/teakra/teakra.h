@@ -27,6 +27,9 @@ public:
 
     std::array<std::uint8_t, 0x80000>& GetDspMemory();
     const std::array<std::uint8_t, 0x80000>& GetDspMemory() const;
+    // must be called after writing program memory through GetDspMemory(), with the word
+    // address and length of what was written
+    void InvalidateProgramCache(std::uint32_t address, std::uint32_t length);
 
     // APBP Data
     bool SendDataIsEmpty(std::uint8_t index) const;
@@ -69,6 +72,9 @@ public:
 
     // core
     void Run(unsigned cycle);
+    // how many cycles the core will sit in an idle loop before a timer or BTDMP event can wake
+    // it up, 0 if it isn't idle. Anything sent to it in the meantime can wake it up earlier.
+    std::uint64_t GetIdleCycles() const;
 
     void SetAHBMCallback(const AHBMCallback& callback);
 
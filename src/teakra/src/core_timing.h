@@ -26,14 +26,25 @@ public:
     }
 
     u64 Skip(u64 maximum) {
-        u64 ticks = maximum;
+        u64 ticks = std::min(maximum, GetMaxSkip());
+        Advance(ticks);
+        return ticks;
+    }
+
+    // Number of ticks that can go by before any component has something to do
+    u64 GetMaxSkip() const {
+        u64 ticks = Callbacks::Infinity;
         for (const auto& callbacks : registered_callbacks) {
             ticks = std::min(ticks, callbacks->GetMaxSkip());
         }
+        return ticks;
+    }
+
+    // Applies ticks that were deferred, which must not be more than GetMaxSkip() allowed
+    void Advance(u64 ticks) {
         for (const auto& callbacks : registered_callbacks) {
             callbacks->Skip(ticks);
         }
-        return ticks;
     }
 
     void RegisterCallbacks(Callbacks* callbacks) {
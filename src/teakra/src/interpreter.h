@@ -1,10 +1,12 @@
 #pragma once
+#include <algorithm>
 #include <atomic>
 #include <stdexcept>
 #include <tuple>
 #include <type_traits>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 #include "bit.h"
 #include "core_timing.h"
 #include "crash.h"
@@ -62,6 +64,7 @@ public:
         idle = false;
         for (u64 i = 0; i < cycles; ++i) {
             if (idle) {
+                SyncTiming();
                 u64 skipped = core_timing.Skip(cycles - i - 1);
                 i += skipped;
 
@@ -72,22 +75,33 @@ public:
                 }
             }
 
-            for (std::size_t i = 0; i < 3; ++i) {
-                if (interrupt_pending[i].exchange(false)) {
-                    regs.ip[i] = 1;
+            // the flags are only exchanged when something was signalled since the last check
+            if (any_interrupt_pending.load(std::memory_order_relaxed) &&
+                any_interrupt_pending.exchange(false)) {
+                for (std::size_t i = 0; i < 3; ++i) {
+                    if (interrupt_pending[i].exchange(false)) {
+                        regs.ip[i] = 1;
+                    }
                 }
-            }
 
-            if (vinterrupt_pending.exchange(false)) {
-                regs.ipv = 1;
+                if (vinterrupt_pending.exchange(false)) {
+                    regs.ipv = 1;
+                }
             }
 
-            u16 opcode = mem.ProgramRead((regs.pc++) | (regs.prpage << 18));
-            auto& decoder = decoders[opcode];
-            u16 expand_value = 0;
-            if (decoder.NeedExpansion()) {
-                expand_value = mem.ProgramRead((regs.pc++) | (regs.prpage << 18));
+            u32 fetch_address = regs.pc | (regs.prpage << 18);
+            const DecodedInstruction* inst;
+            DecodedInstruction uncached;
+            if (fetch_address + 1 < ProgramCacheSize) {
+                inst = &program_cache[fetch_address];
+                if (!inst->decoder) {
+                    Decode(program_cache[fetch_address], fetch_address);
+                }
+            } else {
+                Decode(uncached, fetch_address);
+                inst = &uncached;
             }
+            regs.pc += inst->decoder->NeedExpansion() ? 2 : 1;
 
             if (regs.rep) {
                 if (regs.repc == 0) {
@@ -108,7 +122,7 @@ public:
                 }
             }
 
-            decoder.call(*this, opcode, expand_value);
+            inst->decoder->call_unchecked(*this, inst->opcode, inst->expansion);
 
             // I am not sure if a single-instruction loop is interruptable and how it is handled,
             // so just disable interrupt for it for now.
@@ -140,17 +154,49 @@ public:
                 }
             }
 
-            core_timing.Tick();
+            Tick();
         }
+        SyncTiming();
     }
 
     void SignalInterrupt(u32 i) {
         interrupt_pending[i] = true;
+        any_interrupt_pending = true;
     }
     void SignalVectoredInterrupt(u32 address, bool context_switch) {
         vinterrupt_address = address;
         vinterrupt_pending = true;
         vinterrupt_context_switch = context_switch;
+        any_interrupt_pending = true;
+    }
+
+    // Number of cycles the core will spend waiting in an idle loop before one of the components
+    // has something to do, or 0 if it is running code or has an interrupt to take.
+    u64 GetIdleCycles() const {
+        if (!idle || any_interrupt_pending.load(std::memory_order_relaxed))
+            return 0;
+        return core_timing.GetMaxSkip();
+    }
+
+    // Applies the ticks that were deferred so far. This has to happen before anything outside
+    // of the core looks at the state of the timers and BTDMP, that is before any MMIO access.
+    void SyncTiming() {
+        if (pending_ticks != 0) {
+            core_timing.Advance(pending_ticks);
+            pending_ticks = 0;
+        }
+        // what happens next may change the components' plans, so ask them again on the next tick
+        tick_budget = 0;
+    }
+
+    // Drops the decoded instructions covering program memory words [address, address + length)
+    void InvalidateProgramCache(u32 address, u32 length) {
+        // an instruction with an expansion word also depends on the word after it
+        u32 start = address != 0 ? address - 1 : 0;
+        u32 end = std::min<u32>(address + length, ProgramCacheSize);
+        for (u32 a = start; a < end; ++a) {
+            program_cache[a].decoder = nullptr;
+        }
     }
 
     using instruction_return_type = void;
@@ -2936,11 +2982,46 @@ private:
 
     std::array<std::atomic<bool>, 3> interrupt_pending{{false, false, false}};
     std::atomic<bool> vinterrupt_pending{false};
+    std::atomic<bool> any_interrupt_pending{false};
     std::atomic<bool> vinterrupt_context_switch;
     std::atomic<u32> vinterrupt_address;
 
     bool idle = false;
 
+    // Ticks are not passed to the components one by one. As long as none of them has something
+    // to do, they are counted and applied all at once by SyncTiming().
+    u64 pending_ticks = 0;
+    u64 tick_budget = 0;
+
+    void Tick() {
+        if (pending_ticks < tick_budget) {
+            ++pending_ticks;
+            return;
+        }
+        SyncTiming();
+        core_timing.Tick();
+        tick_budget = core_timing.GetMaxSkip();
+    }
+
+    // Instructions in program memory are decoded once and kept until something writes over
+    // them. Program memory ends where data memory begins; anything fetched past that is
+    // decoded every time, as data writes don't invalidate the cache.
+    struct DecodedInstruction {
+        const Matcher<Interpreter>* decoder = nullptr; // null if not decoded yet
+        u16 opcode = 0;
+        u16 expansion = 0;
+    };
+    static constexpr u32 ProgramCacheSize = MemoryInterfaceUnit::DataMemoryOffset;
+    std::vector<DecodedInstruction> program_cache =
+        std::vector<DecodedInstruction>(ProgramCacheSize);
+
+    void Decode(DecodedInstruction& inst, u32 address) {
+        inst.opcode = mem.ProgramRead(address);
+        inst.decoder = &decoders[inst.opcode];
+        inst.expansion = inst.decoder->NeedExpansion() ? mem.ProgramRead(address + 1) : 0;
+        ASSERT(inst.decoder->Matches(inst.opcode));
+    }
+
     u64 GetAcc(RegName name) const {
         switch (name) {
         case RegName::a0:
@@ -55,6 +55,12 @@ public:
         return fn(v, instruction, instruction_expansion);
     }
 
+    // for instructions that were already checked against Matches() when they were decoded
+    handler_return_type call_unchecked(Visitor& v, u16 instruction,
+                                       u16 instruction_expansion = 0) const {
+        return fn(v, instruction, instruction_expansion);
+    }
+
 private:
     const char* name;
     u16 mask;
@@ -10,16 +10,26 @@ MemoryInterface::MemoryInterface(SharedMemory& shared_memory,
 void MemoryInterface::SetMMIO(MMIORegion& mmio) {
     this->mmio = &mmio;
 }
+void MemoryInterface::SetProgramWriteHandler(std::function<void(u32 address)> handler) {
+    program_write_handler = std::move(handler);
+}
+void MemoryInterface::SetMMIOAccessHandler(std::function<void()> handler) {
+    mmio_access_handler = std::move(handler);
+}
 
 u16 MemoryInterface::ProgramRead(u32 address) const {
     return shared_memory.ReadWord(address);
 }
 void MemoryInterface::ProgramWrite(u32 address, u16 value) {
     shared_memory.WriteWord(address, value);
+    if (program_write_handler)
+        program_write_handler(address);
 }
 u16 MemoryInterface::DataRead(u16 address, bool bypass_mmio) {
     if (memory_interface_unit.InMMIO(address) && !bypass_mmio) {
         ASSERT(mmio != nullptr);
+        if (mmio_access_handler)
+            mmio_access_handler();
         return mmio->Read(memory_interface_unit.ToMMIO(address));
     }
     u32 converted = memory_interface_unit.ConvertDataAddress(address);
@@ -29,6 +39,8 @@ u16 MemoryInterface::DataRead(u16 address, bool bypass_mmio) {
 void MemoryInterface::DataWrite(u16 address, u16 value, bool bypass_mmio) {
     if (memory_interface_unit.InMMIO(address) && !bypass_mmio) {
         ASSERT(mmio != nullptr);
+        if (mmio_access_handler)
+            mmio_access_handler();
         return mmio->Write(memory_interface_unit.ToMMIO(address), value);
     }
     u32 converted = memory_interface_unit.ConvertDataAddress(address);
@@ -46,11 +58,15 @@ void MemoryInterface::DataWriteA32(u32 address, u16 value) {
 }
 u16 MemoryInterface::MMIORead(u16 address) {
     ASSERT(mmio != nullptr);
+    if (mmio_access_handler)
+        mmio_access_handler();
     // according to GBATek ("DSi Teak I/O Ports (on ARM9 Side)"), these are mirrored
     return mmio->Read(address & (MemoryInterfaceUnit::MMIOSize - 1));
 }
 void MemoryInterface::MMIOWrite(u16 address, u16 value) {
     ASSERT(mmio != nullptr);
+    if (mmio_access_handler)
+        mmio_access_handler();
     mmio->Write(address & (MemoryInterfaceUnit::MMIOSize - 1), value);
 }
 
@@ -1,4 +1,5 @@
 #include "interpreter.h"
+#include "memory_interface.h"
 #include "processor.h"
 #include "register.h"
 
@@ -6,7 +7,11 @@ namespace Teakra {
 
 struct Processor::Impl {
     Impl(CoreTiming& core_timing, MemoryInterface& memory_interface)
-        : core_timing(core_timing), interpreter(core_timing, regs, memory_interface) {}
+        : core_timing(core_timing), interpreter(core_timing, regs, memory_interface) {
+        memory_interface.SetProgramWriteHandler(
+            [this](u32 address) { interpreter.InvalidateProgramCache(address, 1); });
+        memory_interface.SetMMIOAccessHandler([this]() { interpreter.SyncTiming(); });
+    }
     CoreTiming& core_timing;
     RegisterState regs;
     Interpreter interpreter;
@@ -18,6 +23,7 @@ Processor::~Processor() = default;
 
 void Processor::Reset() {
     impl->regs = RegisterState();
+    impl->interpreter.InvalidateProgramCache(0, 0x40000);
 }
 
 void Processor::Run(unsigned cycles) {
@@ -31,4 +37,12 @@ void Processor::SignalVectoredInterrupt(u32 address, bool context_switch) {
     impl->interpreter.SignalVectoredInterrupt(address, context_switch);
 }
 
+u64 Processor::GetIdleCycles() const {
+    return impl->interpreter.GetIdleCycles();
+}
+
+void Processor::InvalidateProgramCache(u32 address, u32 length) {
+    impl->interpreter.InvalidateProgramCache(address, length);
+}
+
 } // namespace Teakra
@@ -16,6 +16,8 @@ public:
     void Run(unsigned cycles);
     void SignalInterrupt(u32 i);
     void SignalVectoredInterrupt(u32 address, bool context_switch);
+    void InvalidateProgramCache(u32 address, u32 length);
+    u64 GetIdleCycles() const;
 
 private:
     struct Impl;
@@ -79,10 +79,18 @@ const std::array<std::uint8_t, 0x80000>& Teakra::GetDspMemory() const {
     return impl->shared_memory.raw;
 }
 
+void Teakra::InvalidateProgramCache(std::uint32_t address, std::uint32_t length) {
+    impl->processor.InvalidateProgramCache(address, length);
+}
+
 void Teakra::Run(unsigned cycle) {
     impl->processor.Run(cycle);
 }
 
+std::uint64_t Teakra::GetIdleCycles() const {
+    return impl->processor.GetIdleCycles();
+}
+
 bool Teakra::SendDataIsEmpty(std::uint8_t index) const {
     return !impl->apbp_from_cpu.IsDataReady(index);
 }